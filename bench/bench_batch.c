@@ -0,0 +1,88 @@
+/*
+ * Building and tearing down graphs of same-sized nodes: one deep_pool_malloc
+ * / deep_pool_free per node versus deep_pool_malloc_batch /
+ * deep_pool_free_batch per graph, for fast-bin and sorted-block sizes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "deep_mem.h"
+
+#define POOL_SIZE (64 * 1024 * 1024)
+#define GRAPH_NODES (512)
+#define ROUNDS (2000)
+
+static void *nodes[GRAPH_NODES];
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double
+run_single (mem_pool_t *pool, uint32_t size)
+{
+  double start = now_ns ();
+
+  for (int round = 0; round < ROUNDS; round++)
+    {
+      for (int i = 0; i < GRAPH_NODES; i++)
+        {
+          nodes[i] = deep_pool_malloc (pool, size);
+        }
+      for (int i = 0; i < GRAPH_NODES; i++)
+        {
+          deep_pool_free (pool, nodes[i]);
+        }
+    }
+  return (now_ns () - start) / ((double)ROUNDS * GRAPH_NODES);
+}
+
+static double
+run_batch (mem_pool_t *pool, uint32_t size)
+{
+  double start = now_ns ();
+
+  for (int round = 0; round < ROUNDS; round++)
+    {
+      if (deep_pool_malloc_batch (pool, size, GRAPH_NODES, nodes)
+          != GRAPH_NODES)
+        {
+          fprintf (stderr, "batch of %d x %u bytes failed\n", GRAPH_NODES,
+                   size);
+          exit (1);
+        }
+      deep_pool_free_batch (pool, nodes, GRAPH_NODES);
+    }
+  return (now_ns () - start) / ((double)ROUNDS * GRAPH_NODES);
+}
+
+int
+main (void)
+{
+  static const uint32_t sizes[] = { 24, 56, 120, 1000 };
+  void *mem = malloc (POOL_SIZE);
+
+  if (mem == NULL)
+    {
+      fprintf (stderr, "cannot set up a %d-byte pool\n", POOL_SIZE);
+      return 1;
+    }
+
+  printf ("%8s %16s %16s\n", "size", "single ns/node", "batch ns/node");
+  for (size_t i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    {
+      /* a fresh pool each time, so both runs start from the remainder */
+      double single = run_single (deep_pool_init (mem, POOL_SIZE), sizes[i]);
+      double batch = run_batch (deep_pool_init (mem, POOL_SIZE), sizes[i]);
+      printf ("%8u %16.1f %16.1f\n", sizes[i], single, batch);
+    }
+
+  free (mem);
+  return 0;
+}
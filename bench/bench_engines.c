@@ -0,0 +1,161 @@
+/*
+ * Sorted-block engines on the same traces: one skiplist pool and one TLSF
+ * pool replay identical malloc/free sequences of blocks bigger than the
+ * fast bins; per-operation latency (mean, p99, max) and failures are
+ * reported for each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "deep_mem.h"
+
+#define POOL_SIZE (64 * 1024 * 1024)
+#define TRACE_LENGTH (1000000)
+#define LIVE_SLOTS (4096)
+
+typedef struct
+{
+  const char *name;
+  uint32_t min_size;
+  uint32_t max_size;
+} trace_t;
+
+static const trace_t traces[] = {
+  { "small 72-512", 72, 512 },
+  { "medium 72-4K", 72, 4096 },
+  { "large 1K-64K", 1024, 65536 },
+};
+
+static uint32_t *trace_slots;
+static uint32_t *trace_sizes;
+static uint64_t *malloc_ns;
+static uint64_t *free_ns;
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void
+make_trace (trace_t const *trace, uint32_t seed)
+{
+  uint32_t span = trace->max_size - trace->min_size + 1;
+
+  for (int i = 0; i < TRACE_LENGTH; i++)
+    {
+      seed = seed * 1103515245u + 12345u;
+      trace_slots[i] = (seed >> 8) % LIVE_SLOTS;
+      seed = seed * 1103515245u + 12345u;
+      trace_sizes[i] = trace->min_size + (seed >> 8) % span;
+    }
+}
+
+static void
+report (const char *what, uint64_t *samples, int count)
+{
+  uint64_t sum = 0;
+
+  if (count == 0)
+    {
+      printf ("  %-7s %10s\n", what, "-");
+      return;
+    }
+  for (int i = 0; i < count; i++)
+    {
+      sum += samples[i];
+    }
+  qsort (samples, count, sizeof (uint64_t), compare_u64);
+  printf ("  %-7s %10.1f %10llu %10llu", what, (double)sum / count,
+          (unsigned long long)samples[count * 99 / 100],
+          (unsigned long long)samples[count - 1]);
+}
+
+static void
+replay (const char *engine_name, mem_engine_t engine, void *mem)
+{
+  mem_pool_config_t config = { .engine = engine };
+  mem_pool_t *pool = deep_pool_init_with_config (mem, POOL_SIZE, &config);
+  void *slots[LIVE_SLOTS] = { NULL };
+  int mallocs = 0, frees = 0, failures = 0;
+
+  if (pool == NULL)
+    {
+      fprintf (stderr, "cannot set up a %d-byte pool\n", POOL_SIZE);
+      exit (1);
+    }
+  for (int i = 0; i < TRACE_LENGTH; i++)
+    {
+      uint32_t slot = trace_slots[i];
+      uint64_t start;
+
+      if (slots[slot] != NULL)
+        {
+          start = now_ns ();
+          deep_pool_free (pool, slots[slot]);
+          free_ns[frees++] = now_ns () - start;
+          slots[slot] = NULL;
+          continue;
+        }
+      start = now_ns ();
+      slots[slot] = deep_pool_malloc (pool, trace_sizes[i]);
+      malloc_ns[mallocs++] = now_ns () - start;
+      failures += slots[slot] == NULL;
+    }
+
+  printf ("%-9s", engine_name);
+  report ("malloc", malloc_ns, mallocs);
+  report ("free", free_ns, frees);
+  printf ("  %8d\n", failures);
+  deep_pool_destroy (pool);
+}
+
+int
+main (void)
+{
+  void *mem = malloc (POOL_SIZE);
+
+  trace_slots = malloc (TRACE_LENGTH * sizeof (uint32_t));
+  trace_sizes = malloc (TRACE_LENGTH * sizeof (uint32_t));
+  malloc_ns = malloc (TRACE_LENGTH * sizeof (uint64_t));
+  free_ns = malloc (TRACE_LENGTH * sizeof (uint64_t));
+  if (mem == NULL || trace_slots == NULL || trace_sizes == NULL
+      || malloc_ns == NULL || free_ns == NULL)
+    {
+      fprintf (stderr, "out of memory\n");
+      return 1;
+    }
+
+  for (size_t t = 0; t < sizeof (traces) / sizeof (traces[0]); t++)
+    {
+      make_trace (&traces[t], (uint32_t)t + 1);
+      printf ("trace %s, %d ops, %d live slots (latency in ns)\n",
+              traces[t].name, TRACE_LENGTH, LIVE_SLOTS);
+      printf ("%-9s  %-7s %10s %10s %10s  %-7s %10s %10s %10s  %8s\n",
+              "engine", "", "mean", "p99", "max", "", "mean", "p99", "max",
+              "failures");
+      replay ("skiplist", MEM_ENGINE_SKIPLIST, mem);
+      replay ("tlsf", MEM_ENGINE_TLSF, mem);
+      printf ("\n");
+    }
+
+  free (mem);
+  free (trace_slots);
+  free (trace_sizes);
+  free (malloc_ns);
+  free (free_ns);
+  return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Caller-side cost of deep_info: recording into the per-thread ring versus
+ * the synchronous log_printf it replaced. Output goes to /dev/null so only
+ * the formatting and write path is measured.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "deep_log.h"
+
+#define MESSAGES (1000000)
+/* small enough that a batch never fills the ring */
+#define BATCH (1000)
+
+static double
+elapsed_ns (struct timespec const *start, struct timespec const *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9
+         + (end->tv_nsec - start->tv_nsec);
+}
+
+int
+main (void)
+{
+  struct timespec start, end;
+  double recorded = 0, flushed = 0, synchronous;
+  int dummy = 0;
+
+  if (freopen ("/dev/null", "w", stdout) == NULL)
+    {
+      return 1;
+    }
+
+  for (int i = 0; i < MESSAGES; i += BATCH)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      for (int j = i; j < i + BATCH; j++)
+        {
+          deep_info ("malloc %d times, @%p", j, (void *)&dummy);
+        }
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      recorded += elapsed_ns (&start, &end);
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      log_flush ();
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      flushed += elapsed_ns (&start, &end);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < MESSAGES; i++)
+    {
+      log_printf (__FILE__, __LINE__, __FUNCTION__, "<info>",
+                  "malloc %d times, @%p", i, (void *)&dummy);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  synchronous = elapsed_ns (&start, &end);
+
+  fprintf (stderr, "%-28s %10s\n", "", "ns/message");
+  fprintf (stderr, "%-28s %10.1f\n", "deep_info (record)",
+           recorded / MESSAGES);
+  fprintf (stderr, "%-28s %10.1f\n", "log_flush (format + write)",
+           flushed / MESSAGES);
+  fprintf (stderr, "%-28s %10.1f\n", "log_printf (synchronous)",
+           synchronous / MESSAGES);
+  return 0;
+}
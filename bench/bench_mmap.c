@@ -0,0 +1,114 @@
+/*
+ * Huge blocks carved from the pool versus mapped on their own
+ * (mem_pool_config_t.mmap_threshold): the cost of growing one buffer by
+ * realloc up to GROW_MAX bytes, and how fragmented the pool is left by
+ * short-lived huge blocks allocated between long-lived small ones.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "deep_mem.h"
+
+#define POOL_SIZE (512 * 1024 * 1024)
+#define MMAP_THRESHOLD (128 * 1024)
+#define GROW_STEP (64 * 1024)
+#define GROW_MAX (64 * 1024 * 1024)
+#define HUGE_SIZE (8 * 1024 * 1024)
+#define HUGE_ROUNDS (64)
+#define SMALL_SIZE (200)
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Grow a buffer by GROW_STEP at a time, a small block being allocated after
+ * each step so that the buffer cannot always grow in place. */
+static double
+run_grow (mem_pool_t *pool)
+{
+  static void *smalls[GROW_MAX / GROW_STEP];
+  uint8_t *buf = NULL;
+  uint32_t steps = 0;
+  double start = now_ns ();
+
+  for (uint32_t size = GROW_STEP; size <= GROW_MAX; size += GROW_STEP)
+    {
+      if ((buf = deep_pool_realloc (pool, buf, size)) == NULL)
+        {
+          fprintf (stderr, "realloc to %u bytes failed\n", size);
+          exit (1);
+        }
+      buf[size - 1] = 1;
+      smalls[steps++] = deep_pool_malloc (pool, SMALL_SIZE);
+    }
+  double ns = (now_ns () - start) / steps;
+
+  deep_pool_free (pool, buf);
+  for (uint32_t i = 0; i < steps; i++)
+    {
+      deep_pool_free (pool, smalls[i]);
+    }
+  return ns;
+}
+
+/* Allocate and free huge blocks, leaving a small block behind each time;
+ * returns the fragmentation of the pool at the end. */
+static double
+run_huge (mem_pool_t *pool, double *ns)
+{
+  mem_stats_t stats;
+  double start = now_ns ();
+
+  for (int round = 0; round < HUGE_ROUNDS; round++)
+    {
+      void *huge = deep_pool_malloc (pool, HUGE_SIZE);
+      if (huge == NULL || deep_pool_malloc (pool, SMALL_SIZE) == NULL)
+        {
+          fprintf (stderr, "round %d failed\n", round);
+          exit (1);
+        }
+      memset (huge, round, HUGE_SIZE);
+      deep_pool_free (pool, huge);
+    }
+  *ns = (now_ns () - start) / HUGE_ROUNDS;
+
+  deep_pool_stats (pool, &stats);
+  return stats.fragmentation;
+}
+
+int
+main (void)
+{
+  void *mem = malloc (POOL_SIZE);
+
+  if (mem == NULL)
+    {
+      fprintf (stderr, "cannot set up a %d-byte pool\n", POOL_SIZE);
+      return 1;
+    }
+
+  printf ("%10s %16s %16s %12s\n", "", "realloc ns/step", "huge ns/round",
+          "huge frag");
+  for (int mapped = 0; mapped < 2; mapped++)
+    {
+      mem_pool_config_t config
+          = { .mmap_threshold = mapped ? MMAP_THRESHOLD : 0 };
+      double grow
+          = run_grow (deep_pool_init_with_config (mem, POOL_SIZE, &config));
+      double huge_ns;
+      double frag = run_huge (
+          deep_pool_init_with_config (mem, POOL_SIZE, &config), &huge_ns);
+      printf ("%10s %16.0f %16.0f %11.1f%%\n", mapped ? "mapped" : "in pool",
+              grow, huge_ns, frag * 100);
+    }
+
+  free (mem);
+  return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Standard containers on deep_mem pools: the same container workloads
+ * with the default allocator (global operator new), with std::pmr
+ * containers on a deep::pool_resource over a skiplist and a TLSF pool, and
+ * with deep::pool_allocator on a TLSF pool. Reports ns per element.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include "deep_mem_resource.hpp"
+
+#define POOL_SIZE (256u << 20)
+#define ELEMENTS (200000)
+#define ROUNDS (5)
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline uint32_t
+next_seed (uint32_t seed)
+{
+  return seed * 1103515245u + 12345u;
+}
+
+/* push_back without reserve, then drop the vector */
+template <typename Vector, typename Alloc>
+static void
+vector_grow (const Alloc &alloc)
+{
+  Vector v (alloc);
+
+  for (uint32_t i = 0; i < ELEMENTS; i++)
+    {
+      v.push_back (i);
+    }
+}
+
+/* fill a list, then erase and reinsert nodes all along it */
+template <typename List, typename Alloc>
+static void
+list_churn (const Alloc &alloc)
+{
+  List l (alloc);
+
+  for (uint32_t i = 0; i < ELEMENTS; i++)
+    {
+      l.push_back (i);
+    }
+  uint32_t i = 0;
+  for (auto it = l.begin (); it != l.end (); i++)
+    {
+      if (i % 2 == 0)
+        {
+          it = l.erase (it);
+          l.push_front (i);
+        }
+      else
+        {
+          ++it;
+        }
+    }
+}
+
+/* insert random keys, then erase half of them */
+template <typename Map, typename Alloc>
+static void
+map_churn (const Alloc &alloc)
+{
+  Map m (alloc);
+  uint32_t seed = 1;
+
+  for (uint32_t i = 0; i < ELEMENTS; i++)
+    {
+      seed = next_seed (seed);
+      m.emplace (seed, i);
+    }
+  seed = 1;
+  for (uint32_t i = 0; i < ELEMENTS; i += 2)
+    {
+      seed = next_seed (seed);
+      m.erase (seed);
+      seed = next_seed (seed);
+    }
+}
+
+template <typename Workload>
+static double
+measure (Workload workload)
+{
+  uint64_t start = now_ns ();
+
+  for (int r = 0; r < ROUNDS; r++)
+    {
+      workload ();
+    }
+  return (double)(now_ns () - start) / ROUNDS / ELEMENTS;
+}
+
+static mem_pool_t *
+new_pool (mem_engine_t engine, void *mem)
+{
+  mem_pool_config_t config = {};
+  mem_pool_t *pool;
+
+  config.engine = engine;
+  pool = deep_pool_init_with_config (mem, POOL_SIZE, &config);
+  if (pool == NULL)
+    {
+      fprintf (stderr, "cannot set up the pool\n");
+      exit (1);
+    }
+  return pool;
+}
+
+/* One row: the workload with the default allocator, as std::pmr containers
+ * on a skiplist and a TLSF pool, and with pool_allocator on a TLSF pool,
+ * each pool fresh. */
+template <typename Std, typename Pmr, typename Alloc>
+static void
+row (const char *name, Std on_std, Pmr on_resource, Alloc on_allocator)
+{
+  void *mem = malloc (POOL_SIZE);
+  double ns[4];
+
+  if (mem == NULL)
+    {
+      fprintf (stderr, "cannot set up the pool\n");
+      exit (1);
+    }
+  ns[0] = measure ([&] { on_std (); });
+  deep::pool_resource skiplist (new_pool (MEM_ENGINE_SKIPLIST, mem));
+  ns[1] = measure ([&] { on_resource (&skiplist); });
+  deep::pool_resource tlsf (new_pool (MEM_ENGINE_TLSF, mem));
+  ns[2] = measure ([&] { on_resource (&tlsf); });
+  deep::pool_allocator<uint32_t> alloc (new_pool (MEM_ENGINE_TLSF, mem));
+  ns[3] = measure ([&] { on_allocator (alloc); });
+  free (mem);
+
+  printf ("%16s %12.1f %12.1f %12.1f %12.1f\n", name, ns[0], ns[1], ns[2],
+          ns[3]);
+}
+
+int
+main (void)
+{
+  using value_t = uint32_t;
+  using entry_t = std::pair<const value_t, uint32_t>;
+  using alloc_t = deep::pool_allocator<value_t>;
+  using resource_t = std::pmr::memory_resource *;
+
+  printf ("%16s %12s %12s %12s %12s\n", "ns/element", "std", "pmr skiplist",
+          "pmr tlsf", "alloc tlsf");
+  row (
+      "vector grow",
+      [] { vector_grow<std::vector<value_t>> (std::allocator<value_t> ()); },
+      [] (resource_t r) { vector_grow<std::pmr::vector<value_t>> (r); },
+      [] (const alloc_t &a) {
+        vector_grow<std::vector<value_t, alloc_t>> (a);
+      });
+  row (
+      "list churn",
+      [] { list_churn<std::list<value_t>> (std::allocator<value_t> ()); },
+      [] (resource_t r) { list_churn<std::pmr::list<value_t>> (r); },
+      [] (const alloc_t &a) { list_churn<std::list<value_t, alloc_t>> (a); });
+  row (
+      "map churn",
+      [] {
+        map_churn<std::map<value_t, uint32_t>> (std::allocator<entry_t> ());
+      },
+      [] (resource_t r) { map_churn<std::pmr::map<value_t, uint32_t>> (r); },
+      [] (const alloc_t &a) {
+        map_churn<std::map<value_t, uint32_t, std::less<value_t>,
+                           deep::pool_allocator<entry_t>>> (a);
+      });
+  row (
+      "hash map churn",
+      [] {
+        map_churn<std::unordered_map<value_t, uint32_t>> (
+            std::allocator<entry_t> ());
+      },
+      [] (resource_t r) {
+        map_churn<std::pmr::unordered_map<value_t, uint32_t>> (r);
+      },
+      [] (const alloc_t &a) {
+        map_churn<std::unordered_map<value_t, uint32_t, std::hash<value_t>,
+                                     std::equal_to<value_t>,
+                                     deep::pool_allocator<entry_t>>> (a);
+      });
+  return 0;
+}
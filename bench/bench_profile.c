@@ -0,0 +1,98 @@
+/*
+ * Cost of the heap profiler on the default pool: a malloc / free pair
+ * through deep_malloc, through deep_malloc_profiled while profiling is
+ * stopped, and while it samples at a few intervals.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "deep_profile.h"
+
+#define POOL_SIZE (64u << 20)
+#define LIVE (1024)
+#define ROUNDS (4000000)
+
+static const block_size_t intervals[] = { PROFILE_DEFAULT_INTERVAL, 64 * 1024,
+                                          4096 };
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline uint32_t
+next_seed (uint32_t seed)
+{
+  return seed * 1103515245u + 12345u;
+}
+
+/* ROUNDS pairs over LIVE slots of 16..527 bytes; ns per pair */
+static double
+run (bool profiled)
+{
+  static void *blocks[LIVE];
+  uint32_t seed = 1;
+  uint64_t start = now_ns ();
+
+  for (uint32_t i = 0; i < ROUNDS; i++)
+    {
+      seed = next_seed (seed);
+      uint32_t slot = (seed >> 8) % LIVE;
+      block_size_t size = 16 + (seed >> 20) % 512;
+      deep_free (blocks[slot]);
+      blocks[slot] = profiled ? deep_malloc_profiled (size) : deep_malloc (size);
+      if (blocks[slot] == NULL)
+        {
+          fprintf (stderr, "malloc fail\n");
+          exit (1);
+        }
+    }
+  double pair_ns = (double)(now_ns () - start) / ROUNDS;
+
+  for (uint32_t i = 0; i < LIVE; i++)
+    {
+      deep_free (blocks[i]);
+      blocks[i] = NULL;
+    }
+  return pair_ns;
+}
+
+int
+main (void)
+{
+  void *mem = malloc (POOL_SIZE);
+  profile_site_t site;
+
+  if (mem == NULL || !deep_mem_init (mem, POOL_SIZE))
+    {
+      fprintf (stderr, "cannot set up the pool\n");
+      return 1;
+    }
+  run (false); /* warm up */
+  double plain = run (false);
+  printf ("%-28s %14s %10s\n", "", "ns/malloc+free", "overhead");
+  printf ("%-28s %14.1f %9.1f%%\n", "deep_malloc", plain, 0.0);
+  double off = run (true);
+  printf ("%-28s %14.1f %9.1f%%\n", "profiled, stopped", off,
+          100 * (off - plain) / plain);
+  for (size_t i = 0; i < sizeof (intervals) / sizeof (*intervals); i++)
+    {
+      char name[32];
+      deep_mem_profile_start (intervals[i]);
+      double on = run (true);
+      deep_mem_profile_stop ();
+      deep_mem_profile_sites (&site, 1);
+      snprintf (name, sizeof (name), "profiled, every %llu B",
+                (unsigned long long)intervals[i]);
+      printf ("%-28s %14.1f %9.1f%%  estimated %llu blocks\n", name, on,
+              100 * (on - plain) / plain,
+              (unsigned long long)site.alloc_count);
+    }
+  free (mem);
+  return 0;
+}
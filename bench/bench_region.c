@@ -0,0 +1,104 @@
+/*
+ * Per-request temporaries: REQUESTS requests each allocating TEMPORARIES
+ * blocks of 16..271 bytes and dropping them all at the end, with a
+ * deep_pool_malloc / deep_pool_free per block, and with one region reset
+ * per request. Reports ns per temporary on each engine.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "deep_region.h"
+
+#define POOL_SIZE (64u << 20)
+#define REQUESTS (20000)
+#define TEMPORARIES (200)
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline uint32_t
+next_seed (uint32_t seed)
+{
+  return seed * 1103515245u + 12345u;
+}
+
+static double
+run (mem_engine_t engine, bool region)
+{
+  static void *temporaries[TEMPORARIES];
+  void *mem = malloc (POOL_SIZE);
+  mem_pool_config_t config = { .engine = engine };
+  mem_pool_t *pool = deep_pool_init_with_config (mem, POOL_SIZE, &config);
+  mem_region_t *temp;
+  uint32_t seed = 1;
+
+  if (pool == NULL || (temp = deep_pool_region_begin (pool, 0)) == NULL)
+    {
+      fprintf (stderr, "cannot set up the pool\n");
+      exit (1);
+    }
+  /* some long-lived blocks around, as in a running VM */
+  for (uint32_t i = 0; i < 10000; i++)
+    {
+      seed = next_seed (seed);
+      void *block = deep_pool_malloc (pool, 16 + (seed >> 8) % 512);
+      if ((seed >> 4) % 2 == 0)
+        {
+          deep_pool_free (pool, block);
+        }
+    }
+
+  uint64_t start = now_ns ();
+  for (uint32_t r = 0; r < REQUESTS; r++)
+    {
+      for (uint32_t i = 0; i < TEMPORARIES; i++)
+        {
+          seed = next_seed (seed);
+          block_size_t size = 16 + (seed >> 8) % 256;
+          temporaries[i] = region ? deep_pool_region_alloc (temp, size)
+                                  : deep_pool_malloc (pool, size);
+          if (temporaries[i] == NULL)
+            {
+              fprintf (stderr, "malloc fail\n");
+              exit (1);
+            }
+          *(uint8_t *)temporaries[i] = i;
+        }
+      if (region)
+        {
+          deep_pool_region_reset (temp);
+          continue;
+        }
+      for (uint32_t i = 0; i < TEMPORARIES; i++)
+        {
+          deep_pool_free (pool, temporaries[i]);
+        }
+    }
+  double ns = (double)(now_ns () - start) / REQUESTS / TEMPORARIES;
+
+  deep_pool_region_end (temp);
+  free (mem);
+  return ns;
+}
+
+int
+main (void)
+{
+  static const char *engines[] = { "skiplist", "tlsf" };
+
+  printf ("%10s %20s %20s\n", "engine", "ns/malloc+free", "ns/region alloc");
+  for (int e = MEM_ENGINE_SKIPLIST; e <= MEM_ENGINE_TLSF; e++)
+    {
+      double blocks = run (e, false);
+      double region = run (e, true);
+      printf ("%10s %20.1f %20.1f\n", engines[e], blocks, region);
+    }
+  return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Shape of the skiplist over free sorted blocks: with TOWERS distinct free
+ * sizes in the pool, the mean tower height and the number of nodes a
+ * search visits on its way down (the walk done by every insert and
+ * remove), plus the cost of a malloc / free pair taking one of the blocks
+ * out of the list and putting it back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "deep_mem.h"
+
+#define MIN_SIZE (SORTED_BIN_MIN_SIZE)
+/* an allocated block keeping free neighbours apart; fast blocks would be
+ * carved from the other end of the remainder */
+#define GUARD_SIZE (MIN_SIZE)
+#define SEARCHES (100000)
+#define ROUNDS (200000)
+
+static const uint32_t tower_counts[] = { 256, 1024, 4096, 8192 };
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline uint32_t
+next_seed (uint32_t seed)
+{
+  return seed * 1103515245u + 12345u;
+}
+
+/* The nodes visited while looking for the last one smaller than `size` on
+ * every level, from the top of the head down. */
+static uint32_t
+search_steps (mem_pool_t *pool, block_size_t size)
+{
+  sorted_block_t *curr = pool->sorted_block.addr;
+  uint32_t steps = 0;
+
+  for (uint32_t level = SORTED_BLOCK_INDICES_LEVEL; level-- > 0;)
+    {
+      while (curr->payload.info.offsets[level] != 0)
+        {
+          sorted_block_t *next
+              = (sorted_block_t *)((uint8_t *)curr
+                                   + curr->payload.info.offsets[level]);
+          steps++;
+          if ((next->head & BLOCK_SIZE_MASK) >= size)
+            {
+              break;
+            }
+          curr = next;
+        }
+    }
+  return steps;
+}
+
+static void
+run (uint32_t towers)
+{
+  /* sizes MIN_SIZE, MIN_SIZE + 8, ..., each followed by a guard */
+  uint64_t pool_size = (uint64_t)towers * (MIN_SIZE + GUARD_SIZE)
+                       + 4ull * towers * (towers - 1) + (1 << 20);
+  void *mem = malloc (pool_size);
+  void **blocks = malloc (towers * sizeof (void *));
+  mem_pool_t *pool = deep_pool_init (mem, pool_size);
+  mem_stats_t stats;
+  uint32_t seed = 1;
+
+  if (mem == NULL || blocks == NULL || pool == NULL)
+    {
+      fprintf (stderr, "cannot set up a %llu-byte pool\n",
+               (unsigned long long)pool_size);
+      exit (1);
+    }
+  for (uint32_t i = 0; i < towers; i++)
+    {
+      blocks[i] = deep_pool_malloc (pool, MIN_SIZE + 8 * i - 8);
+      if (blocks[i] == NULL
+          || deep_pool_malloc (pool, GUARD_SIZE - 8) == NULL)
+        {
+          fprintf (stderr, "cannot fill the pool\n");
+          exit (1);
+        }
+    }
+  /* free in random order, so that insertion order does not shape it */
+  for (uint32_t i = towers; i > 1; i--)
+    {
+      seed = next_seed (seed);
+      uint32_t j = (seed >> 8) % i;
+      void *tmp = blocks[i - 1];
+      blocks[i - 1] = blocks[j];
+      blocks[j] = tmp;
+    }
+  for (uint32_t i = 0; i < towers; i++)
+    {
+      deep_pool_free (pool, blocks[i]);
+    }
+
+  uint64_t steps = 0;
+  uint32_t max_steps = 0;
+  for (uint32_t i = 0; i < SEARCHES; i++)
+    {
+      seed = next_seed (seed);
+      uint32_t s
+          = search_steps (pool, MIN_SIZE + 8 * ((seed >> 8) % towers) - 8);
+      steps += s;
+      max_steps = s > max_steps ? s : max_steps;
+    }
+
+  /* each pair takes a block out of the list and inserts it anew */
+  uint64_t start = now_ns ();
+  for (uint32_t i = 0; i < ROUNDS; i++)
+    {
+      seed = next_seed (seed);
+      block_size_t size = MIN_SIZE + 8 * ((seed >> 8) % towers) - 8;
+      deep_pool_free (pool, deep_pool_malloc (pool, size));
+    }
+  double pair_ns = (double)(now_ns () - start) / ROUNDS;
+
+  deep_pool_stats (pool, &stats);
+  uint64_t levels = 0;
+  uint32_t nodes = 0;
+  uint32_t tallest = 0;
+  for (uint32_t h = 1; h <= SORTED_BLOCK_INDICES_LEVEL; h++)
+    {
+      levels += (uint64_t)h * stats.tower_heights[h];
+      nodes += stats.tower_heights[h];
+      tallest = stats.tower_heights[h] != 0 ? h : tallest;
+    }
+  printf ("%8u %14.2f %8u %14.1f %10u %14.0f\n", towers,
+          (double)levels / nodes, tallest, (double)steps / SEARCHES,
+          max_steps, pair_ns);
+
+  free (blocks);
+  free (mem);
+}
+
+int
+main (void)
+{
+  printf ("%8s %14s %8s %14s %10s %14s\n", "towers", "mean height",
+          "tallest", "steps/search", "max steps", "ns/malloc+free");
+  for (size_t i = 0; i < sizeof (tower_counts) / sizeof (*tower_counts); i++)
+    {
+      run (tower_counts[i]);
+    }
+  return 0;
+}
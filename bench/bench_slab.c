@@ -0,0 +1,104 @@
+/*
+ * Slab caches against plain blocks for fixed-size objects: OBJECTS objects
+ * of one size allocated, then freed and allocated again in random order,
+ * through deep_pool_malloc / deep_pool_free and through a slab cache. Reports
+ * the pool bytes each live object costs and ns per malloc + free pair.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "deep_slab.h"
+
+#define POOL_SIZE (64u << 20)
+#define OBJECTS (200000)
+#define ROUNDS (2000000)
+#define OBJECTS_PER_SLAB (64)
+
+static const block_size_t object_sizes[] = { 16, 32, 48, 96, 160, 256 };
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline uint32_t
+next_seed (uint32_t seed)
+{
+  return seed * 1103515245u + 12345u;
+}
+
+/* Bytes per live object once OBJECTS are allocated; `pair_ns` gets the
+ * cost of replacing random ones. */
+static double
+run (block_size_t size, bool slab, double *pair_ns)
+{
+  static void *objects[OBJECTS];
+  void *mem = malloc (POOL_SIZE);
+  mem_pool_t *pool = deep_pool_init (mem, POOL_SIZE);
+  slab_cache_t *cache = NULL;
+  mem_stats_t empty, full;
+  uint32_t seed = 1;
+
+  if (pool == NULL
+      || (slab
+          && (cache = deep_pool_slab_create (pool, size, OBJECTS_PER_SLAB))
+                 == NULL))
+    {
+      fprintf (stderr, "cannot set up the pool\n");
+      exit (1);
+    }
+  deep_pool_stats (pool, &empty);
+  for (uint32_t i = 0; i < OBJECTS; i++)
+    {
+      objects[i] = slab ? deep_pool_slab_alloc (pool, cache)
+                        : deep_pool_malloc (pool, size);
+      if (objects[i] == NULL)
+        {
+          fprintf (stderr, "malloc fail\n");
+          exit (1);
+        }
+    }
+  deep_pool_stats (pool, &full);
+
+  uint64_t start = now_ns ();
+  for (uint32_t i = 0; i < ROUNDS; i++)
+    {
+      seed = next_seed (seed);
+      uint32_t j = (seed >> 8) % OBJECTS;
+      if (slab)
+        {
+          deep_pool_slab_free (pool, cache, objects[j]);
+          objects[j] = deep_pool_slab_alloc (pool, cache);
+        }
+      else
+        {
+          deep_pool_free (pool, objects[j]);
+          objects[j] = deep_pool_malloc (pool, size);
+        }
+    }
+  *pair_ns = (double)(now_ns () - start) / ROUNDS;
+
+  free (mem);
+  return (double)(full.used_bytes - empty.used_bytes) / OBJECTS;
+}
+
+int
+main (void)
+{
+  printf ("%8s %16s %16s %16s %16s\n", "size", "bytes/object",
+          "slab bytes/obj", "ns/malloc+free", "slab ns/pair");
+  for (size_t i = 0; i < sizeof (object_sizes) / sizeof (*object_sizes); i++)
+    {
+      double block_ns, slab_ns;
+      double block_bytes = run (object_sizes[i], false, &block_ns);
+      double slab_bytes = run (object_sizes[i], true, &slab_ns);
+      printf ("%8u %16.1f %16.1f %16.1f %16.1f\n", (unsigned)object_sizes[i],
+              block_bytes, slab_bytes, block_ns, slab_ns);
+    }
+  return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Warm start from a pool image: building a heap of OBJECTS linked objects
+ * in a fresh pool, against restoring INSTANCES pools from an image of it,
+ * each instance then allocating a few more objects, and also walking all
+ * of them, which reads every page of the image. Also reports the size of
+ * the image on disk, its remainder being a hole.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "deep_mem.h"
+
+#define POOL_SIZE (64u << 20)
+#define OBJECTS (200000)
+#define INSTANCES (100)
+#define START_OBJECTS (16) /* allocated by every instance */
+#define IMAGE_PATH "bench_snapshot.img"
+
+/* objects refer to each other by offset, which holds wherever the pool is
+ * mapped */
+typedef struct object
+{
+  uint64_t next;
+  uint32_t id;
+  uint32_t size;
+} object_t;
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* The heap a VM sets up before running anything; returns the offset of its
+ * first object. */
+static uint64_t
+build (mem_pool_t *pool)
+{
+  uint64_t head = 0;
+  uint32_t seed = 1;
+
+  for (uint32_t i = 0; i < OBJECTS; i++)
+    {
+      seed = seed * 1103515245u + 12345u;
+      uint32_t size = sizeof (object_t) + (seed >> 8) % 240;
+      object_t *object = deep_pool_malloc (pool, size);
+      if (object == NULL)
+        {
+          fprintf (stderr, "cannot build the heap\n");
+          exit (1);
+        }
+      memset (object, 0, size);
+      object->next = head;
+      object->id = i;
+      object->size = size;
+      head = (uint8_t *)object - (uint8_t *)pool;
+    }
+  return head;
+}
+
+/* What an instance does first: allocate a few objects, after visiting all
+ * the others if `walk`. */
+static uint32_t
+start (mem_pool_t *pool, uint64_t head, bool walk)
+{
+  uint32_t count = 0;
+
+  for (uint64_t offset = walk ? head : 0; offset != 0;)
+    {
+      object_t *object = (object_t *)((uint8_t *)pool + offset);
+      offset = object->next;
+      count++;
+    }
+  for (uint32_t i = 0; i < START_OBJECTS; i++)
+    {
+      count += deep_pool_malloc (pool, 100) != NULL;
+    }
+  return count;
+}
+
+int
+main (void)
+{
+  void *mem = malloc (POOL_SIZE);
+  mem_pool_t *pools[INSTANCES];
+  struct stat st;
+
+  if (mem == NULL)
+    {
+      fprintf (stderr, "cannot allocate the pool\n");
+      return 1;
+    }
+
+  uint64_t t0 = now_ns ();
+  mem_pool_t *pool = deep_pool_init (mem, POOL_SIZE);
+  uint64_t head = build (pool);
+  uint32_t expected = start (pool, head, true);
+  double init_us = (now_ns () - t0) / 1e3;
+
+  t0 = now_ns ();
+  if (!deep_pool_snapshot (pool, IMAGE_PATH) || stat (IMAGE_PATH, &st) != 0)
+    {
+      fprintf (stderr, "cannot write %s\n", IMAGE_PATH);
+      return 1;
+    }
+  double snapshot_us = (now_ns () - t0) / 1e3;
+  free (mem);
+
+  double restore_us[2];
+  for (int walk = 0; walk < 2; walk++)
+    {
+      t0 = now_ns ();
+      for (uint32_t i = 0; i < INSTANCES; i++)
+        {
+          pools[i] = deep_pool_restore (IMAGE_PATH);
+          if (pools[i] == NULL
+              || start (pools[i], head, walk)
+                     != (walk ? expected : START_OBJECTS))
+            {
+              fprintf (stderr, "instance %u differs from the original\n", i);
+              return 1;
+            }
+        }
+      restore_us[walk] = (now_ns () - t0) / 1e3 / INSTANCES;
+      for (uint32_t i = 0; i < INSTANCES; i++)
+        {
+          deep_pool_destroy (pools[i]);
+        }
+    }
+  unlink (IMAGE_PATH);
+
+  printf ("%-38s %12.0f us\n", "build + start, fresh pool", init_us);
+  printf ("%-38s %12.0f us\n", "snapshot", snapshot_us);
+  printf ("%-38s %12.0f us\n", "restore + start, per instance",
+          restore_us[0]);
+  printf ("%-38s %12.0f us\n", "restore + walk + start, per instance",
+          restore_us[1]);
+  printf ("%-38s %8llu of %llu KiB\n", "image on disk",
+          (unsigned long long)st.st_blocks / 2,
+          (unsigned long long)st.st_size / 1024);
+  return 0;
+}
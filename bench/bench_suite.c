@@ -0,0 +1,405 @@
+/*
+ * Allocator benchmark suite: deterministic traces of mallocs and frees are
+ * generated for several workloads and replayed on deep_mem (skiplist and
+ * TLSF engines) and on glibc malloc as a baseline.
+ *
+ * Workloads combine a size distribution (uniform or power law), an order
+ * in which short-lived blocks are freed (LIFO, FIFO or random) and a share
+ * of long-lived blocks that stay until the end. Each trace is replayed
+ * twice per allocator: once untimed per operation for throughput, once
+ * with every operation timed for latency percentiles and footprint.
+ *
+ * Reported per allocator:
+ *   ops/s       mallocs and frees per second
+ *   p50..p999   latency of a single malloc or free, in ns
+ *   peak frag   1 - peak live bytes / peak footprint, where the footprint
+ *               is the heap the allocator had to touch (for deep_mem the
+ *               pool minus its untouched remainder)
+ *   failed      share of mallocs returning NULL
+ *
+ * Usage: bench_suite [ops per workload]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <malloc.h>
+#include <time.h>
+#include "deep_mem.h"
+
+#define POOL_SIZE (256 * 1024 * 1024)
+#define DEFAULT_OPS (1000000)
+#define LIVE_CAP (8192)
+#define FOOTPRINT_INTERVAL (256)
+
+typedef enum
+{
+  SIZES_UNIFORM,
+  SIZES_POWER_LAW,
+} size_dist_t;
+
+typedef enum
+{
+  FREE_LIFO,
+  FREE_FIFO,
+  FREE_RANDOM,
+} free_order_t;
+
+typedef struct
+{
+  const char *name;
+  size_dist_t sizes;
+  uint32_t min_size;
+  uint32_t max_size;
+  free_order_t order;
+  uint32_t long_lived_percent;
+} workload_t;
+
+static const workload_t workloads[] = {
+  { "uniform 16-512, random free", SIZES_UNIFORM, 16, 512, FREE_RANDOM, 0 },
+  { "uniform 16-512, LIFO free", SIZES_UNIFORM, 16, 512, FREE_LIFO, 0 },
+  { "uniform 16-512, FIFO free", SIZES_UNIFORM, 16, 512, FREE_FIFO, 0 },
+  { "power law 16-64K, random free", SIZES_POWER_LAW, 16, 65536,
+    FREE_RANDOM, 0 },
+  { "power law 16-64K, 10% long-lived", SIZES_POWER_LAW, 16, 65536,
+    FREE_RANDOM, 10 },
+  { "uniform 16-4K, 30% long-lived, FIFO", SIZES_UNIFORM, 16, 4096,
+    FREE_FIFO, 30 },
+};
+
+/* size 0 frees the block in `slot` */
+typedef struct
+{
+  uint32_t slot;
+  uint32_t size;
+} trace_op_t;
+
+typedef struct
+{
+  const char *name;
+  void *(*malloc_fn) (uint32_t size);
+  void (*free_fn) (void *ptr);
+  void (*reset) (void);
+  size_t (*footprint) (void);
+} allocator_t;
+
+static trace_op_t *trace;
+static uint32_t trace_length;
+static uint32_t trace_mallocs;
+static void *slots[LIVE_CAP];
+static uint32_t slot_sizes[LIVE_CAP];
+static uint32_t *latencies;
+
+static void *pool_mem;
+static mem_pool_t *pool;
+/* glibc heap in use by the suite itself (pool buffer, trace) */
+static size_t libc_baseline;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t
+rng_next (void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double
+rng_unit (void)
+{
+  return (rng_next () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint32_t
+draw_size (workload_t const *w)
+{
+  if (w->sizes == SIZES_UNIFORM)
+    {
+      return w->min_size + rng_next () % (w->max_size - w->min_size + 1);
+    }
+  /* Pareto with alpha 1.1: most blocks small, a long tail of big ones */
+  double size = w->min_size * pow (1.0 - rng_unit (), -1.0 / 1.1);
+  return size > w->max_size ? w->max_size : (uint32_t)size;
+}
+
+/**
+ * Build the trace of `ops` operations for `w`. Short-lived blocks sit in a
+ * ring, taken from the back (LIFO), the front (FIFO) or anywhere (random);
+ * long-lived ones are only freed at the end.
+ **/
+static void
+make_trace (workload_t const *w, uint32_t ops)
+{
+  static uint32_t ring[LIVE_CAP];
+  static uint32_t long_lived[LIVE_CAP];
+  static uint32_t free_slots[LIVE_CAP];
+  uint32_t ring_head = 0, ring_count = 0, long_count = 0, free_count = 0;
+
+  for (uint32_t i = 0; i < LIVE_CAP; i++)
+    {
+      free_slots[free_count++] = LIVE_CAP - 1 - i;
+    }
+  trace_length = 0;
+  trace_mallocs = 0;
+
+  for (uint32_t i = 0; i < ops; i++)
+    {
+      bool do_malloc = ring_count == 0
+                       || (free_count > 0 && (rng_next () & 1));
+      if (do_malloc)
+        {
+          uint32_t slot = free_slots[--free_count];
+          trace[trace_length++] = (trace_op_t){ slot, draw_size (w) };
+          trace_mallocs++;
+          if (long_count < LIVE_CAP / 2
+              && rng_next () % 100 < w->long_lived_percent)
+            {
+              long_lived[long_count++] = slot;
+            }
+          else
+            {
+              ring[(ring_head + ring_count++) % LIVE_CAP] = slot;
+            }
+          continue;
+        }
+
+      uint32_t victim;
+      if (w->order == FREE_FIFO)
+        {
+          victim = ring[ring_head];
+          ring_head = (ring_head + 1) % LIVE_CAP;
+        }
+      else
+        {
+          uint32_t back = (ring_head + ring_count - 1) % LIVE_CAP;
+          if (w->order == FREE_RANDOM)
+            {
+              uint32_t pick = (ring_head + rng_next () % ring_count) % LIVE_CAP;
+              uint32_t tmp = ring[pick];
+              ring[pick] = ring[back];
+              ring[back] = tmp;
+            }
+          victim = ring[back];
+        }
+      ring_count--;
+      trace[trace_length++] = (trace_op_t){ victim, 0 };
+      free_slots[free_count++] = victim;
+    }
+
+  for (; ring_count > 0; ring_count--, ring_head = (ring_head + 1) % LIVE_CAP)
+    {
+      trace[trace_length++] = (trace_op_t){ ring[ring_head], 0 };
+    }
+  while (long_count > 0)
+    {
+      trace[trace_length++] = (trace_op_t){ long_lived[--long_count], 0 };
+    }
+}
+
+static void *
+pool_malloc (uint32_t size)
+{
+  return deep_pool_malloc (pool, size);
+}
+
+static void
+pool_free (void *ptr)
+{
+  deep_pool_free (pool, ptr);
+}
+
+static void
+pool_reset_skiplist (void)
+{
+  mem_pool_config_t config = { .engine = MEM_ENGINE_SKIPLIST };
+  pool = deep_pool_init_with_config (pool_mem, POOL_SIZE, &config);
+}
+
+static void
+pool_reset_tlsf (void)
+{
+  mem_pool_config_t config = { .engine = MEM_ENGINE_TLSF };
+  pool = deep_pool_init_with_config (pool_mem, POOL_SIZE, &config);
+}
+
+static size_t
+pool_footprint (void)
+{
+  return pool->total_memory
+         - ((uint8_t *)pool->remainder_block_end
+            - (uint8_t *)pool->remainder_block_head);
+}
+
+static void *
+libc_malloc (uint32_t size)
+{
+  return malloc (size);
+}
+
+static void
+libc_free (void *ptr)
+{
+  free (ptr);
+}
+
+static void
+libc_reset (void)
+{
+  malloc_trim (0);
+}
+
+/* everything glibc holds from the system, minus the suite's own blocks */
+static size_t
+libc_footprint (void)
+{
+  struct mallinfo2 info = mallinfo2 ();
+  size_t size = info.arena + info.hblkhd;
+  return size > libc_baseline ? size - libc_baseline : 0;
+}
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int
+compare_u32 (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* returns the number of failed mallocs */
+static uint32_t
+replay_untimed (allocator_t const *a)
+{
+  uint32_t failures = 0;
+
+  for (uint32_t i = 0; i < trace_length; i++)
+    {
+      trace_op_t op = trace[i];
+      if (op.size == 0)
+        {
+          a->free_fn (slots[op.slot]);
+          continue;
+        }
+      if ((slots[op.slot] = a->malloc_fn (op.size)) == NULL)
+        {
+          failures++;
+        }
+      else
+        {
+          /* touch the block like a real program would */
+          *(volatile uint8_t *)slots[op.slot] = (uint8_t)i;
+        }
+    }
+  return failures;
+}
+
+static double
+replay_timed (allocator_t const *a, size_t *peak_footprint)
+{
+  uint64_t live = 0, peak_live = 0;
+
+  *peak_footprint = 0;
+  for (uint32_t i = 0; i < trace_length; i++)
+    {
+      trace_op_t op = trace[i];
+      uint64_t start = now_ns ();
+      if (op.size == 0)
+        {
+          a->free_fn (slots[op.slot]);
+          latencies[i] = now_ns () - start;
+          live -= slots[op.slot] != NULL ? slot_sizes[op.slot] : 0;
+          continue;
+        }
+      slots[op.slot] = a->malloc_fn (op.size);
+      latencies[i] = now_ns () - start;
+      if (slots[op.slot] != NULL)
+        {
+          *(volatile uint8_t *)slots[op.slot] = (uint8_t)i;
+          slot_sizes[op.slot] = op.size;
+          live += op.size;
+        }
+      /* both peaks are sampled at the same points */
+      if (i % FOOTPRINT_INTERVAL == 0)
+        {
+          size_t footprint = a->footprint ();
+          peak_live = live > peak_live ? live : peak_live;
+          *peak_footprint
+              = footprint > *peak_footprint ? footprint : *peak_footprint;
+        }
+    }
+  return *peak_footprint == 0 ? 0 : 1.0 - (double)peak_live / *peak_footprint;
+}
+
+static void
+run (allocator_t const *a)
+{
+  size_t peak_footprint;
+
+  a->reset ();
+  uint64_t start = now_ns ();
+  uint32_t failures = replay_untimed (a);
+  double seconds = (now_ns () - start) / 1e9;
+
+  a->reset ();
+  double fragmentation = replay_timed (a, &peak_footprint);
+  qsort (latencies, trace_length, sizeof (uint32_t), compare_u32);
+
+  printf ("  %-14s %12.0f %7u %7u %7u %9.1f%% %9.3f%%\n", a->name,
+          trace_length / seconds, latencies[trace_length / 2],
+          latencies[(uint64_t)trace_length * 99 / 100],
+          latencies[(uint64_t)trace_length * 999 / 1000],
+          100 * fragmentation, 100.0 * failures / trace_mallocs);
+}
+
+int
+main (int argc, char **argv)
+{
+  uint32_t ops = argc > 1 ? (uint32_t)strtoul (argv[1], NULL, 10) : DEFAULT_OPS;
+  allocator_t const allocators[] = {
+    { "deep skiplist", pool_malloc, pool_free, pool_reset_skiplist,
+      pool_footprint },
+    { "deep tlsf", pool_malloc, pool_free, pool_reset_tlsf, pool_footprint },
+    { "glibc", libc_malloc, libc_free, libc_reset, libc_footprint },
+  };
+
+  /* every op may be followed by one free when the trace drains */
+  trace = malloc (((size_t)ops + LIVE_CAP) * sizeof (trace_op_t));
+  latencies = malloc (((size_t)ops + LIVE_CAP) * sizeof (uint32_t));
+  pool_mem = malloc (POOL_SIZE);
+  if (ops == 0 || trace == NULL || latencies == NULL || pool_mem == NULL)
+    {
+      fprintf (stderr, "usage: %s [ops per workload > 0]\n", argv[0]);
+      return 1;
+    }
+  struct mallinfo2 info = mallinfo2 ();
+  libc_baseline = info.uordblks + info.hblkhd;
+
+  for (size_t w = 0; w < sizeof (workloads) / sizeof (workloads[0]); w++)
+    {
+      make_trace (&workloads[w], ops);
+      printf ("%s (%u ops)\n", workloads[w].name, trace_length);
+      printf ("  %-14s %12s %7s %7s %7s %10s %10s\n", "allocator", "ops/s",
+              "p50", "p99", "p999", "peak frag", "failed");
+      for (size_t i = 0; i < sizeof (allocators) / sizeof (allocators[0]); i++)
+        {
+          run (&allocators[i]);
+        }
+      printf ("\n");
+    }
+
+  free (trace);
+  free (latencies);
+  free (pool_mem);
+  return 0;
+}
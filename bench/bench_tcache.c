@@ -0,0 +1,149 @@
+/*
+ * Small-block malloc/free throughput of one shared pool at 1-32 threads:
+ * a single mutex around deep_pool_malloc/deep_pool_free versus the
+ * per-thread caches of deep_tcache_malloc/deep_tcache_free and the
+ * lock-free fast bins of a concurrent pool.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "deep_mem.h"
+
+#define POOL_SIZE (64 * 1024 * 1024)
+#define OPS_PER_THREAD (1000000)
+#define LIVE_SLOTS (64)
+#define MAX_THREADS (32)
+
+typedef enum
+{
+  MODE_MUTEX,
+  MODE_TCACHE,
+  MODE_LOCKFREE,
+} bench_mode_t;
+
+static mem_pool_t *pool;
+static mem_pool_t *concurrent_pool;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bench_mode_t mode;
+
+static inline void *
+bench_malloc (uint32_t size)
+{
+  void *ret;
+
+  if (mode == MODE_TCACHE)
+    {
+      return deep_tcache_malloc (pool, size);
+    }
+  if (mode == MODE_LOCKFREE)
+    {
+      return deep_pool_malloc (concurrent_pool, size);
+    }
+  pthread_mutex_lock (&pool_mutex);
+  ret = deep_pool_malloc (pool, size);
+  pthread_mutex_unlock (&pool_mutex);
+  return ret;
+}
+
+static inline void
+bench_free (void *ptr)
+{
+  if (mode == MODE_TCACHE)
+    {
+      deep_tcache_free (pool, ptr);
+      return;
+    }
+  if (mode == MODE_LOCKFREE)
+    {
+      deep_pool_free (concurrent_pool, ptr);
+      return;
+    }
+  pthread_mutex_lock (&pool_mutex);
+  deep_pool_free (pool, ptr);
+  pthread_mutex_unlock (&pool_mutex);
+}
+
+static void *
+worker (void *arg)
+{
+  uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u + 1;
+  void *slots[LIVE_SLOTS] = { NULL };
+
+  for (int i = 0; i < OPS_PER_THREAD; i++)
+    {
+      uint32_t slot = i % LIVE_SLOTS;
+      seed = seed * 1103515245u + 12345u;
+      bench_free (slots[slot]);
+      /* every fast-bin size class: 1..56 bytes of payload */
+      slots[slot] = bench_malloc ((seed >> 16) % 56 + 1);
+    }
+  for (int i = 0; i < LIVE_SLOTS; i++)
+    {
+      bench_free (slots[i]);
+    }
+  if (mode == MODE_TCACHE)
+    {
+      deep_tcache_flush ();
+    }
+  return NULL;
+}
+
+static double
+run (bench_mode_t bench_mode, int threads)
+{
+  pthread_t tids[MAX_THREADS];
+  struct timespec start, end;
+
+  mode = bench_mode;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < threads; i++)
+    {
+      pthread_create (&tids[i], NULL, worker, (void *)(uintptr_t)i);
+    }
+  for (int i = 0; i < threads; i++)
+    {
+      pthread_join (tids[i], NULL);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  double seconds = (end.tv_sec - start.tv_sec)
+                   + (end.tv_nsec - start.tv_nsec) / 1e9;
+  /* one malloc and one free per iteration */
+  return 2.0 * OPS_PER_THREAD * threads / seconds;
+}
+
+int
+main (void)
+{
+  mem_pool_config_t config = { .concurrent = true };
+  void *mem = malloc (POOL_SIZE);
+  void *concurrent_mem = malloc (POOL_SIZE);
+
+  if (mem == NULL || concurrent_mem == NULL
+      || (pool = deep_pool_init (mem, POOL_SIZE)) == NULL
+      || (concurrent_pool = deep_pool_init_with_config (
+              concurrent_mem, POOL_SIZE, &config))
+             == NULL)
+    {
+      fprintf (stderr, "cannot set up two %d-byte pools\n", POOL_SIZE);
+      return 1;
+    }
+
+  printf ("%8s %16s %16s %16s\n", "threads", "mutex ops/s", "tcache ops/s",
+          "lock-free ops/s");
+  for (int threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+      double locked = run (MODE_MUTEX, threads);
+      double cached = run (MODE_TCACHE, threads);
+      double lockfree = run (MODE_LOCKFREE, threads);
+      printf ("%8d %16.0f %16.0f %16.0f\n", threads, locked, cached,
+              lockfree);
+    }
+
+  free (mem);
+  free (concurrent_mem);
+  return 0;
+}
@@ -34,12 +34,56 @@ extern "C" {
 #endif
 
 
+#include <stdint.h>
+
 void log_printf (const char* pFileName, unsigned int uiLine, const char* pFuncName, const char *pFlag, char *LogFmtBuf, ...);
 void log_data(const char *pFileName, unsigned int uiLine, const char* pFuncName, const char *pcStr,unsigned char *pucBuf,unsigned int usLen);
-#define deep_error(...)                             log_printf(__FILE__, __LINE__,__FUNCTION__,"<error>",__VA_ARGS__)
-#define deep_warn(...)                              log_printf(__FILE__, __LINE__,__FUNCTION__,"<warn>",__VA_ARGS__)
-#define deep_debug(...)                             log_printf(__FILE__, __LINE__,__FUNCTION__,"<debug>",__VA_ARGS__)
-#define deep_info(...)                              log_printf(__FILE__, __LINE__,__FUNCTION__,"<info>",__VA_ARGS__)
+
+/* Asynchronous logging: every call site owns a static log_site_t, and a
+ * message is recorded into a per-thread ring buffer as the address of its
+ * site plus the raw arguments. Formatting and writing happen later, in
+ * log_flush or in the background drainer. %s arguments are copied (up to
+ * LOG_STRING_MAX bytes), everything else is stored by value. */
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_MAX_ARGS (16)
+#define LOG_STRING_MAX (255)
+#define LOG_SITE_UNPARSED (-1)
+#define LOG_SITE_SYNC (-2) /* format cannot be recorded, print at once */
+
+typedef struct log_site
+{
+  const char *file;
+  const char *func;
+  const char *flag;
+  const char *fmt;
+  unsigned int line;
+  int nargs; /* LOG_SITE_UNPARSED until the first message */
+  uint64_t arg_types; /* 4 bits per argument */
+} log_site_t;
+
+void log_record (log_site_t *site, const char *fmt, ...);
+/* Format and write every recorded message. */
+void log_flush (void);
+/* Drain the rings from a background thread every `interval_us`. */
+int log_start_drainer (unsigned int interval_us);
+void log_stop_drainer (void);
+
+#define _LOG_FORMAT(...) _LOG_FORMAT_(__VA_ARGS__, 0)
+#define _LOG_FORMAT_(fmt, ...) fmt
+#define _log_async(flag, ...)                                                 \
+  do                                                                          \
+    {                                                                         \
+      static log_site_t _log_site = { __FILE__, __FUNCTION__, flag,          \
+                                      _LOG_FORMAT (__VA_ARGS__), __LINE__,    \
+                                      LOG_SITE_UNPARSED, 0 };                 \
+      log_record (&_log_site, __VA_ARGS__);                                   \
+    }                                                                         \
+  while (0)
+
+#define deep_error(...)                             _log_async("<error>",__VA_ARGS__)
+#define deep_warn(...)                              _log_async("<warn>",__VA_ARGS__)
+#define deep_debug(...)                             _log_async("<debug>",__VA_ARGS__)
+#define deep_info(...)                              _log_async("<info>",__VA_ARGS__)
 #define deep_dump(pcStr,pucBuf,usLen)               log_data(__FILE__, __LINE__,__FUNCTION__,pcStr,pucBuf,usLen)
 
 
@@ -1,20 +1,69 @@
 #ifndef _DEEP_MEM_ALLOC_H
 #define _DEEP_MEM_ALLOC_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #include <stdbool.h>
+#include <stdint.h>
+
+/* Build with DEEP_MEM_WIDE for 64-bit block heads, sizes and offsets, which
+ * lift the limits on pool and block sizes. Heads still take 8 bytes with
+ * the payload alignment, so blocks cost the same; small free sorted blocks
+ * just fit fewer skiplist levels. */
+#ifdef DEEP_MEM_WIDE
+#define BLOCK_HEAD_BITS (64)
+#else
+#define BLOCK_HEAD_BITS (32)
+#endif
 
 #define FAST_BIN_LENGTH (8) /* eight size options for fast bins */
 #define FAST_BIN_MAX_SIZE (64) /* 8 * 8 bytes */
-#define SORTED_BIN_MIN_SIZE (FAST_BIN_MAX_SIZE + 8) /* 64 + 8 bytes */
+/* the smallest block bigger than a fast one, which holds the links, a
+ * skiplist tower of a few levels and a footer while free */
+#define SORTED_BIN_MIN_SIZE (FAST_BIN_MAX_SIZE + 8)
 
 #define A_FLAG_OFFSET (0) /* is allocated */
 #define A_FLAG_MASK (1 << A_FLAG_OFFSET)
 #define P_FLAG_OFFSET (1) /* is previous block allocated */
 #define P_FLAG_MASK (1 << P_FLAG_OFFSET)
-#define BLOCK_SIZE_MASK (0xFFFFFFFF - A_FLAG_MASK - P_FLAG_MASK)
+#define M_FLAG_OFFSET (2) /* is mapped on its own, outside the pool */
+#define M_FLAG_MASK (1 << M_FLAG_OFFSET)
+#define BLOCK_SIZE_MASK                                                       \
+  (~(block_head_t)(A_FLAG_MASK | P_FLAG_MASK | M_FLAG_MASK))
 #define REMAINDER_SIZE_MASK ((0xffffffff << 32) & BLOCK_SIZE_MASK)
 
 #define SORTED_BLOCK_INDICES_LEVEL (13)
+/* a skiplist tower reaches each next level with probability 1 / 2^this */
+#define SORTED_BLOCK_LEVEL_SHIFT (2)
+
+/* bucket i of the size histogram counts blocks of [2^i, 2^(i+1)) bytes */
+#define STATS_HISTOGRAM_LENGTH (BLOCK_HEAD_BITS)
+
+#define POOL_FLAG_CONCURRENT (1 << 0) /* lock-free fast bins */
+#define POOL_FLAG_TLSF (1 << 1) /* free sorted blocks indexed by TLSF */
+#define POOL_FLAG_ZERO_ON_ALLOC (1 << 2) /* malloc hands out zeroed payloads */
+#define POOL_FLAG_ZERO_ON_FREE (1 << 3) /* free scrubs payloads */
+/* the buffer maps an image, see deep_pool_restore */
+#define POOL_FLAG_IMAGE (1 << 4)
+
+/* Two-level segregated fit: 2^4 second-level classes per power of two,
+ * classes of 8 bytes below 2^7 */
+#define TLSF_SL_INDEX_COUNT_LOG2 (4)
+#define TLSF_SL_INDEX_COUNT (1 << TLSF_SL_INDEX_COUNT_LOG2)
+#define TLSF_FL_INDEX_SHIFT (TLSF_SL_INDEX_COUNT_LOG2 + 3)
+#define TLSF_FL_INDEX_COUNT (BLOCK_HEAD_BITS - TLSF_FL_INDEX_SHIFT + 1)
+#define TLSF_SMALL_BLOCK_SIZE (1 << TLSF_FL_INDEX_SHIFT)
+
+#define ALIGNED_ALLOC_MAX_ALIGNMENT (4096) /* a page */
+
+/* fast_bins hold the offset of their top block, in units of 8 bytes, below
+ * this bit and an ABA tag above it */
+#define FAST_BIN_TAG_SHIFT (BLOCK_HEAD_BITS == 64 ? 40 : 32)
+
+#define TCACHE_BIN_CAPACITY (64) /* cached blocks per size class and thread */
+#define TCACHE_BATCH_SIZE (16) /* blocks moved per refill / flush */
 
 /* Align the size up to a multiple of eight*/
 #define ALIGN_MEM_SIZE(size) (((size + 0x7) >> 3) << 3)
@@ -23,8 +72,19 @@
 
 typedef void *mem_t;
 typedef uint64_t mem_size_t;
+#ifdef DEEP_MEM_WIDE
+typedef uint64_t block_head_t;
+typedef int64_t block_offset_t; /* between blocks of a pool */
+#define BLOCK_OFFSET_MAX INT64_MAX
+#else
 typedef uint32_t block_head_t;
-typedef uint32_t block_size_t;
+typedef int32_t block_offset_t;
+#define BLOCK_OFFSET_MAX INT32_MAX
+#endif
+typedef block_head_t block_size_t;
+
+/* Offsets between blocks are signed, which bounds the size of a pool. */
+#define POOL_MAX_SIZE ((block_size_t)BLOCK_OFFSET_MAX)
 
 /* For storing small blocks of memory */
 typedef struct fast_block
@@ -44,26 +104,74 @@ typedef struct sorted_block
   {
     struct
     {
-      int32_t pred_offset;
-      int32_t succ_offset;
+      block_offset_t pred_offset;
+      block_offset_t succ_offset;
       uint32_t level_of_indices;
-      // bigger array index corresponds to lower index in skip list,
-      // i.e., skipping less nodes in the skip list
+      // offsets[0] is the level where each node is connected one by one
+      // consecutively; bigger array index corresponds to higher index in
+      // skip list, i.e., skipping more nodes in the skip list.
       // 0 means this node is the last one in this level of index.
-      // offsets[SORTED_BLOCK_INDICES_LEVEL - 1] is the level where each node
-      // is connected one by one consecutively.
       // The skip list is in ascending order by block's size.
-      int32_t offsets[SORTED_BLOCK_INDICES_LEVEL];
-      // padding
-      // uint32_t footer;
+      // Only the first level_of_indices offsets are part of the block: a
+      // tower is never higher than what fits in front of the footer, so
+      // small blocks end within this array.
+      block_offset_t offsets[SORTED_BLOCK_INDICES_LEVEL];
     } info;
     void *payload;
   } payload;
 } sorted_block_t;
 
+/* Blocks of at least mmap_threshold bytes get an anonymous mapping of their
+ * own, starting with this header; the head holds the size of the payload
+ * up to the end of the mapping, with the A and M flags set. */
+typedef struct mapped_block
+{
+  struct mapped_block *prev; /* in the pool's list of mapped blocks */
+  struct mapped_block *next;
+  mem_size_t length; /* of the whole mapping */
+  block_head_t head;
+  union
+  {
+    void *payload;
+  } payload;
+} mapped_block_t;
+
+/* Index of free sorted blocks used instead of the skiplist by TLSF pools.
+ * Blocks of one class are doubly linked through the pred_offset and
+ * succ_offset of their sorted_block_t. */
+typedef struct tlsf_index
+{
+  block_size_t fl_bitmap; /* TLSF_FL_INDEX_COUNT bits */
+  uint32_t sl_bitmap[TLSF_FL_INDEX_COUNT];
+  /* offset of the first block of each class from the pool, 0 if empty */
+  block_size_t blocks[TLSF_FL_INDEX_COUNT][TLSF_SL_INDEX_COUNT];
+} tlsf_index_t;
+
+/* Hands a growing pool more memory, see mem_pool_config_t. */
+typedef struct mem_region_provider
+{
+  /* Return a region of at least `*size` bytes and store its actual size in
+   * `*size`, or return NULL. */
+  void *(*acquire) (void *context, block_size_t *size);
+  /* Take back a region from `acquire`, now that nothing in it is
+   * allocated; may be NULL to keep every region. */
+  void (*release) (void *context, void *region, block_size_t size);
+  void *context;
+} mem_region_provider_t;
+
 typedef struct mem_pool
 {
   uint64_t free_memory;
+  uint64_t total_memory; /* size of the whole pool, header included */
+  union
+  {
+    uint64_t _lock_padding;
+    struct
+    {
+      uint32_t lock; /* taken by the thread-safe entry points only */
+      uint32_t flags; /* POOL_FLAG_*, fixed at init */
+    };
+  };
   union
   {
     uint64_t _padding;
@@ -79,18 +187,211 @@ typedef struct mem_pool
     uint64_t _remainder_block_end_padding;
     void *remainder_block_end; /* The address of the last byte in remainder */
   }; /* should not be dereferenced */
+  /* (ABA tag << FAST_BIN_TAG_SHIFT) | offset of the top block from the
+   * pool / 8, 0 if empty */
+  uint64_t fast_bins[FAST_BIN_LENGTH];
   union
   {
-    uint64_t _padding;
-    fast_block_t *addr;
-  } fast_bins[FAST_BIN_LENGTH];
+    uint64_t _mapped_blocks_padding;
+    mapped_block_t *mapped_blocks; /* most recently mapped first */
+  };
+  uint64_t mmap_threshold; /* 0 if no block is mapped on its own */
+  uint64_t mapped_bytes;
+  uint32_t mapped_block_count;
+  uint32_t arena_count; /* extra arenas of the pool */
+  /* Regions from the provider are set up as pools of their own, the extra
+   * arenas, linked from the pool newest first. */
+  union
+  {
+    uint64_t _arenas_padding;
+    struct mem_pool *arenas;
+  };
+  union
+  {
+    uint64_t _next_arena_padding;
+    struct mem_pool *next_arena; /* older arena, in an extra arena */
+  };
+  uint64_t region_size; /* of an extra arena, as acquired */
+  union
+  {
+    uint64_t _region_provider_padding[3];
+    mem_region_provider_t region_provider;
+  };
+  uint64_t level_random[2]; /* draws skiplist tower heights */
+  /* counters kept up to date for deep_pool_stats */
+  uint32_t fast_bin_counts[FAST_BIN_LENGTH];
+  uint32_t sorted_block_count;
+  uint32_t sorted_block_histogram[STATS_HISTOGRAM_LENGTH];
+  /* skiplist nodes per level_of_indices, 0 being same-size chain members */
+  uint32_t tower_heights[SORTED_BLOCK_INDICES_LEVEL + 1];
+  /* new whenever the pool is set up or moved, 0 once destroyed, so thread
+   * caches notice their blocks are gone */
+  uint64_t generation;
 } mem_pool_t;
 
-bool deep_mem_init (void *mem, uint32_t size);
+typedef enum mem_engine
+{
+  MEM_ENGINE_SKIPLIST = 0, /* sorted blocks in a skiplist, best fit */
+  MEM_ENGINE_TLSF, /* constant-time two-level segregated fit */
+} mem_engine_t;
+
+typedef enum mem_zero_policy
+{
+  MEM_ZERO_NONE = 0, /* payloads keep whatever they held */
+  MEM_ZERO_ON_ALLOC, /* malloc zeroes the payload */
+  /* free zeroes the payload, so no data outlives its block and calloc only
+   * clears the free-list links left in it */
+  MEM_ZERO_ON_FREE,
+} mem_zero_policy_t;
+
+typedef struct mem_pool_config
+{
+  /* Make malloc / realloc / free safe to call from several threads: fast
+   * bins become lock-free stacks, so blocks up to FAST_BIN_MAX_SIZE are
+   * allocated and freed (by any thread) without a lock; everything else
+   * takes the pool lock. */
+  bool concurrent;
+  /* How free blocks bigger than FAST_BIN_MAX_SIZE are indexed. */
+  mem_engine_t engine;
+  /* When payloads are zeroed; realloc never zeroes the bytes it adds. */
+  mem_zero_policy_t zero;
+  /* Serve malloc / calloc / realloc of at least this many bytes from an
+   * anonymous mapping of their own instead of the pool: realloc resizes
+   * them with mremap and free unmaps them. 0 keeps every block in the
+   * pool. Batches, and aligned allocations beyond 8-byte alignment, always
+   * stay in the pool. */
+  block_size_t mmap_threshold;
+  /* When no block fits, ask `acquire` for another region and allocate from
+   * it, then from older regions and the pool itself; a region is released
+   * as soon as nothing in it is allocated. A NULL `acquire` keeps the pool
+   * at its initial size. Callbacks run under the pool lock of concurrent
+   * pools, whose lock-free paths only serve the initial buffer. */
+  mem_region_provider_t region_provider;
+  /* Seeds the pool's generator of skiplist tower heights, so that pools
+   * given the same seed and calls lay out the same skiplist. */
+  uint64_t seed;
+} mem_pool_config_t;
+
+typedef struct mem_stats
+{
+  uint64_t total_bytes;
+  uint64_t free_bytes; /* free blocks and remainder, heads included */
+  uint64_t used_bytes; /* allocated blocks and pool metadata */
+  uint64_t remainder_bytes;
+  uint64_t largest_free_block; /* biggest free region, head included */
+  /* 1 - largest_free_block / free_bytes: 0 when all free memory is one
+   * region, close to 1 when it is scattered in small blocks */
+  double fragmentation;
+  uint32_t fast_bin_blocks[FAST_BIN_LENGTH]; /* free blocks of 8 * (i+1) */
+  uint32_t sorted_blocks; /* free blocks in the skiplist / TLSF index */
+  uint32_t sorted_block_histogram[STATS_HISTOGRAM_LENGTH];
+  uint32_t tower_heights[SORTED_BLOCK_INDICES_LEVEL + 1]; /* skiplist only */
+  uint32_t arenas; /* regions from the provider, summed up in the above */
+  /* blocks mapped on their own, counted in none of the above */
+  uint32_t mapped_blocks;
+  uint64_t mapped_bytes; /* their mappings, headers included */
+} mem_stats_t;
+
+/* Pool handle API: every pool lives in its own caller-supplied buffer and
+ * shares no state with other pools. A block must be resized and freed
+ * through the pool it was allocated from. Pools are at most POOL_MAX_SIZE
+ * bytes. */
+mem_pool_t *deep_pool_init (void *mem, block_size_t size);
+/* `config` may be NULL for the defaults of deep_pool_init. */
+mem_pool_t *deep_pool_init_with_config (void *mem, block_size_t size,
+                                        mem_pool_config_t const *config);
+/* Unmaps the blocks mapped on their own and releases the regions from the
+ * provider; the buffer is the caller's. */
+void deep_pool_destroy (mem_pool_t *pool);
+void *deep_pool_malloc (mem_pool_t *pool, block_size_t size);
+/* Zeroed `count * size` bytes, or NULL if that overflows. */
+void *deep_pool_calloc (mem_pool_t *pool, uint32_t count,
+                        block_size_t size);
+void *deep_pool_realloc (mem_pool_t *pool, void *ptr, block_size_t size);
+void deep_pool_free (mem_pool_t *pool, void *ptr);
+/* `size` bytes at an address that is a multiple of `alignment`, a power of
+ * two up to ALIGNED_ALLOC_MAX_ALIGNMENT; freed and resized like any block,
+ * though realloc may move it to a less aligned address. Alignment is kept
+ * by deep_pool_migrate only if the new buffer is aligned like the old. */
+void *deep_pool_aligned_alloc (mem_pool_t *pool, uint32_t alignment,
+                               block_size_t size);
+/* Allocate up to `n` blocks of `size` bytes into `out`, carving runs of
+ * neighbouring blocks at once; returns how many were allocated. */
+uint32_t deep_pool_malloc_batch (mem_pool_t *pool, block_size_t size,
+                                 uint32_t n, void **out);
+/* Free `n` blocks (NULL entries are skipped); neighbouring blocks are merged
+ * before being indexed. `ptrs` is reordered in place. */
+void deep_pool_free_batch (mem_pool_t *pool, void **ptrs, uint32_t n);
+/* Read the pool's counters; cheap enough to sample periodically. */
+void deep_pool_stats (mem_pool_t *pool, mem_stats_t *stats);
+/* Move the pool to `new_mem`, `size` bytes at least as big as it, which may
+ * overlap the old buffer; the growth becomes free memory. Blocks inside the
+ * buffer move with it, at the same offsets; blocks mapped on their own and
+ * arenas from the region provider stay where they are. The pool must be
+ * idle meanwhile. The calling thread's cache is flushed; other threads
+ * holding its blocks in their caches must call deep_tcache_flush first, or
+ * those blocks stay allocated. Returns the new handle, i.e. `new_mem`, or
+ * NULL on failure, leaving the pool untouched. */
+mem_pool_t *deep_pool_migrate (mem_pool_t *pool, void *new_mem,
+                               block_size_t size);
+/* Write the pool to the file at `path` as an image deep_pool_restore maps
+ * back at any address, in any process of the same build; the remainder is
+ * left as a hole. The pool must not be in use meanwhile, nor own blocks
+ * outside its buffer (mapped on their own or in regions from the
+ * provider). Blocks held by thread caches stay allocated in the image. */
+bool deep_pool_snapshot (mem_pool_t *pool, char const *path);
+/* Map the image at `path` copy-on-write, so that pools restored from one
+ * file share its pages until they write to them; they have no region
+ * provider. deep_pool_destroy unmaps it. */
+mem_pool_t *deep_pool_restore (char const *path);
+
+/* Thread-safe entry points for a pool shared between threads. Blocks up to
+ * FAST_BIN_MAX_SIZE are served from a per-thread cache that refills from and
+ * flushes to the pool's fast bins in batches; everything else takes the pool
+ * lock. A thread should call deep_tcache_flush before it exits, otherwise its
+ * cached blocks stay allocated. deep_pool_migrate and deep_pool_destroy
+ * flush the calling thread's cache; other threads must flush theirs first.
+ * A cache still bound to a moved or destroyed pool drops its blocks on the
+ * next call instead of handing them back, as long as the old buffer is
+ * still mapped. */
+void *deep_tcache_malloc (mem_pool_t *pool, block_size_t size);
+void deep_tcache_free (mem_pool_t *pool, void *ptr);
+void deep_tcache_flush (void);
+
+/* The same operations on a default pool set up by deep_mem_init. */
+bool deep_mem_init (void *mem, block_size_t size);
+bool deep_mem_init_with_config (void *mem, block_size_t size,
+                                mem_pool_config_t const *config);
 void deep_mem_destroy (void);
-void *deep_malloc (uint32_t size);
-void *deep_realloc (void *ptr, uint32_t size);
+void *deep_malloc (block_size_t size);
+void *deep_calloc (uint32_t count, block_size_t size);
+void *deep_realloc (void *ptr, block_size_t size);
+void *deep_aligned_alloc (uint32_t alignment, block_size_t size);
 void deep_free (void *ptr);
-bool deep_mem_migrate (void *new_mem, uint32_t size);
+uint32_t deep_malloc_batch (block_size_t size, uint32_t n, void **out);
+void deep_free_batch (void **ptrs, uint32_t n);
+bool deep_mem_stats (mem_stats_t *stats);
+/* Append a record of every deep_malloc / deep_calloc / deep_realloc /
+ * deep_aligned_alloc / deep_free (and the batch forms) to the file at
+ * `path`, which is mapped into memory and grown as needed;
+ * tools/deep_replay.c plays it back. Tracing stops at deep_mem_trace_stop
+ * or at exit. */
+bool deep_mem_trace_start (char const *path);
+void deep_mem_trace_stop (void);
+/* deep_pool_snapshot of the default pool, and deep_pool_restore of one,
+ * which replaces the default pool like deep_mem_init does. */
+bool deep_mem_snapshot (char const *path);
+bool deep_mem_restore (char const *path);
+/* Move the pool into `new_mem`, which must be at least as big as the current
+ * pool; any extra space becomes remainder. Allocated blocks keep their offset
+ * from the start of the pool, so callers rebase their pointers by
+ * (new_mem - old_mem); blocks mapped on their own (see mmap_threshold) or
+ * in regions from the provider do not move. The old buffer may overlap the
+ * new one. */
+bool deep_mem_migrate (void *new_mem, block_size_t size);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* _DEEP_MEM_ALLOC_H */
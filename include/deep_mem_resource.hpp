@@ -0,0 +1,169 @@
+#ifndef _DEEP_MEM_RESOURCE_HPP
+#define _DEEP_MEM_RESOURCE_HPP
+
+/* C++17 adapters putting standard containers in a deep_mem pool:
+ * deep::pool_resource, a std::pmr::memory_resource for the std::pmr
+ * containers, and deep::pool_allocator<T>, an allocator for the others.
+ * Both are bound to a pool handle, or to the default pool when built
+ * without one, and forward the size and alignment of every request to
+ * deep_pool_malloc / deep_pool_aligned_alloc (deep_malloc /
+ * deep_aligned_alloc); block heads know their size, so deallocation needs
+ * neither. Alignments beyond ALIGNED_ALLOC_MAX_ALIGNMENT, and requests the
+ * pool cannot serve, throw std::bad_alloc. */
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include "deep_mem.h"
+
+namespace deep
+{
+
+namespace detail
+{
+
+/* Blocks start 8-byte aligned and their payloads follow the head, so plain
+ * blocks are aligned to the payload offset: 8 bytes on 64-bit platforms,
+ * 4 on 32-bit ones. */
+constexpr std::size_t payload_alignment = offsetof (fast_block_t, payload);
+
+inline void *
+allocate (mem_pool_t *pool, std::size_t bytes, std::size_t alignment)
+{
+  void *ret = nullptr;
+
+  if (bytes == 0)
+    {
+      bytes = 1; /* a distinct pointer, as operator new gives */
+    }
+  if (bytes <= POOL_MAX_SIZE && alignment <= ALIGNED_ALLOC_MAX_ALIGNMENT)
+    {
+      if (alignment <= payload_alignment)
+        {
+          ret = pool != nullptr ? deep_pool_malloc (pool, bytes)
+                                : deep_malloc (bytes);
+        }
+      else
+        {
+          ret = pool != nullptr
+                    ? deep_pool_aligned_alloc (pool, alignment, bytes)
+                    : deep_aligned_alloc (alignment, bytes);
+        }
+    }
+  if (ret == nullptr)
+    {
+      throw std::bad_alloc ();
+    }
+  return ret;
+}
+
+inline void
+deallocate (mem_pool_t *pool, void *ptr) noexcept
+{
+  if (pool != nullptr)
+    {
+      deep_pool_free (pool, ptr);
+    }
+  else
+    {
+      deep_free (ptr);
+    }
+}
+
+} // namespace detail
+
+class pool_resource : public std::pmr::memory_resource
+{
+public:
+  /* on the default pool */
+  pool_resource () noexcept : pool_ (nullptr) {}
+  explicit pool_resource (mem_pool_t *pool) noexcept : pool_ (pool) {}
+
+  mem_pool_t *
+  pool () const noexcept
+  {
+    return pool_;
+  }
+
+private:
+  void *
+  do_allocate (std::size_t bytes, std::size_t alignment) override
+  {
+    return detail::allocate (pool_, bytes, alignment);
+  }
+
+  void
+  do_deallocate (void *ptr, std::size_t, std::size_t) override
+  {
+    detail::deallocate (pool_, ptr);
+  }
+
+  bool
+  do_is_equal (const std::pmr::memory_resource &other) const noexcept override
+  {
+    const pool_resource *resource = dynamic_cast<const pool_resource *> (&other);
+    return resource != nullptr && resource->pool_ == pool_;
+  }
+
+  mem_pool_t *pool_;
+};
+
+template <typename T> class pool_allocator
+{
+public:
+  using value_type = T;
+
+  /* on the default pool */
+  pool_allocator () noexcept : pool_ (nullptr) {}
+  explicit pool_allocator (mem_pool_t *pool) noexcept : pool_ (pool) {}
+  template <typename U>
+  pool_allocator (const pool_allocator<U> &other) noexcept
+      : pool_ (other.pool ())
+  {
+  }
+
+  T *
+  allocate (std::size_t n)
+  {
+    if (n > std::numeric_limits<std::size_t>::max () / sizeof (T))
+      {
+        throw std::bad_alloc ();
+      }
+    return static_cast<T *> (
+        detail::allocate (pool_, n * sizeof (T), alignof (T)));
+  }
+
+  void
+  deallocate (T *ptr, std::size_t) noexcept
+  {
+    detail::deallocate (pool_, ptr);
+  }
+
+  mem_pool_t *
+  pool () const noexcept
+  {
+    return pool_;
+  }
+
+private:
+  mem_pool_t *pool_;
+};
+
+template <typename T, typename U>
+bool
+operator== (const pool_allocator<T> &a, const pool_allocator<U> &b) noexcept
+{
+  return a.pool () == b.pool ();
+}
+
+template <typename T, typename U>
+bool
+operator!= (const pool_allocator<T> &a, const pool_allocator<U> &b) noexcept
+{
+  return !(a == b);
+}
+
+} // namespace deep
+
+#endif /* _DEEP_MEM_RESOURCE_HPP */
@@ -0,0 +1,93 @@
+#ifndef _DEEP_PROFILE_H
+#define _DEEP_PROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "deep_mem.h"
+
+/* Sampling heap profiler of the default pool. deep_malloc_profiled (size)
+ * is deep_malloc that, while profiling runs, samples about one block per
+ * `interval` bytes allocated by each thread (at exponentially distributed
+ * distances) and charges it to its call site, which owns a static
+ * profile_site_t like the log macros do. A sampled block counts as live
+ * until deep_free, deep_free_batch or deep_realloc lets go of it; blocks
+ * freed through deep_pool_* are not seen. While profiling is stopped, a
+ * call costs one flag test on top of deep_malloc. */
+#define PROFILE_DEFAULT_INTERVAL (512 * 1024)
+/* counters of the filter telling deep_free which blocks may be sampled */
+#define PROFILE_FILTER_LENGTH (4096)
+
+typedef struct profile_site
+{
+  const char *file;
+  const char *func;
+  unsigned int line;
+  bool listed; /* sampled since profiling started */
+  struct profile_site *next; /* in the list of listed sites */
+  /* estimates, each sample weighing as many blocks and bytes as it stands
+   * for on average */
+  uint64_t alloc_count;
+  uint64_t alloc_bytes;
+  uint64_t live_count;
+  uint64_t live_bytes;
+  uint64_t live_samples; /* sampled blocks not freed yet */
+} profile_site_t;
+
+extern bool profile_enabled;
+
+/* deep_malloc (size), sampled while profiling runs */
+#define deep_malloc_profiled(size)                                            \
+  ({                                                                          \
+    static profile_site_t _profile_site                                       \
+        = { __FILE__, __FUNCTION__, __LINE__, false, NULL, 0, 0, 0, 0, 0 };   \
+    __builtin_expect (__atomic_load_n (&profile_enabled, __ATOMIC_RELAXED),   \
+                      0)                                                      \
+        ? deep_malloc_at (&_profile_site, (size))                             \
+        : deep_malloc (size);                                                 \
+  })
+
+void *deep_malloc_at (profile_site_t *site, block_size_t size);
+
+/* Forget all samples and start sampling about once every `interval`
+ * bytes (PROFILE_DEFAULT_INTERVAL if 0). */
+void deep_mem_profile_start (block_size_t interval);
+/* Take no more samples; blocks sampled so far are followed until freed. */
+void deep_mem_profile_stop (void);
+/* Copy up to `max` sites sampled since profiling started into `sites`,
+ * most live bytes first; returns how many there are in all. */
+uint32_t deep_mem_profile_sites (profile_site_t *sites, uint32_t max);
+/* One line per site: live bytes and blocks, then allocated ones. */
+void deep_mem_profile_dump (FILE *out);
+
+/* Recording, used by the default-pool wrappers of deep_mem.c, which name
+ * blocks by their offset from the pool; key 0 marks an empty slot of the
+ * table of sampled blocks. */
+typedef struct profile_sample
+{
+  uint64_t key;
+  profile_site_t *site;
+  block_size_t size;
+  double weight; /* blocks this sample stands for */
+  uint64_t count; /* its share of the site's counters */
+  uint64_t bytes;
+} profile_sample_t;
+
+extern uint64_t profile_live_samples;
+bool profile_tick (block_size_t size);
+void profile_sample (profile_site_t *site, uint64_t key, block_size_t size);
+void profile_release (uint64_t key);
+bool profile_take (uint64_t key, profile_sample_t *sample);
+void profile_put (profile_sample_t const *sample, uint64_t key,
+                  block_size_t size);
+void profile_forget (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DEEP_PROFILE_H */
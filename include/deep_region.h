@@ -0,0 +1,65 @@
+#ifndef _DEEP_REGION_H
+#define _DEEP_REGION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "deep_mem.h"
+
+/* Regions hand out temporaries by bumping a pointer through chunks taken
+ * from the pool, with no head per allocation and no way to free one: a
+ * reset takes everything back at once and keeps the chunks for what comes
+ * next, and the end of the region frees them. A region is not thread-safe
+ * and must end before its pool is migrated or written to an image. */
+#define REGION_DEFAULT_CHUNK_SIZE (64 * 1024)
+
+/* Chunks are pool blocks starting with this header; the first one also
+ * holds the mem_region_t. */
+typedef struct region_chunk
+{
+  struct region_chunk *next; /* allocated after this one */
+  block_size_t size; /* bytes after the header */
+} region_chunk_t;
+
+typedef struct mem_region
+{
+  mem_pool_t *pool;
+  /* the region this one is nested in, on the calling thread's stack of
+   * deep_region_begin */
+  struct mem_region *outer;
+  region_chunk_t *first;
+  region_chunk_t *current; /* allocations are bumped from */
+  uint8_t *top; /* next allocation in current */
+  uint8_t *end; /* of current */
+  block_size_t chunk_size; /* of new chunks, but those of bigger requests */
+} mem_region_t;
+
+/* A region of `pool` allocating chunks of `chunk_size` bytes
+ * (REGION_DEFAULT_CHUNK_SIZE if 0), or NULL if the first cannot be. */
+mem_region_t *deep_pool_region_begin (mem_pool_t *pool,
+                                      block_size_t chunk_size);
+/* `size` bytes, 8-byte aligned and zeroed in pools zeroing on alloc, or
+ * NULL if no chunk can be allocated. */
+void *deep_pool_region_alloc (mem_region_t *region, block_size_t size);
+/* Take back every allocation in constant time, but in pools zeroing on
+ * free, which first scrub what was handed out. */
+void deep_pool_region_reset (mem_region_t *region);
+/* Free every chunk, and the region with them. */
+void deep_pool_region_end (mem_region_t *region);
+
+/* The same on the default pool, for a stack of regions per thread: begin
+ * pushes a region, the others act on the innermost one, and end pops it.
+ * deep_region_alloc returns NULL outside of any region. */
+bool deep_region_begin (block_size_t chunk_size);
+void *deep_region_alloc (block_size_t size);
+void deep_region_reset (void);
+void deep_region_end (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DEEP_REGION_H */
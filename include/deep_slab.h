@@ -0,0 +1,78 @@
+#ifndef _DEEP_SLAB_H
+#define _DEEP_SLAB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "deep_mem.h"
+
+/* Slab caches hand out objects of one size packed in slabs, blocks of the
+ * pool aligned to their size, a power of two: an object finds its slab by
+ * masking its address, so objects carry no head and allocating or freeing
+ * one takes constant time. A slab fits in a page, which bounds the object
+ * size. Links between a cache and its slabs are offsets, so caches move
+ * with deep_pool_migrate and pool images like any block, provided their
+ * slabs are not in regions from the provider; alignment is kept as for
+ * deep_pool_aligned_alloc. A cache is not thread-safe. */
+#define SLAB_MIN_SIZE (256)
+#define SLAB_MAX_SIZE (ALIGNED_ALLOC_MAX_ALIGNMENT)
+
+/* At the start of every slab; its objects follow. */
+typedef struct slab
+{
+  /* neighbours in the cache's partial or full list, as offsets from the
+   * cache, 0 for none */
+  int64_t prev;
+  int64_t next;
+  uint32_t used; /* objects handed out */
+  /* objects handed out at least once; the others, after them, have never
+   * been touched */
+  uint32_t carved;
+  /* 1 + index of the first freed object, which holds that of the next in
+   * its first four bytes; 0 if none */
+  uint32_t free;
+} slab_t;
+
+typedef struct slab_cache
+{
+  block_size_t object_size; /* a multiple of 8 */
+  block_size_t slab_size; /* a power of two, the slabs' alignment */
+  uint32_t objects_per_slab;
+  uint32_t slab_count;
+  uint64_t object_count; /* handed out */
+  /* first slab with free objects and first slab without, as offsets from
+   * the cache, 0 for none */
+  int64_t partial;
+  int64_t full;
+} slab_cache_t;
+
+/* A cache of `object_size`-byte objects in slabs of the smallest power of
+ * two holding `objects_per_slab` of them, at most SLAB_MAX_SIZE; a slab
+ * holds as many as fit. NULL if not even one object fits in a slab. */
+slab_cache_t *deep_pool_slab_create (mem_pool_t *pool,
+                                     block_size_t object_size,
+                                     uint32_t objects_per_slab);
+/* Free every slab of the cache, and the cache. */
+void deep_pool_slab_destroy (mem_pool_t *pool, slab_cache_t *cache);
+/* An object, zeroed in pools zeroing on alloc, or NULL if no slab can be
+ * allocated. */
+void *deep_pool_slab_alloc (mem_pool_t *pool, slab_cache_t *cache);
+/* Give back an object of the cache; a slab left empty is freed unless it
+ * is the only one with free objects. NULL is ignored. */
+void deep_pool_slab_free (mem_pool_t *pool, slab_cache_t *cache, void *ptr);
+
+/* The same operations on the default pool. */
+slab_cache_t *deep_slab_create (block_size_t object_size,
+                                uint32_t objects_per_slab);
+void deep_slab_destroy (slab_cache_t *cache);
+void *deep_slab_alloc (slab_cache_t *cache);
+void deep_slab_free (slab_cache_t *cache, void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DEEP_SLAB_H */
@@ -0,0 +1,66 @@
+#ifndef _DEEP_TRACE_H
+#define _DEEP_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "deep_mem.h"
+
+/* A trace file is a trace_header_t followed by `count` trace_record_t.
+ * Blocks are named by their payload offset from the start of the default
+ * pool, which is never 0, so 0 stands for NULL; an offset is reused once
+ * its block is freed. */
+#define TRACE_MAGIC "DMTRACE1"
+#define TRACE_INITIAL_RECORDS (1 << 20)
+/* set on every record of a batch call but its last */
+#define TRACE_FLAG_BATCH_NEXT (1 << 0)
+
+typedef enum trace_op
+{
+  TRACE_OP_MALLOC = 1, /* size -> id */
+  TRACE_OP_CALLOC, /* size (count * size) -> id */
+  TRACE_OP_REALLOC, /* id, size -> new_id */
+  TRACE_OP_FREE, /* id */
+  TRACE_OP_ALIGNED_ALLOC, /* size, alignment (in new_id) -> id */
+} trace_op_t;
+
+/* 24 bytes, 40 in DEEP_MEM_WIDE builds; either only reads its own */
+typedef struct trace_record
+{
+  uint64_t timestamp; /* ns since the trace was opened */
+  block_size_t size;
+  block_size_t id;
+  block_size_t new_id;
+  uint8_t op;
+  uint8_t flags; /* TRACE_FLAG_* */
+  uint8_t _padding[2];
+} trace_record_t;
+
+typedef struct trace_header
+{
+  char magic[8];
+  uint32_t record_size;
+  uint32_t _padding;
+  uint64_t count;
+  uint64_t pool_size; /* of the traced pool, when tracing started */
+} trace_header_t;
+
+/* Recording, used by the default-pool wrappers of deep_mem.c. */
+extern bool trace_enabled;
+bool trace_open (const char *path, uint64_t pool_size);
+void trace_close (void);
+void trace_append (trace_op_t op, block_size_t size, block_size_t id,
+                   block_size_t new_id);
+/* One record per non-NULL block of a deep_malloc_batch / deep_free_batch,
+ * written together; ids are offsets from `base`. */
+void trace_append_batch (trace_op_t op, block_size_t size, void *const *ptrs,
+                         uint32_t n, void const *base);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DEEP_TRACE_H */
@@ -5,6 +5,12 @@
 
 uint64_t next (void);
 
+/* The same generator on a caller-held state, e.g. one per pool, so that
+   sequences neither interfere nor depend on other users. seed_r fills the
+   state from a 64-bit seed through splitmix64; any seed will do. */
+void seed_r (uint64_t state[2], uint64_t seed);
+uint64_t next_r (uint64_t state[2]);
+
 /* This is the jump function for the generator. It is equivalent
    to 2^64 calls to next(); it can be used to generate 2^64
    non-overlapping subsequences for parallel computations. */
@@ -27,8 +27,60 @@ Description: dump/debug funtions for logs.
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 #include "deep_log.h"
 
+/* kinds of recorded arguments, as read with va_arg */
+typedef enum log_arg_type
+{
+  LOG_ARG_INT = 0,
+  LOG_ARG_LONG,
+  LOG_ARG_LLONG,
+  LOG_ARG_INTMAX,
+  LOG_ARG_SIZE,
+  LOG_ARG_PTRDIFF,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_LDOUBLE, /* stored as a double */
+  LOG_ARG_POINTER,
+  LOG_ARG_STRING, /* copied, NUL-terminated, padded to 8 bytes */
+} log_arg_type_t;
+
+/* One message in a ring: the header, then an 8-byte slot per argument
+ * (strings inline). A record with a NULL site pads the end of the ring;
+ * an end too short for a header is skipped without one. */
+typedef struct log_record_head
+{
+  const log_site_t *site;
+  uint32_t size;
+  uint32_t _padding;
+} log_record_head_t;
+
+/* Single-producer single-consumer ring: the owning thread advances `head`,
+ * the drainer (serialised by drain_lock) advances `tail`. Both only grow. */
+typedef struct log_ring
+{
+  uint64_t head;
+  uint64_t tail;
+  struct log_ring *next;
+  int in_use; /* owned by a live thread */
+  uint32_t _padding;
+  uint8_t data[LOG_RING_SIZE];
+} log_ring_t;
+
+static log_ring_t *rings;
+static _Thread_local log_ring_t *thread_ring;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static pthread_t drainer;
+static volatile bool drainer_running;
+static unsigned int drainer_interval_us;
+
 void log_printf (const char* pFileName, unsigned int uiLine, const char* pFnucName, const char *pFlag, char *LogFmtBuf, ...)
 {
 	va_list args;
@@ -54,6 +106,7 @@ void log_data(const char *pFileName, unsigned int uiLine, const char* pFnucName,
     unsigned char *p;
     unsigned char *pucAddr = pucBuf;
 
+    log_flush ();
     if(pcStr)
     {
         log_printf (pFileName, uiLine, pFnucName, "<dump>", "[%s]: length = %d (0x%X)\r\n",pcStr, usLen, usLen);
@@ -112,4 +165,469 @@ void log_data(const char *pFileName, unsigned int uiLine, const char* pFnucName,
     printf ("\r\n");
 }
 
+/** Work out the va_arg type of every argument of `fmt`, once per site.
+ *
+ * NOTE:
+ *   - %n, wide strings and more than LOG_MAX_ARGS arguments cannot be
+ *     recorded; such sites are printed synchronously
+ **/
+static int
+_log_parse_format (const char *fmt, uint64_t *types)
+{
+  int n = 0;
+
+  *types = 0;
+  for (const char *p = fmt; *p != '\0'; p++)
+    {
+      if (*p != '%')
+        {
+          continue;
+        }
+      if (*++p == '%')
+        {
+          continue;
+        }
+
+      log_arg_type_t integer = LOG_ARG_INT;
+      bool long_double = false;
+      bool wide = false;
+      for (; *p != '\0' && strchr ("-+ #0123456789.*hlLjzt", *p) != NULL; p++)
+        {
+          switch (*p)
+            {
+            case '*':
+              if (n == LOG_MAX_ARGS)
+                {
+                  return LOG_SITE_SYNC;
+                }
+              *types |= (uint64_t)LOG_ARG_INT << (4 * n++);
+              break;
+            case 'l':
+              integer = integer == LOG_ARG_LONG ? LOG_ARG_LLONG : LOG_ARG_LONG;
+              wide = true;
+              break;
+            case 'L':
+              long_double = true;
+              break;
+            case 'j':
+              integer = LOG_ARG_INTMAX;
+              break;
+            case 'z':
+              integer = LOG_ARG_SIZE;
+              break;
+            case 't':
+              integer = LOG_ARG_PTRDIFF;
+              break;
+            }
+        }
+
+      log_arg_type_t type;
+      if (*p == '\0' || n == LOG_MAX_ARGS)
+        {
+          return LOG_SITE_SYNC;
+        }
+      else if (strchr ("diouxXc", *p) != NULL)
+        {
+          type = *p == 'c' ? LOG_ARG_INT : integer;
+        }
+      else if (strchr ("eEfFgGaA", *p) != NULL)
+        {
+          type = long_double ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+        }
+      else if (*p == 'p')
+        {
+          type = LOG_ARG_POINTER;
+        }
+      else if (*p == 's' && !wide)
+        {
+          type = LOG_ARG_STRING;
+        }
+      else
+        {
+          return LOG_SITE_SYNC;
+        }
+      *types |= (uint64_t)type << (4 * n++);
+    }
+
+  return n;
+}
+
+static void
+_log_release_ring (void *ring)
+{
+  __atomic_store_n (&((log_ring_t *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+_log_init (void)
+{
+  pthread_key_create (&ring_key, _log_release_ring);
+  atexit (log_flush);
+}
+
+/** The calling thread's ring: one left by an exited thread if any,
+ * otherwise a new one pushed onto the global list.
+ **/
+static log_ring_t *
+_log_get_ring (void)
+{
+  log_ring_t *ring;
+
+  if (thread_ring != NULL)
+    {
+      return thread_ring;
+    }
+  pthread_once (&log_once, _log_init);
+
+  for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next)
+    {
+      int idle = 0;
+      if (__atomic_compare_exchange_n (&ring->in_use, &idle, 1, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+          break;
+        }
+    }
+  if (ring == NULL)
+    {
+      if ((ring = calloc (1, sizeof (log_ring_t))) == NULL)
+        {
+          return NULL;
+        }
+      ring->in_use = 1;
+      ring->next = __atomic_load_n (&rings, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n (&rings, &ring->next, ring, true,
+                                           __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED))
+        ;
+    }
+
+  pthread_setspecific (ring_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+/** Reserve `size` contiguous bytes at the head of the ring, flushing when
+ * it is full. The bytes are published by advancing head afterwards.
+ **/
+static uint8_t *
+_log_reserve (log_ring_t *ring, uint32_t size)
+{
+  for (;;)
+    {
+      uint64_t head = ring->head;
+      uint64_t tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+      uint32_t offset = head % LOG_RING_SIZE;
+      uint32_t to_end = LOG_RING_SIZE - offset;
+      uint32_t needed = size <= to_end ? size : to_end + size;
+
+      if (LOG_RING_SIZE - (head - tail) >= needed)
+        {
+          if (size > to_end)
+            {
+              if (to_end >= sizeof (log_record_head_t))
+                {
+                  log_record_head_t *pad
+                      = (log_record_head_t *)&ring->data[offset];
+                  pad->site = NULL;
+                  pad->size = to_end;
+                }
+              __atomic_store_n (&ring->head, head + to_end, __ATOMIC_RELEASE);
+              offset = 0;
+            }
+          return &ring->data[offset];
+        }
+      log_flush ();
+    }
+}
+
+void
+log_record (log_site_t *site, const char *fmt, ...)
+{
+  uint64_t slots[LOG_MAX_ARGS];
+  const char *strings[LOG_MAX_ARGS];
+  uint32_t lengths[LOG_MAX_ARGS];
+  uint32_t size = sizeof (log_record_head_t);
+  log_ring_t *ring;
+  va_list args;
+  int nargs = __atomic_load_n (&site->nargs, __ATOMIC_ACQUIRE);
+  uint64_t types;
+
+  if (nargs == LOG_SITE_UNPARSED)
+    {
+      /* racing first callers store the same result */
+      nargs = _log_parse_format (fmt, &types);
+      __atomic_store_n (&site->arg_types, types, __ATOMIC_RELAXED);
+      __atomic_store_n (&site->nargs, nargs, __ATOMIC_RELEASE);
+    }
+  types = __atomic_load_n (&site->arg_types, __ATOMIC_RELAXED);
+  if (nargs == LOG_SITE_SYNC || (ring = _log_get_ring ()) == NULL)
+    {
+      char logbuf[256];
+      va_start (args, fmt);
+      vsnprintf (logbuf, sizeof (logbuf), fmt, args);
+      va_end (args);
+      log_flush ();
+      log_printf (site->file, site->line, site->func, site->flag, "%s",
+                  logbuf);
+      return;
+    }
+
+  va_start (args, fmt);
+  for (int i = 0; i < nargs; i++)
+    {
+      switch ((log_arg_type_t)((types >> (4 * i)) & 0xf))
+        {
+        case LOG_ARG_INT:
+          slots[i] = (uint64_t)va_arg (args, int);
+          break;
+        case LOG_ARG_LONG:
+          slots[i] = (uint64_t)va_arg (args, long);
+          break;
+        case LOG_ARG_LLONG:
+          slots[i] = (uint64_t)va_arg (args, long long);
+          break;
+        case LOG_ARG_INTMAX:
+          slots[i] = (uint64_t)va_arg (args, intmax_t);
+          break;
+        case LOG_ARG_SIZE:
+          slots[i] = (uint64_t)va_arg (args, size_t);
+          break;
+        case LOG_ARG_PTRDIFF:
+          slots[i] = (uint64_t)va_arg (args, ptrdiff_t);
+          break;
+        case LOG_ARG_DOUBLE:
+        case LOG_ARG_LDOUBLE:
+          {
+            double value
+                = ((types >> (4 * i)) & 0xf) == LOG_ARG_DOUBLE
+                      ? va_arg (args, double)
+                      : (double)va_arg (args, long double);
+            memcpy (&slots[i], &value, sizeof (double));
+          }
+          break;
+        case LOG_ARG_POINTER:
+          slots[i] = (uint64_t)(uintptr_t)va_arg (args, void *);
+          break;
+        case LOG_ARG_STRING:
+          strings[i] = va_arg (args, const char *);
+          if (strings[i] == NULL)
+            {
+              strings[i] = "(null)";
+            }
+          lengths[i] = strnlen (strings[i], LOG_STRING_MAX);
+          size += (lengths[i] + 1 + 7) & ~7U;
+          continue;
+        }
+      size += sizeof (uint64_t);
+    }
+  va_end (args);
+
+  uint8_t *record = _log_reserve (ring, size);
+  uint8_t *p = record + sizeof (log_record_head_t);
+  ((log_record_head_t *)record)->site = site;
+  ((log_record_head_t *)record)->size = size;
+  for (int i = 0; i < nargs; i++)
+    {
+      if (((types >> (4 * i)) & 0xf) == LOG_ARG_STRING)
+        {
+          memcpy (p, strings[i], lengths[i]);
+          p[lengths[i]] = '\0';
+          p += (lengths[i] + 1 + 7) & ~7U;
+        }
+      else
+        {
+          memcpy (p, &slots[i], sizeof (uint64_t));
+          p += sizeof (uint64_t);
+        }
+    }
+  __atomic_store_n (&ring->head, ring->head + size, __ATOMIC_RELEASE);
+}
+
+/** Format one argument with its own conversion spec `spec`; `stars`
+ * holds the values of `*` width / precision before it.
+ **/
+static int
+_log_format_arg (char *buf, size_t len, const char *spec, log_arg_type_t type,
+                 const uint8_t *slot, const int *stars, int nstars)
+{
+  uint64_t v;
+  double d;
 
+  memcpy (&v, slot, sizeof (v));
+  memcpy (&d, slot, sizeof (d));
+#define _LOG_SNPRINTF(value)                                                  \
+  (nstars == 0   ? snprintf (buf, len, spec, value)                           \
+   : nstars == 1 ? snprintf (buf, len, spec, stars[0], value)                 \
+                 : snprintf (buf, len, spec, stars[0], stars[1], value))
+  switch (type)
+    {
+    case LOG_ARG_INT:
+      return _LOG_SNPRINTF ((int)v);
+    case LOG_ARG_LONG:
+      return _LOG_SNPRINTF ((long)v);
+    case LOG_ARG_LLONG:
+      return _LOG_SNPRINTF ((long long)v);
+    case LOG_ARG_INTMAX:
+      return _LOG_SNPRINTF ((intmax_t)v);
+    case LOG_ARG_SIZE:
+      return _LOG_SNPRINTF ((size_t)v);
+    case LOG_ARG_PTRDIFF:
+      return _LOG_SNPRINTF ((ptrdiff_t)v);
+    case LOG_ARG_DOUBLE:
+    case LOG_ARG_LDOUBLE:
+      return _LOG_SNPRINTF (d);
+    case LOG_ARG_POINTER:
+      return _LOG_SNPRINTF ((void *)(uintptr_t)v);
+    case LOG_ARG_STRING:
+      return _LOG_SNPRINTF ((const char *)slot);
+    }
+#undef _LOG_SNPRINTF
+  return 0;
+}
+
+/** Rebuild the message of `record` into `out` by walking its format and
+ * printing each conversion with the recorded value.
+ **/
+static void
+_log_format_record (const log_record_head_t *record, char *out, size_t len)
+{
+  const log_site_t *site = record->site;
+  const uint8_t *slot = (const uint8_t *)(record + 1);
+  uint64_t types = __atomic_load_n (&site->arg_types, __ATOMIC_RELAXED);
+  size_t used = 0;
+  int arg = 0;
+
+  for (const char *p = site->fmt; *p != '\0' && used + 1 < len; p++)
+    {
+      if (*p != '%' || p[1] == '%')
+        {
+          out[used++] = *p;
+          p += *p == '%';
+          continue;
+        }
+
+      char spec[32];
+      int stars[2];
+      int nstars = 0;
+      size_t n = 0;
+      const char *start = p++;
+      while (*p != '\0' && strchr ("-+ #0123456789.*hlLjzt", *p) != NULL)
+        {
+          p++;
+        }
+      for (const char *q = start; q <= p && n + 1 < sizeof (spec); q++)
+        {
+          if (*q == 'L')
+            {
+              continue; /* long doubles were recorded as doubles */
+            }
+          if (*q == '*')
+            {
+              int64_t star;
+              memcpy (&star, slot, sizeof (star));
+              stars[nstars++ & 1] = (int)star;
+              slot += sizeof (uint64_t);
+              arg++;
+            }
+          spec[n++] = *q;
+        }
+      spec[n] = '\0';
+
+      log_arg_type_t type = (types >> (4 * arg++)) & 0xf;
+      int written = _log_format_arg (out + used, len - used, spec, type, slot,
+                                     stars, nstars);
+      if (written > 0)
+        {
+          used += (size_t)written < len - used ? (size_t)written
+                                               : len - used - 1;
+        }
+      slot += type == LOG_ARG_STRING
+                  ? (strlen ((const char *)slot) + 1 + 7) & ~7U
+                  : sizeof (uint64_t);
+    }
+  out[used] = '\0';
+}
+
+void
+log_flush (void)
+{
+  char logbuf[256];
+
+  pthread_mutex_lock (&drain_lock);
+  for (log_ring_t *ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE);
+       ring != NULL; ring = ring->next)
+    {
+      uint64_t tail = ring->tail;
+      uint64_t head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+
+      while (tail != head)
+        {
+          uint32_t to_end = LOG_RING_SIZE - tail % LOG_RING_SIZE;
+          if (to_end < sizeof (log_record_head_t))
+            {
+              /* too short for a pad record, see _log_reserve */
+              tail += to_end;
+              continue;
+            }
+          const log_record_head_t *record
+              = (const log_record_head_t *)&ring->data[tail % LOG_RING_SIZE];
+          if (record->site != NULL)
+            {
+              _log_format_record (record, logbuf, sizeof (logbuf));
+              printf ("%s:%d, %s(), %s, %s\r\n", record->site->file,
+                      record->site->line, record->site->func,
+                      record->site->flag, logbuf);
+            }
+          tail += record->size;
+        }
+      __atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+  fflush (stdout);
+  pthread_mutex_unlock (&drain_lock);
+}
+
+static void *
+_log_drain_loop (void *arg)
+{
+  struct timespec interval = { drainer_interval_us / 1000000,
+                               drainer_interval_us % 1000000 * 1000 };
+
+  (void)arg;
+  while (__atomic_load_n (&drainer_running, __ATOMIC_ACQUIRE))
+    {
+      log_flush ();
+      nanosleep (&interval, NULL);
+    }
+  return NULL;
+}
+
+int
+log_start_drainer (unsigned int interval_us)
+{
+  if (drainer_running)
+    {
+      return 0;
+    }
+  drainer_interval_us = interval_us;
+  drainer_running = true;
+  if (pthread_create (&drainer, NULL, _log_drain_loop, NULL) != 0)
+    {
+      drainer_running = false;
+      return -1;
+    }
+  return 0;
+}
+
+void
+log_stop_drainer (void)
+{
+  if (!drainer_running)
+    {
+      return;
+    }
+  __atomic_store_n (&drainer_running, false, __ATOMIC_RELEASE);
+  pthread_join (drainer, NULL);
+  log_flush ();
+}
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
 #include "deep_mem.h"
 #include "deep_log.h"
 #define WASM_FILE_SIZE 1024
@@ -11,6 +13,10 @@
 #define ITER 1000
 
 uint8_t deepvm_mempool[DEEPVM_MEMPOOL_SIZE]= {0};
+/* a concurrent pool, for the thread caches */
+uint8_t deepvm_shared_mempool[DEEPVM_MEMPOOL_SIZE]= {0};
+/* where pools are migrated to, twice as big */
+uint8_t deepvm_grown_mempool[2 * DEEPVM_MEMPOOL_SIZE]= {0};
 uint8_t example[100]= {"This is a example for logsys."};
 
 static void
@@ -44,6 +50,360 @@ void cycletest(uint32_t n) {
   }
 }
 
+/* Zero-byte blocks still get room for the free-list link: freeing one must
+   leave the block carved next to it intact. */
+static bool
+zero_size_test (void)
+{
+  mem_stats_t before, after;
+
+  printf ("\nTEST ON MALLOCING/FREEING 0 bytes: \n\n");
+  deep_mem_stats (&before);
+  uint8_t *below = deep_malloc (24);
+  uint8_t *zero = deep_malloc (0);
+  uint8_t *above = deep_malloc (24);
+  uint8_t *zero_calloc = deep_calloc (3, 0);
+  uint8_t *zero_realloc = deep_realloc (NULL, 0);
+  deep_free (zero);
+  deep_free (zero_calloc);
+  deep_free (zero_realloc);
+  deep_free (below);
+  deep_free (above);
+  deep_mem_stats (&after);
+
+  if (after.used_bytes != before.used_bytes)
+    {
+      deep_error ("%llu bytes lost freeing 0-byte blocks",
+                  (unsigned long long)(after.used_bytes - before.used_bytes));
+      return false;
+    }
+  return true;
+}
+
+/* The same through a thread cache, whose refills link blocks carved side by
+   side. */
+static bool
+zero_size_tcache_test (void)
+{
+  mem_pool_config_t config = { .concurrent = true };
+  mem_pool_t *pool = deep_pool_init_with_config (
+      deepvm_shared_mempool, DEEPVM_MEMPOOL_SIZE, &config);
+  mem_stats_t before, after;
+
+  printf ("\nTEST ON CACHING 0 bytes: \n\n");
+  deep_pool_stats (pool, &before);
+  uint8_t *first = deep_tcache_malloc (pool, 0);
+  uint8_t *second = deep_tcache_malloc (pool, 0);
+  deep_tcache_free (pool, first);
+  deep_tcache_free (pool, second);
+  deep_tcache_flush ();
+  deep_pool_stats (pool, &after);
+  deep_pool_destroy (pool);
+
+  if (after.used_bytes != before.used_bytes)
+    {
+      deep_error ("%llu bytes lost caching 0-byte blocks",
+                  (unsigned long long)(after.used_bytes - before.used_bytes));
+      return false;
+    }
+  return true;
+}
+
+/* Batches: 0-byte blocks carved side by side, and pointers passed twice
+   to deep_free_batch, which frees them once. */
+static bool
+batch_test (void)
+{
+  mem_stats_t before, after;
+  void *zeros[8], *blocks[4];
+
+  printf ("\nTEST ON BATCHES: \n\n");
+  deep_mem_stats (&before);
+  uint32_t zero_count = deep_malloc_batch (0, 8, zeros);
+  uint32_t count = deep_malloc_batch (200, 4, blocks);
+  /* keeps the blocks above off the remainder */
+  uint8_t *guard = deep_malloc (24);
+  deep_free (zeros[3]);
+  zeros[3] = NULL;
+  deep_free_batch (zeros, zero_count);
+  if (count == 4)
+    {
+      void *twice[] = { blocks[1], blocks[0], blocks[1], zeros[0],
+                        blocks[2], blocks[3], blocks[2] };
+      deep_free_batch (twice, sizeof (twice) / sizeof (*twice));
+    }
+  deep_free (guard);
+  deep_mem_stats (&after);
+
+  if (after.used_bytes != before.used_bytes)
+    {
+      deep_error ("%lld bytes lost freeing batches",
+                  (long long)(after.used_bytes - before.used_bytes));
+      return false;
+    }
+  return true;
+}
+
+/* A block handed back to the remainder is seen as free when freed again. */
+static bool
+double_free_test (void)
+{
+  mem_stats_t before, after;
+
+  printf ("\nTEST ON FREEING TWICE: \n\n");
+  deep_mem_stats (&before);
+  /* a size class of its own, carved at the end of the remainder */
+  uint8_t *p = deep_malloc (52);
+  deep_free (p);
+  deep_free (p);
+  deep_mem_stats (&after);
+
+  if (after.used_bytes != before.used_bytes)
+    {
+      deep_error ("%lld bytes gained freeing twice",
+                  (long long)(before.used_bytes - after.used_bytes));
+      return false;
+    }
+  return true;
+}
+
+/* Grow a pool holding live fast and sorted blocks, some freed in between,
+   and 8 bytes of remainder left below the fast blocks, too few for any
+   block: the blocks keep their data at the same offsets, and once all are
+   freed the pool is as free as a new one. */
+static bool
+migrate_test (void)
+{
+  static const block_size_t sizes[] = { 24, 200, 40, 1000, 16, 72, 56 };
+  const uint32_t count = sizeof (sizes) / sizeof (*sizes);
+  mem_pool_t *pool = deep_pool_init (deepvm_shared_mempool,
+                                     DEEPVM_MEMPOOL_SIZE);
+  uint8_t *blocks[sizeof (sizes) / sizeof (*sizes) * 4];
+  uint8_t *filler = NULL;
+  mem_stats_t empty, before, after;
+  bool passed = true;
+
+  printf ("\nTEST ON MIGRATING: \n\n");
+  deep_pool_stats (pool, &empty);
+  for (uint32_t i = 0; i < count * 4; i++)
+    {
+      blocks[i] = deep_pool_malloc (pool, sizes[i % count]);
+      memset (blocks[i], i, sizes[i % count]);
+    }
+  for (uint32_t i = 0; i < count * 4; i += 3)
+    {
+      deep_pool_free (pool, blocks[i]);
+      blocks[i] = NULL;
+    }
+  deep_pool_stats (pool, &before);
+  filler = deep_pool_malloc (pool, before.remainder_bytes - 8
+                                       - offsetof (fast_block_t, payload));
+  deep_pool_stats (pool, &before);
+
+  mem_pool_t *grown = deep_pool_migrate (pool, deepvm_grown_mempool,
+                                         sizeof (deepvm_grown_mempool));
+  deep_pool_stats (grown, &after);
+  if (after.total_bytes != sizeof (deepvm_grown_mempool)
+      || after.free_bytes + after.used_bytes != after.total_bytes
+      || after.used_bytes < before.used_bytes)
+    {
+      deep_error ("%s", "migrated pool miscounted");
+      passed = false;
+    }
+  for (uint32_t i = 0; i < count * 4; i++)
+    {
+      if (blocks[i] == NULL)
+        {
+          continue;
+        }
+      blocks[i] = deepvm_grown_mempool + (blocks[i] - deepvm_shared_mempool);
+      for (block_size_t j = 0; j < sizes[i % count]; j++)
+        {
+          if (blocks[i][j] != (uint8_t)i)
+            {
+              deep_error ("block %u changed by migrating", i);
+              passed = false;
+              break;
+            }
+        }
+    }
+  /* the new space is usable */
+  uint8_t *big = deep_pool_malloc (grown, DEEPVM_MEMPOOL_SIZE / 2);
+  if (big == NULL)
+    {
+      deep_error ("%s", "no room in the migrated pool");
+      passed = false;
+    }
+  deep_pool_free (grown, big);
+  if (filler != NULL)
+    {
+      deep_pool_free (grown, deepvm_grown_mempool
+                                 + (filler - deepvm_shared_mempool));
+    }
+  for (uint32_t i = 0; i < count * 4; i++)
+    {
+      deep_pool_free (grown, blocks[i]);
+    }
+  deep_pool_stats (grown, &after);
+  if (after.used_bytes != empty.used_bytes)
+    {
+      deep_error ("%lld bytes lost migrating",
+                  (long long)(after.used_bytes - empty.used_bytes));
+      passed = false;
+    }
+  deep_pool_destroy (grown);
+  return passed;
+}
+
+/* Migrating and destroying a pool the calling thread caches blocks of: the
+   cache is flushed first, so it neither flushes into the old buffer,
+   scribbled over here, nor keeps blocks of the pool allocated. */
+static bool
+migrate_tcache_test (void)
+{
+  mem_pool_config_t config = { .concurrent = true };
+  mem_pool_t *pool = deep_pool_init_with_config (
+      deepvm_shared_mempool, DEEPVM_MEMPOOL_SIZE, &config);
+  mem_stats_t empty, after;
+  bool passed = true;
+
+  printf ("\nTEST ON MIGRATING CACHED BLOCKS: \n\n");
+  deep_pool_stats (pool, &empty);
+  deep_tcache_free (pool, deep_tcache_malloc (pool, 24));
+  mem_pool_t *grown = deep_pool_migrate (pool, deepvm_grown_mempool,
+                                         sizeof (deepvm_grown_mempool));
+  memset (deepvm_shared_mempool, 0xff, sizeof (deepvm_shared_mempool));
+  deep_tcache_free (grown, deep_tcache_malloc (grown, 24));
+  deep_tcache_flush ();
+  deep_pool_stats (grown, &after);
+  if (after.used_bytes != empty.used_bytes)
+    {
+      deep_error ("%lld bytes lost migrating cached blocks",
+                  (long long)(after.used_bytes - empty.used_bytes));
+      passed = false;
+    }
+
+  deep_tcache_free (grown, deep_tcache_malloc (grown, 24));
+  deep_pool_destroy (grown);
+  memset (deepvm_grown_mempool, 0xff, sizeof (deepvm_grown_mempool));
+  pool = deep_pool_init_with_config (deepvm_shared_mempool,
+                                     DEEPVM_MEMPOOL_SIZE, &config);
+  deep_tcache_free (pool, deep_tcache_malloc (pool, 24));
+  deep_tcache_flush ();
+  deep_pool_stats (pool, &after);
+  if (after.used_bytes != empty.used_bytes)
+    {
+      deep_error ("%lld bytes lost caching after a destroy",
+                  (long long)(after.used_bytes - empty.used_bytes));
+      passed = false;
+    }
+  deep_pool_destroy (pool);
+  return passed;
+}
+
+/* Snapshot a pool holding live fast and sorted blocks, some freed in
+   between, and restore it at another address: the blocks keep their data
+   at the same offsets, the restored pool serves and frees blocks, and
+   freeing them all leaves it as free as a new one. */
+static bool
+snapshot_test (void)
+{
+  static const block_size_t sizes[] = { 24, 200, 40, 1000, 16, 72, 56 };
+  const uint32_t count = sizeof (sizes) / sizeof (*sizes);
+  mem_pool_t *pool = deep_pool_init (deepvm_shared_mempool,
+                                     DEEPVM_MEMPOOL_SIZE);
+  uint8_t *blocks[sizeof (sizes) / sizeof (*sizes) * 4];
+  char path[] = "/tmp/deepvm_snapshot_XXXXXX";
+  mem_stats_t empty, before, after;
+  bool passed = true;
+
+  printf ("\nTEST ON SNAPSHOTTING: \n\n");
+  deep_pool_stats (pool, &empty);
+  for (uint32_t i = 0; i < count * 4; i++)
+    {
+      blocks[i] = deep_pool_malloc (pool, sizes[i % count]);
+      memset (blocks[i], i, sizes[i % count]);
+    }
+  for (uint32_t i = 0; i < count * 4; i += 3)
+    {
+      deep_pool_free (pool, blocks[i]);
+      blocks[i] = NULL;
+    }
+  deep_pool_stats (pool, &before);
+
+  int fd = mkstemp (path);
+  if (fd < 0)
+    {
+      deep_error ("%s", "no file to snapshot to");
+      deep_pool_destroy (pool);
+      return false;
+    }
+  close (fd);
+  mem_pool_t *restored = deep_pool_snapshot (pool, path)
+                             ? deep_pool_restore (path)
+                             : NULL;
+  unlink (path);
+  if (restored == NULL)
+    {
+      deep_error ("%s", "pool not restored");
+      deep_pool_destroy (pool);
+      return false;
+    }
+  /* the original is no longer needed, nor should the copy read it */
+  deep_pool_destroy (pool);
+  memset (deepvm_shared_mempool, 0xff, sizeof (deepvm_shared_mempool));
+
+  deep_pool_stats (restored, &after);
+  if (after.total_bytes != before.total_bytes
+      || after.used_bytes != before.used_bytes)
+    {
+      deep_error ("%s", "restored pool miscounted");
+      passed = false;
+    }
+  for (uint32_t i = 0; i < count * 4; i++)
+    {
+      if (blocks[i] == NULL)
+        {
+          continue;
+        }
+      blocks[i] = (uint8_t *)restored + (blocks[i] - deepvm_shared_mempool);
+      for (block_size_t j = 0; j < sizes[i % count]; j++)
+        {
+          if (blocks[i][j] != (uint8_t)i)
+            {
+              deep_error ("block %u changed by restoring", i);
+              passed = false;
+              break;
+            }
+        }
+    }
+  for (uint32_t i = 0; i < count; i++)
+    {
+      uint8_t *fresh = deep_pool_malloc (restored, sizes[i]);
+      if (fresh == NULL)
+        {
+          deep_error ("%s", "no room in the restored pool");
+          passed = false;
+          continue;
+        }
+      memset (fresh, 0xee, sizes[i]);
+      deep_pool_free (restored, fresh);
+    }
+  for (uint32_t i = 0; i < count * 4; i++)
+    {
+      deep_pool_free (restored, blocks[i]);
+    }
+  deep_pool_stats (restored, &after);
+  if (after.used_bytes != empty.used_bytes)
+    {
+      deep_error ("%lld bytes lost restoring",
+                  (long long)(after.used_bytes - empty.used_bytes));
+      passed = false;
+    }
+  deep_pool_destroy (restored);
+  return passed;
+}
+
 int main(void) {
     // deep_info("This a log for information");
     // deep_debug("This a log for debuging");
@@ -54,5 +414,24 @@ int main(void) {
     cycletest(100); /* sorted */
     cycletest(60);  /* sorted on 64bit; fast on 32bit */
     cycletest(40);  /* fast */
-    return 0;
+    bool passed = zero_size_test ();
+    passed = zero_size_tcache_test () && passed;
+    passed = batch_test () && passed;
+    passed = double_free_test () && passed;
+
+    /* the same on the TLSF engine */
+    mem_pool_config_t tlsf = { .engine = MEM_ENGINE_TLSF };
+    deep_mem_destroy ();
+    deep_mem_init_with_config (deepvm_mempool, DEEPVM_MEMPOOL_SIZE, &tlsf);
+    printf ("\nTESTS ON THE TLSF ENGINE: \n");
+    cycletest(100);
+    cycletest(60);
+    cycletest(40);
+    passed = zero_size_test () && passed;
+    passed = batch_test () && passed;
+
+    passed = migrate_test () && passed;
+    passed = migrate_tcache_test () && passed;
+    passed = snapshot_test () && passed;
+    return passed ? 0 : 1;
 }
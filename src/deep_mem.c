@@ -1,13 +1,27 @@
 
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "random.h"
 #include "deep_mem.h"
 #include "deep_log.h"
+#include "deep_trace.h"
+#include "deep_profile.h"
+#include "deep_slab.h"
+#include "deep_region.h"
 
+#ifndef DEEP_MEM_QUIET
 #define DBG
+#endif
 
 #ifdef DBG
 #define PRINT_ARG(FSTRING, ARG) do {printf(FSTRING, ARG); fflush(stdout);} while (0)
@@ -15,36 +29,171 @@
 #define PRINT_ARG(FSTRING, ARG) ((void *)0)
 #endif
 
-mem_pool_t *pool;
+/* The pool behind deep_mem_init / deep_malloc / deep_free etc. */
+static mem_pool_t *default_pool;
+
+/* deep_mem_trace_start turns this on; the default-pool wrappers test it
+   before doing anything else. */
+#define TRACING() \
+  __builtin_expect (__atomic_load_n (&trace_enabled, __ATOMIC_RELAXED), 0)
+
+/* Blocks are traced by their offset from the pool, which survives
+   deep_mem_migrate; 0 is NULL. */
+static inline block_size_t
+_trace_id (void *ptr)
+{
+  return ptr == NULL ? 0
+                     : (block_size_t)((uint8_t *)ptr - (uint8_t *)default_pool);
+}
+
+/* Sampled blocks are followed by the heap profiler until freed; the
+   default-pool wrappers only ask it while some are. */
+#define PROFILING() \
+  __builtin_expect ( \
+      __atomic_load_n (&profile_live_samples, __ATOMIC_RELAXED) != 0, 0)
+
+/* Unlike trace ids, profiler keys span blocks mapped on their own too. */
+static inline uint64_t
+_profile_key (void *ptr)
+{
+  return (uint64_t)((uint8_t *)ptr - (uint8_t *)default_pool);
+}
 
 /*
   Store the offset between payload and head of a block.
-  Calculate at runtime (during deep_init()).
-  This is just a patch; will prolly need better solutions.
+  It is the same for every pool, as it only depends on the platform.
 */
-uint8_t block_payload_offset;
+static const uint8_t block_payload_offset = offsetof (fast_block_t, payload);
+/* The same for blocks mapped on their own, whose head also sits right
+   before the payload. */
+static const uint8_t mapped_payload_offset
+    = offsetof (mapped_block_t, payload);
+
+/* Size of the block for a `size`-byte payload: the payload and its head
+   rounded up to 8 bytes, but never smaller than a fast block, whose payload
+   holds the free-list link once freed. */
+static inline block_size_t
+_block_aligned_size (block_size_t size)
+{
+  block_size_t aligned_size = ALIGN_MEM_SIZE (size + block_payload_offset);
+
+  return aligned_size < sizeof (fast_block_t) ? sizeof (fast_block_t)
+                                              : aligned_size;
+}
+
+/* Per-thread stacks of fast blocks, bound to one pool at a time, as it was
+   when bound. */
+typedef struct thread_cache
+{
+  mem_pool_t *pool;
+  uint64_t generation;
+  uint32_t counts[FAST_BIN_LENGTH];
+  fast_block_t *bins[FAST_BIN_LENGTH];
+} thread_cache_t;
 
-static void *deep_malloc_fast_bins (uint32_t size);
-static void *deep_malloc_sorted_bins (uint32_t size);
-static void deep_free_fast_bins (void *ptr);
-static void deep_free_sorted_bins (void *ptr);
+static _Thread_local thread_cache_t tcache;
+
+/* Last generation handed to a pool; 0 marks a destroyed one. */
+static uint64_t pool_generation;
+
+static inline uint64_t
+_pool_new_generation (void)
+{
+  return __atomic_add_fetch (&pool_generation, 1, __ATOMIC_RELAXED);
+}
+
+/* Innermost region of deep_region_begin on the calling thread. */
+static _Thread_local mem_region_t *region_stack;
+
+static void *_pool_malloc (mem_pool_t *pool, block_size_t size);
+static void *_pool_realloc (mem_pool_t *pool, void *ptr, block_size_t size);
+static void *_pool_aligned_alloc (mem_pool_t *pool, uint32_t alignment,
+                                  block_size_t size);
+static void _pool_free (mem_pool_t *pool, void *ptr);
+static void *deep_malloc_fast_bins (mem_pool_t *pool, block_size_t size,
+                                    bool from_remainder);
+static void *deep_malloc_sorted_bins (mem_pool_t *pool, block_size_t size);
+static void deep_free_fast_bins (mem_pool_t *pool, void *ptr,
+                                 bool to_remainder);
+static void deep_free_sorted_bins (mem_pool_t *pool, void *ptr);
+static void _tcache_refill (uint32_t offset, block_size_t aligned_size);
+static void _tcache_drain (uint32_t offset, uint32_t count);
 
 /* helper functions for maintaining the sorted_block skiplist */
 static sorted_block_t *
 _split_into_two_sorted_blocks (sorted_block_t *block,
-                               uint32_t aligned_size);
-static void _merge_into_single_block (sorted_block_t *curr,
+                               block_size_t aligned_size);
+static void _merge_into_single_block (mem_pool_t *pool, sorted_block_t *curr,
                                       sorted_block_t *next);
+static void _release_region_to_bins (mem_pool_t *pool, void *addr,
+                                     block_size_t size);
+static void _extend_remainder_end (mem_pool_t *pool);
+static bool _grow_block_before_remainder (mem_pool_t *pool,
+                                          block_size_t size);
+static bool _consolidate_fast_blocks (mem_pool_t *pool);
+static fast_block_t *_consolidate_region (mem_pool_t *pool,
+                                          sorted_block_t *start,
+                                          sorted_block_t *end,
+                                          fast_block_t *taken, bool *merged);
+static void _release_free_run (mem_pool_t *pool, sorted_block_t *run,
+                               sorted_block_t *run_end);
+static uint32_t _malloc_batch (mem_pool_t *pool, block_size_t aligned_size,
+                               uint32_t n, void **out);
+static sorted_block_t *_find_largest_sorted_block (mem_pool_t *pool);
+static uint32_t _malloc_fast_batch (mem_pool_t *pool, block_size_t aligned_size,
+                                    uint32_t n, void **out);
+static uint32_t _malloc_sorted_run (mem_pool_t *pool, block_size_t aligned_size,
+                                    uint32_t n, void **out);
+static void _shrink_sorted_block (mem_pool_t *pool, sorted_block_t *block,
+                                  block_size_t aligned_size);
+static bool _grow_sorted_block_in_place (mem_pool_t *pool, sorted_block_t *block,
+                                         block_size_t aligned_size);
 static sorted_block_t *
-_allocate_block_from_skiplist (uint32_t aligned_size);
+_allocate_sorted_block (mem_pool_t *pool, block_size_t aligned_size);
+static sorted_block_t *_find_free_sorted_block (mem_pool_t *pool,
+                                                block_size_t size);
+static void _insert_free_sorted_block (mem_pool_t *pool,
+                                       sorted_block_t *block);
+static void _remove_free_sorted_block (mem_pool_t *pool,
+                                       sorted_block_t *block);
 static inline bool _sorted_block_is_in_skiplist (sorted_block_t *block);
 static sorted_block_t *
-_find_sorted_block_by_size_on_index (sorted_block_t *node, uint32_t size,
+_find_sorted_block_by_size_on_index (sorted_block_t *node, block_size_t size,
                                      uint32_t index_level);
 static sorted_block_t *
-_find_sorted_block_by_size (sorted_block_t *node, uint32_t size);
-static void _insert_sorted_block_to_skiplist (sorted_block_t *block);
-static void _remove_sorted_block_from_skiplist (sorted_block_t *block);
+_find_sorted_block_by_size (sorted_block_t *node, block_size_t size);
+static void _find_sorted_block_predecessors (mem_pool_t *pool,
+                                             block_size_t size,
+                                             sorted_block_t **preds);
+static void _insert_sorted_block_to_skiplist (mem_pool_t *pool, sorted_block_t *block);
+static void _remove_sorted_block_from_skiplist (mem_pool_t *pool, sorted_block_t *block);
+
+/* helper functions for the extra arenas of growing pools */
+static void *_arenas_alloc (mem_pool_t *pool, uint32_t alignment,
+                            block_size_t size);
+static void *_arenas_realloc (mem_pool_t *pool, void *ptr,
+                              block_size_t size);
+static void _arenas_free (mem_pool_t *pool, void *ptr);
+static uint32_t _arenas_malloc_batch (mem_pool_t *pool,
+                                      block_size_t aligned_size, uint32_t n,
+                                      void **out);
+static mem_pool_t *_pool_add_arena (mem_pool_t *pool, block_size_t size);
+static void _pool_release_arena (mem_pool_t *pool, mem_pool_t *arena);
+
+/* helper functions for blocks mapped on their own */
+static void *_malloc_mapped (mem_pool_t *pool, block_size_t size);
+static void *_realloc_mapped (mem_pool_t *pool, mapped_block_t *block,
+                              block_size_t size);
+static void _free_mapped (mem_pool_t *pool, mapped_block_t *block);
+
+/* helper functions for pool images */
+static void _pool_rebase (mem_pool_t *pool, void *from, void *to);
+static void _unmap_image (void *mem, mem_size_t size);
+
+/* helper functions for maintaining the TLSF index */
+static sorted_block_t *_tlsf_find_block (mem_pool_t *pool, block_size_t size);
+static void _tlsf_insert_block (mem_pool_t *pool, sorted_block_t *block);
+static void _tlsf_remove_block (mem_pool_t *pool, sorted_block_t *block);
 
 static inline bool
 block_is_allocated (block_head_t const *head)
@@ -70,6 +219,12 @@ block_set_P_flag (block_head_t *head, bool allocated)
   *head = allocated ? (*head | P_FLAG_MASK) : (*head & (~P_FLAG_MASK));
 }
 
+static inline bool
+block_is_mapped (block_head_t const *head)
+{
+  return (*head) & M_FLAG_MASK;
+}
+
 /**
  * The size of the payload.
  **/
@@ -89,6 +244,15 @@ block_set_size (block_head_t *head, block_size_t size)
   *head = (*head & (~BLOCK_SIZE_MASK)) | size;
 }
 
+/**
+ * Fast blocks are told apart from sorted blocks by their size alone.
+ **/
+static inline bool
+block_is_fast (block_head_t const *head)
+{
+  return block_get_size (head) + block_payload_offset <= FAST_BIN_MAX_SIZE;
+}
+
 static inline void *
 get_pointer_by_offset_in_bytes (void *p, int64_t offset)
 {
@@ -102,13 +266,13 @@ get_offset_between_pointers_in_bytes (void *p, void *q)
 }
 
 static inline struct sorted_block *
-get_block_by_offset (struct sorted_block *node, int32_t offset)
+get_block_by_offset (struct sorted_block *node, block_offset_t offset)
 {
   return (struct sorted_block *)(get_pointer_by_offset_in_bytes ((mem_t *)node,
                                                                  offset));
 }
 
-static inline int32_t
+static inline block_offset_t
 get_offset_between_blocks (struct sorted_block *origin,
                            struct sorted_block *target)
 {
@@ -123,567 +287,3530 @@ get_remainder_size (struct mem_pool const *pool)
                                                pool->remainder_block_head);
 }
 
-bool deep_mem_init (void *mem, uint32_t size)
+/**
+ * The block lying right after `block` in memory.
+ **/
+static inline struct sorted_block *
+get_next_block (struct sorted_block *block)
 {
-  // Offset calculation
-  {
-    fast_block_t block;
-    block_payload_offset
-      = (uint8_t)((uint32_t)&block.payload - (uint32_t)&block.head);
-  }
-  PRINT_ARG("Offset: %u\n", block_payload_offset);
-
-  if (size < sizeof (mem_pool_t))
-    {
-      return false; /* given buffer is too small */
-    }
-
-  memset(mem, 0, size);
-  mem_size_t aligned_size = ALIGN_MEM_SIZE_TRUNC(size);
-
-  pool = (mem_pool_t *)mem;
-  pool->free_memory = aligned_size - sizeof(mem_pool_t)
-                      - sizeof(sorted_block_t) - sizeof(block_head_t);
-  /* the first node in the list, to simplify implementation */
-  pool->sorted_block.addr = 
-      (sorted_block_t *)(get_pointer_by_offset_in_bytes(
-        mem, sizeof(mem_pool_t)));
-  /* all other fields are set as 0 */
-  pool->sorted_block.addr->payload.info.level_of_indices = 
-      SORTED_BLOCK_INDICES_LEVEL;
-  pool->remainder_block_head =
-      (block_head_t *)(get_pointer_by_offset_in_bytes(
-        mem, sizeof(mem_pool_t) + sizeof(sorted_block_t)));
-  pool->remainder_block_end = 
-      (get_pointer_by_offset_in_bytes(mem, aligned_size - 8)); // -8 for safety
-  for (int i = 0; i < FAST_BIN_LENGTH; ++i)
-    {
-      pool->fast_bins[i].addr = NULL;
-    }
-  // initialise remainder block's head
-  block_set_A_flag (pool->remainder_block_head, false);
-  block_set_P_flag (pool->remainder_block_head, true);
-
-  return true;
+  return get_block_by_offset (block, block_get_size (&block->head)
+                                         + block_payload_offset);
 }
 
-void
-deep_mem_destroy (void)
+/**
+ * Free sorted blocks keep a copy of their head in the last four bytes, so
+ * that the next block can find them when its P flag is cleared.
+ **/
+static inline void
+block_set_footer (struct sorted_block *block)
 {
-  pool = NULL;
+  *(block_head_t *)get_pointer_by_offset_in_bytes (
+      block, block_get_size (&block->head) + block_payload_offset
+                 - sizeof (block_head_t))
+      = block->head;
 }
 
-void *
-deep_malloc(uint32_t size)
+static inline struct sorted_block *
+get_prev_block_by_footer (struct sorted_block *block)
 {
-  if (pool->free_memory < size)
-  {
-    return NULL;
-  }
+  block_head_t const *footer = (block_head_t *)get_pointer_by_offset_in_bytes (
+      block, -(int64_t)sizeof (block_head_t));
 
-  uint32_t aligned_size = ALIGN_MEM_SIZE(size + block_payload_offset);
-
-  if (aligned_size <= FAST_BIN_MAX_SIZE)
-  {
-    return deep_malloc_fast_bins(aligned_size);
-  }
-  return deep_malloc_sorted_bins(aligned_size);
+  return get_block_by_offset (
+      block, -(block_offset_t)(block_get_size (footer) + block_payload_offset));
 }
 
-/* Note that aligning is done in deep_malloc, the size shoulde already be 
- * aligned here.
- */
-static void *
-deep_malloc_fast_bins(block_size_t aligned_size)
+/**
+ * The number of skiplist levels fitting in a free sorted block of `size`
+ * bytes (head + payload), between its links and its footer.
+ **/
+static inline uint32_t
+sorted_block_max_level (block_size_t size)
 {
-  uint32_t offset = (aligned_size >> 3) - 1;
-  bool P_flag = false;
-  fast_block_t *ret = NULL;
-  block_size_t payload_size;
-  
-  if (pool->fast_bins[offset].addr != NULL) 
-  {
-    PRINT_ARG("%s", "Fast block from stack\n");
-    ret = pool->fast_bins[offset].addr;
-    pool->fast_bins[offset].addr = ret->payload.next;
-    P_flag = prev_block_is_allocated(&ret->head);
-    payload_size = block_get_size(&ret->head);
-  }
-  // When there are no available fast blocks, grab at the end of the remainder.
-  else if (aligned_size <= get_remainder_size(pool)) 
-  {
-    PRINT_ARG("%s", "Fast block from remainder\n");
-    ret = (fast_block_t *)(get_pointer_by_offset_in_bytes
-        (pool->remainder_block_end,
-        -(int64_t)aligned_size - sizeof(block_head_t)));
-    pool->remainder_block_end = (void *)ret;
-
-    payload_size = aligned_size - block_payload_offset;
-    block_set_size (&ret->head, payload_size);
-    pool->free_memory -= sizeof(block_head_t);
-  }
-  else 
-  {
-    return NULL;
-  }
-
-  memset (&ret->payload, 0, payload_size);
-  block_set_A_flag (&ret->head, true);
-  block_set_P_flag (&ret->head, P_flag);
-  pool->free_memory -= payload_size;
-
-  PRINT_ARG("Remainder start (after allocation): %p\n", pool->remainder_block_head);
-  PRINT_ARG("Remainder end (after allocation):   %p\n", pool->remainder_block_end);
-  PRINT_ARG("Payload size (after allocation):    %u\n", payload_size);
-  PRINT_ARG("Free memory (after allocation):     %llu\n", pool->free_memory);
+  block_size_t levels
+      = (size - sizeof (block_head_t)
+         - offsetof (sorted_block_t, payload.info.offsets))
+        / sizeof (block_offset_t);
 
-  return &ret->payload;
+  return levels < SORTED_BLOCK_INDICES_LEVEL ? levels
+                                             : SORTED_BLOCK_INDICES_LEVEL;
 }
 
-/* Note that aligning is done in deep_malloc, the size should already be 
- * aligned here.
- */
-static void *
-deep_malloc_sorted_bins (block_size_t aligned_size)
+/**
+ * The bytes at the start of a free sorted block that may hold its head and
+ * links, i.e. all of it but the footer in small blocks.
+ **/
+static inline block_size_t
+sorted_block_links_size (struct sorted_block const *block)
 {
-  sorted_block_t *ret = NULL;
-  block_size_t payload_size = aligned_size - block_payload_offset;
-  if ((pool->sorted_block.addr != NULL)
-      && ((ret = _allocate_block_from_skiplist(aligned_size)) != NULL))
-  {
-    PRINT_ARG("%s", "Allocate from skiplist\n");
-    /* pass */
-  }
-  else if (aligned_size <= get_remainder_size (pool))
-  {
-    PRINT_ARG("%s", "Allocate not from skiplist (start)\n");
-    /* no suitable sorted_block */
-    ret = (sorted_block_t *)pool->remainder_block_head;
-    block_set_size(
-        &ret->head, get_remainder_size(pool) - block_payload_offset);
-    pool->remainder_block_head
-        = (block_head_t *)_split_into_two_sorted_blocks(ret, aligned_size);
-    PRINT_ARG("%s", "Allocate not from skiplist (finish)\n");
-  }
-  else
-  {
-    return NULL;
-  }
-
-  memset (&ret->payload, 0, payload_size);
-  block_set_A_flag (&ret->head, true);
-  block_set_P_flag (&get_block_by_offset (ret, aligned_size)->head, true);
-  pool->free_memory -= payload_size;
-
-  PRINT_ARG("Remainder start (after allocation): %p\n", pool->remainder_block_head);
-  PRINT_ARG("Remainder end (after allocation):   %p\n", pool->remainder_block_end);
-  PRINT_ARG("Payload size (after allocation):    %u\n", payload_size);
-  PRINT_ARG("Free memory (after allocation):     %llu\n", pool->free_memory);
+  block_size_t size = block_get_size (&block->head) + block_payload_offset;
 
-  return &ret->payload;
-}
-
-void *
-deep_realloc (void *ptr, uint32_t size)
-{
-  return NULL;
+  return size < sizeof (sorted_block_t) ? size : sizeof (sorted_block_t);
 }
 
-void
-deep_free (void *ptr)
+mem_pool_t *
+deep_pool_init (void *mem, block_size_t size)
 {
-  void *head = 
-      get_pointer_by_offset_in_bytes(ptr, -(int64_t)block_payload_offset);
- 
-  if (ptr == NULL || !block_is_allocated((block_head_t *)head))
-  {
-    PRINT_ARG("%s", "Double free\n");
-    return;
-  }
-  block_size_t block_size = 
-      block_get_size((block_head_t *)head) + block_payload_offset;
-
-  if (block_size <= FAST_BIN_MAX_SIZE)
-  {
-    deep_free_fast_bins(head);
-  }
-  else
-  {
-    deep_free_sorted_bins(head);
-  }
+  return deep_pool_init_with_config (mem, size, NULL);
 }
 
-static void
-deep_free_fast_bins(void *ptr)
+mem_pool_t *
+deep_pool_init_with_config (void *mem, block_size_t size,
+                            mem_pool_config_t const *config)
 {
-  fast_block_t *block = ptr;
-  // block size is payload size according to spec.
-  block_size_t payload_size = block_get_size(&block->head);
-  uint32_t offset = ((payload_size + block_payload_offset) >> 3) - 1;
-
-  memset (&block->payload, 0, payload_size);
-  block_set_A_flag (&block->head, false);
-  pool->free_memory += payload_size;
+  mem_pool_t *pool = NULL;
 
-  if (block->payload.next != NULL) 
-  {
-    block->payload.next = pool->fast_bins[offset].addr->payload.next;
-  }
-  pool->fast_bins[offset].addr = block;
+  PRINT_ARG("Offset: %u\n", block_payload_offset);
 
-  PRINT_ARG("Remainder start (after free): %p\n", pool->remainder_block_head);
-  PRINT_ARG("Remainder end (after free):   %p\n", pool->remainder_block_end);
-  PRINT_ARG("Payload size (after free):    %u\n", payload_size);
-  PRINT_ARG("Free memory (after free):     %llu\n", pool->free_memory);
-}
+  bool use_tlsf = config != NULL && config->engine == MEM_ENGINE_TLSF;
+  /* the skiplist head or the TLSF index sits between header and remainder */
+  uint32_t index_size = use_tlsf ? ALIGN_MEM_SIZE (sizeof (tlsf_index_t))
+                                 : sizeof (sorted_block_t);
 
-static void
-deep_free_sorted_bins (void *ptr)
-{
-  sorted_block_t *block = ptr;
-  sorted_block_t *the_other = NULL;
-  // block size is payload size according to spec.
-  block_size_t payload_size = block_get_size (&block->head);
+  if (mem == NULL || size < sizeof (mem_pool_t) + index_size + 8
+      || size > POOL_MAX_SIZE)
+    {
+      return NULL; /* given buffer is too small */
+    }
 
-  memset (&block->payload, 0, payload_size);
+  mem_zero_policy_t zero = config != NULL ? config->zero : MEM_ZERO_NONE;
+  mem_size_t aligned_size = ALIGN_MEM_SIZE_TRUNC(size);
 
-  block_set_A_flag (&block->head, false);
+  /* the remainder only needs clearing when free memory must read as zero */
+  memset (mem, 0,
+          zero == MEM_ZERO_ON_FREE ? size : sizeof (mem_pool_t) + index_size);
 
-  /* try to merge */
-  /* merge above */
-  if (!prev_block_is_allocated (&block->head))
+  pool = (mem_pool_t *)mem;
+  pool->total_memory = aligned_size;
+  if (config != NULL && config->concurrent)
     {
-      PRINT_ARG("%s", "Merge above\n");
-      block_size_t prev_size
-          = block_get_size ((block_head_t *)(block - sizeof (block_head_t)));
-      
-      the_other = get_block_by_offset (block, -((int32_t)prev_size));
-      
-      _merge_into_single_block (the_other, block);
-      block = the_other;
+      pool->flags |= POOL_FLAG_CONCURRENT;
     }
-
-  /* merge below */
-  the_other = get_block_by_offset(
-      block, block_get_size(&block->head) + block_payload_offset);
-  if (!block_is_allocated (&the_other->head))
+  if (zero == MEM_ZERO_ON_ALLOC)
     {
-       PRINT_ARG("%s", "Merge below\n");
-      _merge_into_single_block (block, the_other);
+      pool->flags |= POOL_FLAG_ZERO_ON_ALLOC;
     }
-  /* update remainder_block if it is involved */
-  if (the_other == (sorted_block_t *)pool->remainder_block_head)
+  else if (zero == MEM_ZERO_ON_FREE)
     {
-      PRINT_ARG("%s", "Merge into remainder\n");
-      pool->remainder_block_head = (block_head_t *)block;
+      pool->flags |= POOL_FLAG_ZERO_ON_FREE;
     }
-
-  if (!_sorted_block_is_in_skiplist (block))
+  if (config != NULL)
     {
-      _insert_sorted_block_to_skiplist (block);
+      pool->mmap_threshold = config->mmap_threshold;
+      pool->region_provider = config->region_provider;
     }
+  seed_r (pool->level_random, config != NULL ? config->seed : 0);
+  pool->generation = _pool_new_generation ();
+  if (use_tlsf)
+    {
+      /* all bitmaps and lists start empty */
+      pool->flags |= POOL_FLAG_TLSF;
+      pool->sorted_block.addr = NULL;
+    }
+  else
+    {
+      /* the first node in the list, to simplify implementation */
+      pool->sorted_block.addr = 
+          (sorted_block_t *)(get_pointer_by_offset_in_bytes(
+            mem, sizeof(mem_pool_t)));
+      /* all other fields are set as 0 */
+      pool->sorted_block.addr->payload.info.level_of_indices = 
+          SORTED_BLOCK_INDICES_LEVEL;
+    }
+  pool->remainder_block_head =
+      (block_head_t *)(get_pointer_by_offset_in_bytes(
+        mem, sizeof(mem_pool_t) + index_size));
+  pool->remainder_block_end = 
+      (get_pointer_by_offset_in_bytes(mem, aligned_size - 8)); // -8 for safety
+  pool->free_memory = get_remainder_size (pool);
+  for (int i = 0; i < FAST_BIN_LENGTH; ++i)
+    {
+      pool->fast_bins[i] = 0;
+    }
+  // the last 8 bytes act as an allocated fence, so no block merges past it
+  *(block_head_t *)pool->remainder_block_end = 0;
+  block_set_A_flag ((block_head_t *)pool->remainder_block_end, true);
+  block_set_P_flag ((block_head_t *)pool->remainder_block_end, true);
 
-  pool->free_memory += payload_size;
-
-  PRINT_ARG("Remainder start (after free): %p\n", pool->remainder_block_head);
-  PRINT_ARG("Remainder end (after free):   %p\n", pool->remainder_block_end);
-  PRINT_ARG("Payload size (after free):    %u\n", payload_size);
-  PRINT_ARG("Free memory (after free):     %llu\n", pool->free_memory);
+  return pool;
 }
 
-bool
-deep_mem_migrate (void *new_mem, uint32_t size)
+/**
+ * P flags are only kept up to date on sorted blocks, the only ones merging
+ * with the block before them. Fast blocks are left alone, since in
+ * concurrent pools they may be owned by threads not holding the lock.
+ **/
+static inline void
+block_update_P_flag (struct sorted_block *block, bool allocated)
 {
-  return false;
+  block_head_t head = __atomic_load_n (&block->head, __ATOMIC_RELAXED);
+
+  if (!block_is_fast (&head))
+    {
+      /* the owner of `block` may be reading its head without the lock */
+      block_set_P_flag (&head, allocated);
+      __atomic_store_n (&block->head, head, __ATOMIC_RELAXED);
+    }
 }
 
-/* helper functions for maintaining the sorted_block skiplist.
- * aligned_size is the total size of the first block (head + payload).
-*/
-static sorted_block_t *
-_split_into_two_sorted_blocks (sorted_block_t *block,
-                               uint32_t aligned_size)
+/**
+ * Fast blocks change hands without the lock, while _consolidate_region may
+ * be reading their heads under it.
+ **/
+static inline void
+fast_block_store_A_flag (fast_block_t *block, bool allocated)
 {
-  sorted_block_t *new_block = get_block_by_offset(block, aligned_size);
-  // new block size = old block size - space used (aligned_size) - head size.
-  block_size_t new_block_size
-      = block_get_size(&block->head) - aligned_size - block_payload_offset;
+  block_head_t head = block->head;
 
-  // Do we really need this memset?
-  // Maybe setting only the head of new block is suffice?
-  memset (new_block, 0, new_block_size + block_payload_offset);
-  block_set_size (&new_block->head, new_block_size);
-  block_set_A_flag (&new_block->head, false);
-  block_set_P_flag (&new_block->head, false); /* by default */
-  block_set_size (&block->head, aligned_size - block_payload_offset);
-  pool->free_memory -= sizeof (block_head_t);
+  block_set_A_flag (&head, allocated);
+  __atomic_store_n (&block->head, head, __ATOMIC_RELAXED);
+}
 
-  return new_block;
+static inline void
+next_block_set_P_flag (struct sorted_block *block, bool allocated)
+{
+  block_update_P_flag (get_next_block (block), allocated);
 }
 
 /**
- * Assuming `curr` and `next` are contiguous in memory address,
- * where curr < next
- * Attempt to remove both nodes from list, merge them, and insert the merged.
- * NOTE:
- *   - will update `free_memory` of releasing `sizeof (block_head_t)` to pool
+ * Read the head of an allocated block without holding the pool lock: other
+ * threads may flip its P flag, but its size does not change.
  **/
-static void
-_merge_into_single_block (sorted_block_t *curr, sorted_block_t *next)
+static inline block_head_t
+block_load_head_of_payload (void *ptr)
 {
-  _remove_sorted_block_from_skiplist (curr);
-  _remove_sorted_block_from_skiplist (next);
-
-  block_size_t new_size
-      = block_get_size (&curr->head) + block_get_size (&next->head);
-
-  block_set_size (&curr->head, new_size);
-  memset (&curr->payload, 0, new_size - sizeof (curr->head));
-  // copy over new head info to footer
-  *(block_head_t *)get_pointer_by_offset_in_bytes (
-      &curr->head, new_size - sizeof (block_head_t))
-      = curr->head;
-
-  _insert_sorted_block_to_skiplist (curr);
+  return __atomic_load_n ((block_head_t *)get_pointer_by_offset_in_bytes (
+                              ptr, -(int64_t)block_payload_offset),
+                          __ATOMIC_RELAXED);
+}
 
-  pool->free_memory += sizeof (block_head_t);
+static inline bool
+_pool_is_concurrent (mem_pool_t const *pool)
+{
+  return pool->flags & POOL_FLAG_CONCURRENT;
 }
 
-/** Obtain a most apporiate block from sorted_list if possible.
- *
- * - Obtain one with exact same size.
- * - Obtain one with bigger size, but split into two sorted blocks
- *   - returns the part with exactly same size
- *   - insert the rest into sorted_block skiplist
- *   - NOTE: this requires the block found be at least
- *           (`aligned_size + SORTED_BIN_MIN_SIZE`) big
- * - NULL
- *
- * NOTE: The obtained block will be **removed** from the skiplist.
+/**
+ * Pools zeroing on free keep every free byte zero apart from block heads
+ * and free-list links; this clears `size` bytes at `addr` for them.
  **/
-static sorted_block_t *
-_allocate_block_from_skiplist (uint32_t aligned_size)
+static inline void
+_pool_scrub (mem_pool_t const *pool, void *addr, block_size_t size)
 {
-  sorted_block_t *ret = NULL;
-
-  if ((pool->sorted_block.addr == NULL)
-      || ((ret = _find_sorted_block_by_size (pool->sorted_block.addr,
-                                             aligned_size))
-          == NULL))
-    {
-      return NULL;
-    }
-  if (block_get_size (&ret->head) != aligned_size)
+  if (pool->flags & POOL_FLAG_ZERO_ON_FREE)
     {
-      if ((block_get_size (&ret->head) < aligned_size + SORTED_BIN_MIN_SIZE)
-          && (ret = _find_sorted_block_by_size (
-                  ret, aligned_size + SORTED_BIN_MIN_SIZE))
-                 == NULL)
-        {
-          return NULL;
-        }
-      sorted_block_t *remainder = _split_into_two_sorted_blocks (ret, aligned_size);
-      _insert_sorted_block_to_skiplist (remainder);
+      memset (addr, 0, size);
     }
-  _remove_sorted_block_from_skiplist (ret);
-
-  return ret;
 }
 
+/* Whether a block of `size` bytes gets a mapping of its own. */
 static inline bool
-_sorted_block_is_in_skiplist (sorted_block_t *block)
+_pool_maps (mem_pool_t const *pool, block_size_t size)
+{
+  return pool->mmap_threshold != 0 && size >= pool->mmap_threshold;
+}
+
+/* Whether `ptr` points into the buffer of `pool`, not one of its extra
+   arenas or mappings. */
+static inline bool
+_pool_contains (mem_pool_t const *pool, void const *ptr)
+{
+  return (uint8_t const *)ptr > (uint8_t const *)pool
+         && (uint8_t const *)ptr < (uint8_t const *)pool + pool->total_memory;
+}
+
+/* The arena holding `ptr`; blocks mapped on their own belong to `pool`. */
+static inline mem_pool_t *
+_pool_find_arena (mem_pool_t *pool, void const *ptr)
+{
+  for (mem_pool_t *arena = pool->arenas; arena != NULL;
+       arena = arena->next_arena)
+    {
+      if (_pool_contains (arena, ptr))
+        {
+          return arena;
+        }
+    }
+  return pool;
+}
+
+/**
+ * Walk the arenas of `pool` in allocation order, i.e. the extra ones newest
+ * first, then `pool` itself: pass NULL for the first one.
+ **/
+static inline mem_pool_t *
+_pool_next_arena (mem_pool_t *pool, mem_pool_t *arena)
+{
+  if (arena == NULL)
+    {
+      return pool->arenas != NULL ? pool->arenas : pool;
+    }
+  if (arena == pool)
+    {
+      return NULL;
+    }
+  return arena->next_arena != NULL ? arena->next_arena : pool;
+}
+
+static inline mapped_block_t *
+_get_mapped_block (void *ptr)
+{
+  return get_pointer_by_offset_in_bytes (ptr,
+                                         -(int64_t)mapped_payload_offset);
+}
+
+static inline bool
+_pool_uses_tlsf (mem_pool_t const *pool)
+{
+  return pool->flags & POOL_FLAG_TLSF;
+}
+
+/* TLSF pools keep their index right after the pool header. */
+static inline tlsf_index_t *
+_pool_get_tlsf_index (mem_pool_t *pool)
+{
+  return get_pointer_by_offset_in_bytes (pool, sizeof (mem_pool_t));
+}
+
+/* The first block of the pool, right after the skiplist head or TLSF index. */
+static inline sorted_block_t *
+_pool_get_first_block (mem_pool_t *pool)
+{
+  return get_pointer_by_offset_in_bytes (
+      pool, sizeof (mem_pool_t)
+                + (_pool_uses_tlsf (pool)
+                       ? ALIGN_MEM_SIZE (sizeof (tlsf_index_t))
+                       : sizeof (sorted_block_t)));
+}
+
+/* Whether nothing is allocated in `pool`: all but its header, index and
+   fence is free. */
+static inline bool
+_pool_is_empty (mem_pool_t *pool)
+{
+  return pool->free_memory
+             + get_offset_between_pointers_in_bytes (
+                 _pool_get_first_block (pool), pool)
+             + 8
+         == pool->total_memory;
+}
+
+static inline void
+_pool_adjust_free_memory (mem_pool_t *pool, int64_t delta)
+{
+  if (_pool_is_concurrent (pool))
+    {
+      __atomic_fetch_add (&pool->free_memory, delta, __ATOMIC_RELAXED);
+    }
+  else
+    {
+      pool->free_memory += delta;
+    }
+}
+
+static inline fast_block_t *
+_fast_bin_get_top (mem_pool_t *pool, uint64_t bin)
+{
+  uint64_t offset = bin & (((uint64_t)1 << FAST_BIN_TAG_SHIFT) - 1);
+
+  return offset == 0 ? NULL
+                     : get_pointer_by_offset_in_bytes (pool, offset << 3);
+}
+
+/**
+ * A new bin value with `top` on top; the tag is bumped on every update so
+ * that a stale compare-and-swap never succeeds (ABA).
+ **/
+static inline uint64_t
+_fast_bin_set_top (mem_pool_t *pool, uint64_t bin, fast_block_t *top)
+{
+  uint64_t offset
+      = top == NULL ? 0 : get_offset_between_pointers_in_bytes (top, pool);
+
+  return (((bin >> FAST_BIN_TAG_SHIFT) + 1) << FAST_BIN_TAG_SHIFT)
+         | (offset >> 3);
+}
+
+/**
+ * Pop the top block of a fast bin. In concurrent pools this is a Treiber
+ * stack: the top's `next` may be read after another thread has popped and
+ * reused the block, in which case the tag has changed and the CAS retries.
+ **/
+static fast_block_t *
+_fast_bin_pop (mem_pool_t *pool, uint32_t offset)
+{
+  uint64_t *bin = &pool->fast_bins[offset];
+  uint64_t old = __atomic_load_n (bin, __ATOMIC_ACQUIRE);
+  fast_block_t *top = NULL;
+  fast_block_t *next = NULL;
+
+  if (!_pool_is_concurrent (pool))
+    {
+      if ((top = _fast_bin_get_top (pool, old)) != NULL)
+        {
+          *bin = _fast_bin_set_top (pool, old, top->payload.next);
+          pool->fast_bin_counts[offset]--;
+        }
+      return top;
+    }
+
+  do
+    {
+      if ((top = _fast_bin_get_top (pool, old)) == NULL)
+        {
+          return NULL;
+        }
+      next = __atomic_load_n (&top->payload.next, __ATOMIC_RELAXED);
+    }
+  while (!__atomic_compare_exchange_n (bin, &old,
+                                       _fast_bin_set_top (pool, old, next),
+                                       true, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_ACQUIRE));
+  __atomic_fetch_sub (&pool->fast_bin_counts[offset], 1, __ATOMIC_RELAXED);
+
+  return top;
+}
+
+static void
+_fast_bin_push (mem_pool_t *pool, uint32_t offset, fast_block_t *block)
+{
+  uint64_t *bin = &pool->fast_bins[offset];
+  uint64_t old = __atomic_load_n (bin, __ATOMIC_RELAXED);
+
+  if (!_pool_is_concurrent (pool))
+    {
+      block->payload.next = _fast_bin_get_top (pool, old);
+      *bin = _fast_bin_set_top (pool, old, block);
+      pool->fast_bin_counts[offset]++;
+      return;
+    }
+
+  /* counted before it can be popped, so the count never goes below 0 */
+  __atomic_fetch_add (&pool->fast_bin_counts[offset], 1, __ATOMIC_RELAXED);
+  do
+    {
+      /* a concurrent pop may still be reading the link of a stale top */
+      __atomic_store_n (&block->payload.next, _fast_bin_get_top (pool, old),
+                        __ATOMIC_RELAXED);
+    }
+  while (!__atomic_compare_exchange_n (bin, &old,
+                                       _fast_bin_set_top (pool, old, block),
+                                       true, __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED));
+}
+
+/**
+ * Empty a fast bin at once and return its blocks as a list. Like a pop, it
+ * bumps the tag, so threads racing on the old top retry on the empty bin.
+ **/
+static fast_block_t *
+_fast_bin_take_all (mem_pool_t *pool, uint32_t offset)
+{
+  uint64_t *bin = &pool->fast_bins[offset];
+  uint64_t old = __atomic_load_n (bin, __ATOMIC_ACQUIRE);
+  uint32_t count = 0;
+
+  do
+    {
+      if (_fast_bin_get_top (pool, old) == NULL)
+        {
+          return NULL;
+        }
+    }
+  while (!__atomic_compare_exchange_n (bin, &old,
+                                       _fast_bin_set_top (pool, old, NULL),
+                                       true, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_ACQUIRE));
+
+  fast_block_t *top = _fast_bin_get_top (pool, old);
+  for (fast_block_t *block = top; block != NULL; block = block->payload.next)
+    {
+      count++;
+    }
+  __atomic_fetch_sub (&pool->fast_bin_counts[offset], count, __ATOMIC_RELAXED);
+
+  return top;
+}
+
+static inline void
+_pool_lock (mem_pool_t *pool)
+{
+  while (__atomic_exchange_n (&pool->lock, 1, __ATOMIC_ACQUIRE))
+    {
+      while (__atomic_load_n (&pool->lock, __ATOMIC_RELAXED))
+        {
+          sched_yield ();
+        }
+    }
+}
+
+static inline void
+_pool_unlock (mem_pool_t *pool)
+{
+  __atomic_store_n (&pool->lock, 0, __ATOMIC_RELEASE);
+}
+
+bool
+deep_mem_init (void *mem, block_size_t size)
+{
+  return deep_mem_init_with_config (mem, size, NULL);
+}
+
+bool
+deep_mem_init_with_config (void *mem, block_size_t size,
+                           mem_pool_config_t const *config)
+{
+  mem_pool_t *pool = deep_pool_init_with_config (mem, size, config);
+
+  if (pool == NULL)
+    {
+      return false;
+    }
+  default_pool = pool;
+
+  return true;
+}
+
+void
+deep_pool_destroy (mem_pool_t *pool)
+{
+  if (pool != NULL && tcache.pool == pool)
+    {
+      deep_tcache_flush ();
+    }
+  /* the buffer belongs to the caller unless restored from an image; only
+   * mappings and regions are released */
+  while (pool != NULL && pool->mapped_blocks != NULL)
+    {
+      _free_mapped (pool, pool->mapped_blocks);
+    }
+  while (pool != NULL && pool->arenas != NULL)
+    {
+      _pool_release_arena (pool, pool->arenas);
+    }
+  if (pool != NULL)
+    {
+      pool->generation = 0;
+    }
+  if (pool != NULL && (pool->flags & POOL_FLAG_IMAGE))
+    {
+      _unmap_image (pool, pool->total_memory);
+    }
+}
+
+bool
+deep_mem_trace_start (char const *path)
+{
+  if (default_pool == NULL)
+    {
+      return false;
+    }
+  return trace_open (path, default_pool->total_memory);
+}
+
+void
+deep_mem_trace_stop (void)
+{
+  trace_close ();
+}
+
+void
+deep_mem_destroy (void)
+{
+  profile_forget ();
+  deep_pool_destroy (default_pool);
+  default_pool = NULL;
+}
+
+void *
+deep_pool_malloc (mem_pool_t *pool, block_size_t size)
+{
+  block_size_t aligned_size = _block_aligned_size (size);
+  void *ret = NULL;
+
+  if (!_pool_is_concurrent (pool))
+  {
+    return _arenas_alloc (pool, 0, size);
+  }
+
+  /* reusing a fast block takes no lock, carving one from remainder does */
+  if (aligned_size <= FAST_BIN_MAX_SIZE
+      && (ret = deep_malloc_fast_bins (pool, aligned_size, false)) != NULL)
+  {
+    return ret;
+  }
+  _pool_lock (pool);
+  ret = _arenas_alloc (pool, 0, size);
+  _pool_unlock (pool);
+
+  return ret;
+}
+
+static void *
+_pool_malloc (mem_pool_t *pool, block_size_t size)
+{
+  if (_pool_maps (pool, size))
+  {
+    return _malloc_mapped (pool, size);
+  }
+  if (__atomic_load_n (&pool->free_memory, __ATOMIC_RELAXED) < size)
+  {
+    return NULL;
+  }
+
+  block_size_t aligned_size = _block_aligned_size (size);
+
+  if (aligned_size <= FAST_BIN_MAX_SIZE)
+  {
+    return deep_malloc_fast_bins (pool, aligned_size, true);
+  }
+  if (aligned_size < SORTED_BIN_MIN_SIZE)
+  {
+    aligned_size = SORTED_BIN_MIN_SIZE;
+  }
+  return deep_malloc_sorted_bins (pool, aligned_size);
+}
+
+void *
+deep_malloc (block_size_t size)
+{
+  void *ret = deep_pool_malloc (default_pool, size);
+
+  if (TRACING ())
+    {
+      trace_append (TRACE_OP_MALLOC, size, _trace_id (ret), 0);
+    }
+  return ret;
+}
+
+/* The sampling side of deep_malloc_profiled. */
+void *
+deep_malloc_at (profile_site_t *site, block_size_t size)
+{
+  void *ret = deep_malloc (size);
+
+  if (ret != NULL && profile_tick (size))
+    {
+      profile_sample (site, _profile_key (ret), size);
+    }
+  return ret;
+}
+
+/**
+ * Zero only what the pool's policy leaves dirty:
+ *   - zero-on-alloc pools already cleared the payload in malloc;
+ *   - blocks mapped on their own are fresh anonymous memory;
+ *   - zero-on-free pools only hold free-list links in a reused block, i.e.
+ *     the fast bin link, or the skiplist / TLSF links and the footer;
+ *   - otherwise the whole payload.
+ **/
+void *
+deep_pool_calloc (mem_pool_t *pool, uint32_t count, block_size_t size)
+{
+  void *ret = NULL;
+
+  if (size != 0 && count > (block_size_t)-1 / size)
+  {
+    return NULL;
+  }
+  if ((ret = deep_pool_malloc (pool, count * size)) == NULL
+      || (pool->flags & POOL_FLAG_ZERO_ON_ALLOC))
+  {
+    return ret;
+  }
+
+  block_head_t head = block_load_head_of_payload (ret);
+  block_size_t payload_size = block_get_size (&head);
+  if (block_is_mapped (&head))
+  {
+    return ret;
+  }
+  if (!(pool->flags & POOL_FLAG_ZERO_ON_FREE))
+  {
+    memset (ret, 0, payload_size);
+  }
+  else if (block_is_fast (&head))
+  {
+    memset (ret, 0, sizeof (fast_block_t) - block_payload_offset);
+  }
+  else
+  {
+    block_size_t links_size = sizeof (sorted_block_t) - block_payload_offset;
+    memset (ret, 0, payload_size < links_size ? payload_size : links_size);
+    memset (get_pointer_by_offset_in_bytes (ret, payload_size
+                                                 - sizeof (block_head_t)),
+            0, sizeof (block_head_t));
+  }
+
+  return ret;
+}
+
+void *
+deep_calloc (uint32_t count, block_size_t size)
+{
+  void *ret = deep_pool_calloc (default_pool, count, size);
+
+  if (TRACING ())
+    {
+      /* an overflowing product fails, and is recorded as the biggest size */
+      block_size_t total = size != 0 && count > (block_size_t)-1 / size
+                               ? (block_size_t)-1
+                               : count * size;
+      trace_append (TRACE_OP_CALLOC, total, _trace_id (ret), 0);
+    }
+  return ret;
+}
+
+void *
+deep_pool_aligned_alloc (mem_pool_t *pool, uint32_t alignment,
+                         block_size_t size)
+{
+  void *ret;
+
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0
+      || alignment > ALIGNED_ALLOC_MAX_ALIGNMENT)
+  {
+    return NULL;
+  }
+  if (alignment <= block_payload_offset)
+  {
+    /* every payload is that aligned already */
+    return deep_pool_malloc (pool, size);
+  }
+
+  if (!_pool_is_concurrent (pool))
+  {
+    return _arenas_alloc (pool, alignment, size);
+  }
+  _pool_lock (pool);
+  ret = _arenas_alloc (pool, alignment, size);
+  _pool_unlock (pool);
+
+  return ret;
+}
+
+/**
+ * Over-allocate a sorted block, then cut it down to an aligned one:
+ *   - the leading slack is made at least SORTED_BIN_MIN_SIZE big and freed
+ *     as a sorted block of its own, so it merges and gets reused;
+ *   - the trailing slack goes the way of a realloc shrink.
+ * Aligned blocks are sorted blocks even when small, so that nothing but
+ * their own head sits between the slack and the payload.
+ **/
+static void *
+_pool_aligned_alloc (mem_pool_t *pool, uint32_t alignment, block_size_t size)
+{
+  if (size > (block_size_t)-1 - block_payload_offset - alignment
+                 - 2 * SORTED_BIN_MIN_SIZE)
+  {
+    return NULL;
+  }
+
+  block_size_t aligned_size = ALIGN_MEM_SIZE(size + block_payload_offset);
+  if (aligned_size < SORTED_BIN_MIN_SIZE)
+  {
+    aligned_size = SORTED_BIN_MIN_SIZE;
+  }
+
+  /* room for the worst leading slack, just under alignment + min size */
+  void *ptr = deep_malloc_sorted_bins (pool, aligned_size + alignment
+                                                 + SORTED_BIN_MIN_SIZE);
+  if (ptr == NULL)
+  {
+    return NULL;
+  }
+
+  sorted_block_t *block
+      = get_pointer_by_offset_in_bytes (ptr, -(int64_t)block_payload_offset);
+  block_size_t lead = -(uintptr_t)ptr & (alignment - 1);
+  while (lead != 0 && lead < SORTED_BIN_MIN_SIZE)
+  {
+    lead += alignment;
+  }
+
+  if (lead != 0)
+  {
+    PRINT_ARG("Aligned allocation frees %llu leading bytes\n",
+              (unsigned long long)lead);
+    sorted_block_t *aligned = _split_into_two_sorted_blocks (block, lead);
+    block_set_A_flag (&aligned->head, true);
+    block_set_P_flag (&aligned->head, true);
+    /* also clears the P flag of `aligned` */
+    deep_free_sorted_bins (pool, block);
+    block = aligned;
+  }
+  _shrink_sorted_block (pool, block, aligned_size);
+
+  return &block->payload;
+}
+
+void *
+deep_aligned_alloc (uint32_t alignment, block_size_t size)
+{
+  void *ret = deep_pool_aligned_alloc (default_pool, alignment, size);
+
+  if (TRACING ())
+    {
+      trace_append (TRACE_OP_ALIGNED_ALLOC, size, _trace_id (ret), alignment);
+    }
+  return ret;
+}
+
+/* Note that aligning is done in deep_malloc, the size shoulde already be 
+ * aligned here.
+ */
+static void *
+deep_malloc_fast_bins (mem_pool_t *pool, block_size_t aligned_size,
+                       bool from_remainder)
+{
+  uint32_t offset = (aligned_size >> 3) - 1;
+  fast_block_t *ret = NULL;
+  block_size_t payload_size;
+  
+  if ((ret = _fast_bin_pop (pool, offset)) == NULL && from_remainder
+      && aligned_size > get_remainder_size (pool)
+      && _consolidate_fast_blocks (pool))
+  {
+    ret = _fast_bin_pop (pool, offset);
+  }
+
+  if (ret != NULL)
+  {
+    PRINT_ARG("%s", "Fast block from stack\n");
+    payload_size = block_get_size(&ret->head);
+  }
+  // When there are no available fast blocks, grab at the end of the remainder.
+  else if (from_remainder && aligned_size <= get_remainder_size(pool))
+  {
+    PRINT_ARG("%s", "Fast block from remainder\n");
+    ret = (fast_block_t *)(get_pointer_by_offset_in_bytes
+        (pool->remainder_block_end, -(int64_t)aligned_size));
+    pool->remainder_block_end = (void *)ret;
+
+    payload_size = aligned_size - block_payload_offset;
+    ret->head = 0;
+    block_set_size (&ret->head, payload_size);
+  }
+  else 
+  {
+    return NULL;
+  }
+
+  if (pool->flags & POOL_FLAG_ZERO_ON_ALLOC)
+  {
+    memset (&ret->payload, 0, payload_size);
+  }
+  fast_block_store_A_flag (ret, true);
+  _pool_adjust_free_memory (pool, -(int64_t)(payload_size + block_payload_offset));
+
+  PRINT_ARG("Remainder start (after allocation): %p\n", pool->remainder_block_head);
+  PRINT_ARG("Remainder end (after allocation):   %p\n", pool->remainder_block_end);
+  PRINT_ARG("Payload size (after allocation):    %llu\n",
+            (unsigned long long)payload_size);
+  PRINT_ARG("Free memory (after allocation):     %llu\n", pool->free_memory);
+
+  return &ret->payload;
+}
+
+/* Note that aligning is done in deep_malloc, the size should already be 
+ * aligned here.
+ */
+static void *
+deep_malloc_sorted_bins (mem_pool_t *pool, block_size_t aligned_size)
+{
+  sorted_block_t *ret = NULL;
+  block_size_t payload_size = aligned_size - block_payload_offset;
+
+  if ((ret = _allocate_sorted_block (pool, aligned_size)) == NULL
+      && aligned_size > get_remainder_size (pool)
+      && _consolidate_fast_blocks (pool))
+  {
+    /* the freed fast blocks may have merged into a big enough block */
+    ret = _allocate_sorted_block (pool, aligned_size);
+  }
+
+  if (ret != NULL)
+  {
+    PRINT_ARG("%s", "Allocate from free sorted blocks\n");
+    /* the block found may be slightly bigger than required */
+    payload_size = block_get_size (&ret->head);
+  }
+  else if (aligned_size <= get_remainder_size (pool))
+  {
+    PRINT_ARG("%s", "Allocate from remainder\n");
+    /* no suitable sorted_block, carve from the head of remainder */
+    ret = (sorted_block_t *)pool->remainder_block_head;
+    pool->remainder_block_head
+        = (block_head_t *)get_block_by_offset (ret, aligned_size);
+    ret->head = 0;
+    block_set_size (&ret->head, payload_size);
+    /* a free block right before the remainder would have been merged */
+    block_set_P_flag (&ret->head, true);
+  }
+  else
+  {
+    return NULL;
+  }
+
+  if (pool->flags & POOL_FLAG_ZERO_ON_ALLOC)
+  {
+    memset (&ret->payload, 0, payload_size);
+  }
+  block_set_A_flag (&ret->head, true);
+  next_block_set_P_flag (ret, true);
+  _pool_adjust_free_memory (pool, -(int64_t)(payload_size + block_payload_offset));
+
+  PRINT_ARG("Remainder start (after allocation): %p\n", pool->remainder_block_head);
+  PRINT_ARG("Remainder end (after allocation):   %p\n", pool->remainder_block_end);
+  PRINT_ARG("Payload size (after allocation):    %llu\n",
+            (unsigned long long)payload_size);
+  PRINT_ARG("Free memory (after allocation):     %llu\n", pool->free_memory);
+
+  return &ret->payload;
+}
+
+/**
+ * Resize the block in place whenever possible:
+ *   - shrinking splits off the tail and frees it;
+ *   - growing absorbs the remainder or a free block right after it;
+ *   - otherwise fall back to malloc + memcpy + free.
+ * Blocks crossing between fast-bin and sorted-bin sizes are moved, as fast
+ * blocks only live in their own size classes.
+ **/
+void *
+deep_pool_realloc (mem_pool_t *pool, void *ptr, block_size_t size)
+{
+  void *ret = NULL;
+
+  if (!_pool_is_concurrent (pool))
+  {
+    return _arenas_realloc (pool, ptr, size);
+  }
+  _pool_lock (pool);
+  ret = _arenas_realloc (pool, ptr, size);
+  _pool_unlock (pool);
+
+  return ret;
+}
+
+static void *
+_pool_realloc (mem_pool_t *pool, void *ptr, block_size_t size)
+{
+  if (ptr == NULL)
+  {
+    return _pool_malloc (pool, size);
+  }
+  if (size == 0)
+  {
+    _pool_free (pool, ptr);
+    return NULL;
+  }
+
+  sorted_block_t *block = 
+      get_pointer_by_offset_in_bytes(ptr, -(int64_t)block_payload_offset);
+  if (!block_is_allocated (&block->head))
+  {
+    return NULL;
+  }
+  if (block_is_mapped (&block->head))
+  {
+    return _realloc_mapped (pool, _get_mapped_block (ptr), size);
+  }
+
+  block_size_t payload_size = block_get_size (&block->head);
+  block_size_t old_size = payload_size + block_payload_offset;
+  block_size_t aligned_size = _block_aligned_size (size);
+  void *ret = NULL;
+
+  if (block_is_fast (&block->head))
+  {
+    if (aligned_size <= old_size)
+    {
+      PRINT_ARG("%s", "Realloc fits in fast block\n");
+      return ptr;
+    }
+  }
+  /* blocks reaching mmap_threshold move out of the pool, by copying */
+  else if (!_pool_maps (pool, size))
+  {
+    if (aligned_size <= FAST_BIN_MAX_SIZE)
+    {
+      /* moving into a fast block frees up the whole sorted block */
+      if ((ret = deep_malloc_fast_bins (pool, aligned_size, true)) != NULL)
+      {
+        PRINT_ARG("%s", "Realloc moved into fast block\n");
+        memcpy (ret, ptr, size);
+        deep_free_sorted_bins (pool, block);
+        return ret;
+      }
+      aligned_size = SORTED_BIN_MIN_SIZE;
+    }
+    else if (aligned_size < SORTED_BIN_MIN_SIZE)
+    {
+      aligned_size = SORTED_BIN_MIN_SIZE;
+    }
+
+    if (aligned_size <= old_size)
+    {
+      PRINT_ARG("%s", "Realloc shrinks in place\n");
+      _shrink_sorted_block (pool, block, aligned_size);
+      return ptr;
+    }
+    if (_grow_sorted_block_in_place (pool, block, aligned_size))
+    {
+      PRINT_ARG("%s", "Realloc grows in place\n");
+      return ptr;
+    }
+  }
+
+  /* last resort */
+  if ((ret = _pool_malloc (pool, size)) == NULL)
+  {
+    return NULL;
+  }
+  PRINT_ARG("%s", "Realloc by copying\n");
+  memcpy (ret, ptr, payload_size < size ? payload_size : size);
+  _pool_free (pool, ptr);
+
+  return ret;
+}
+
+void *
+deep_realloc (void *ptr, block_size_t size)
+{
+  profile_sample_t sample;
+  /* taken out first, as the block may be freed */
+  bool sampled = PROFILING () && ptr != NULL
+                 && profile_take (_profile_key (ptr), &sample);
+  void *ret = deep_pool_realloc (default_pool, ptr, size);
+
+  if (TRACING ())
+    {
+      trace_append (TRACE_OP_REALLOC, size, _trace_id (ptr), _trace_id (ret));
+    }
+  if (sampled && ret != NULL)
+    {
+      profile_put (&sample, _profile_key (ret), size);
+    }
+  else if (sampled && size != 0)
+    {
+      profile_put (&sample, sample.key, sample.size); /* left in place */
+    }
+  return ret;
+}
+
+void
+deep_pool_free (mem_pool_t *pool, void *ptr)
+{
+  block_head_t head;
+
+  if (ptr == NULL || !_pool_is_concurrent (pool))
+  {
+    _arenas_free (pool, ptr);
+    return;
+  }
+
+  /* fast blocks go back onto the lock-free bins, from any thread */
+  head = block_load_head_of_payload (ptr);
+  if (block_is_fast (&head) && _pool_contains (pool, ptr))
+  {
+    _pool_free (pool, ptr);
+    return;
+  }
+  _pool_lock (pool);
+  _arenas_free (pool, ptr);
+  _pool_unlock (pool);
+}
+
+static void
+_pool_free (mem_pool_t *pool, void *ptr)
+{
+  if (ptr == NULL)
+  {
+    return;
+  }
+
+  void *head = 
+      get_pointer_by_offset_in_bytes(ptr, -(int64_t)block_payload_offset);
+ 
+  if (!block_is_allocated((block_head_t *)head))
+  {
+    PRINT_ARG("%s", "Double free\n");
+    return;
+  }
+
+  if (block_is_mapped ((block_head_t *)head))
+  {
+    _free_mapped (pool, _get_mapped_block (ptr));
+  }
+  else if (block_is_fast ((block_head_t *)head))
+  {
+    /* concurrent pools may get here without the lock */
+    deep_free_fast_bins (pool, head, !_pool_is_concurrent (pool));
+  }
+  else
+  {
+    deep_free_sorted_bins (pool, head);
+  }
+}
+
+void
+deep_free (void *ptr)
+{
+  /* recorded first: once freed, another thread may be handed the same id */
+  if (TRACING () && ptr != NULL)
+    {
+      trace_append (TRACE_OP_FREE, 0, _trace_id (ptr), 0);
+    }
+  if (PROFILING () && ptr != NULL)
+    {
+      profile_release (_profile_key (ptr));
+    }
+  deep_pool_free (default_pool, ptr);
+}
+
+/* `to_remainder` may only be set by callers holding the lock of a
+ * concurrent pool. */
+static void
+deep_free_fast_bins (mem_pool_t *pool, void *ptr, bool to_remainder)
+{
+  fast_block_t *block = ptr;
+  // block size is payload size according to spec.
+  block_size_t payload_size = block_get_size(&block->head);
+  uint32_t offset = ((payload_size + block_payload_offset) >> 3) - 1;
+
+  _pool_scrub (pool, &block->payload, payload_size);
+  _pool_adjust_free_memory (pool, payload_size + block_payload_offset);
+
+  // The block at the end of the remainder goes back to it.
+  if (to_remainder && (void *)block == pool->remainder_block_end)
+  {
+    PRINT_ARG("%s", "Fast block back to remainder\n");
+    /* a stale head must not pass for an allocated block */
+    fast_block_store_A_flag (block, false);
+    _pool_scrub (pool, block, block_payload_offset);
+    pool->remainder_block_end
+        = get_pointer_by_offset_in_bytes (block, payload_size
+                                                     + block_payload_offset);
+    _extend_remainder_end (pool);
+  }
+  else
+  {
+    fast_block_store_A_flag (block, false);
+    _fast_bin_push (pool, offset, block);
+  }
+
+  PRINT_ARG("Remainder start (after free): %p\n", pool->remainder_block_head);
+  PRINT_ARG("Remainder end (after free):   %p\n", pool->remainder_block_end);
+  PRINT_ARG("Payload size (after free):    %llu\n",
+            (unsigned long long)payload_size);
+  PRINT_ARG("Free memory (after free):     %llu\n", pool->free_memory);
+}
+
+static void
+deep_free_sorted_bins (mem_pool_t *pool, void *ptr)
+{
+  sorted_block_t *block = ptr;
+  sorted_block_t *the_other = NULL;
+  // block size is payload size according to spec.
+  block_size_t payload_size = block_get_size (&block->head);
+
+  _pool_scrub (pool, &block->payload, payload_size);
+  block_set_A_flag (&block->head, false);
+  _pool_adjust_free_memory (pool, payload_size + block_payload_offset);
+
+  /* try to merge */
+  /* merge above */
+  if (!prev_block_is_allocated (&block->head))
+    {
+      PRINT_ARG("%s", "Merge above\n");
+      the_other = get_prev_block_by_footer (block);
+      _remove_free_sorted_block (pool, the_other);
+      _merge_into_single_block (pool, the_other, block);
+      block = the_other;
+    }
+
+  /* merge below */
+  the_other = get_next_block (block);
+  /* update remainder_block if it is involved */
+  if (the_other == (sorted_block_t *)pool->remainder_block_head)
+    {
+      PRINT_ARG("%s", "Merge into remainder\n");
+      pool->remainder_block_head = (block_head_t *)block;
+      /* the rest of the block is already clear */
+      _pool_scrub (pool, block, sorted_block_links_size (block));
+    }
+  else if (block == pool->remainder_block_end)
+    {
+      PRINT_ARG("%s", "Merge into remainder end\n");
+      _pool_scrub (pool, block, sorted_block_links_size (block));
+      pool->remainder_block_end = the_other;
+      _extend_remainder_end (pool);
+    }
+  else
+    {
+      /* a fast neighbour may be changing hands without the lock */
+      block_head_t next_head
+          = __atomic_load_n (&the_other->head, __ATOMIC_RELAXED);
+      if (!block_is_fast (&next_head) && !block_is_allocated (&next_head))
+        {
+          PRINT_ARG("%s", "Merge below\n");
+          _remove_free_sorted_block (pool, the_other);
+          _merge_into_single_block (pool, block, the_other);
+        }
+      block_set_footer (block);
+      next_block_set_P_flag (block, false);
+      _insert_free_sorted_block (pool, block);
+    }
+
+  PRINT_ARG("Remainder start (after free): %p\n", pool->remainder_block_head);
+  PRINT_ARG("Remainder end (after free):   %p\n", pool->remainder_block_end);
+  PRINT_ARG("Payload size (after free):    %llu\n",
+            (unsigned long long)payload_size);
+  PRINT_ARG("Free memory (after free):     %llu\n", pool->free_memory);
+}
+
+uint32_t
+deep_pool_malloc_batch (mem_pool_t *pool, block_size_t size, uint32_t n,
+                        void **out)
+{
+  block_size_t aligned_size = _block_aligned_size (size);
+  uint32_t count = 0;
+
+  if (aligned_size > FAST_BIN_MAX_SIZE && aligned_size < SORTED_BIN_MIN_SIZE)
+    {
+      aligned_size = SORTED_BIN_MIN_SIZE;
+    }
+  if (_pool_is_concurrent (pool))
+    {
+      _pool_lock (pool);
+    }
+  count = _arenas_malloc_batch (pool, aligned_size, n, out);
+  if (_pool_is_concurrent (pool))
+    {
+      _pool_unlock (pool);
+    }
+
+  if (pool->flags & POOL_FLAG_ZERO_ON_ALLOC)
+    {
+      for (uint32_t i = 0; i < count; ++i)
+        {
+          block_head_t head = block_load_head_of_payload (out[i]);
+          memset (out[i], 0, block_get_size (&head));
+        }
+    }
+
+  return count;
+}
+
+uint32_t
+deep_malloc_batch (block_size_t size, uint32_t n, void **out)
+{
+  uint32_t count = deep_pool_malloc_batch (default_pool, size, n, out);
+
+  if (TRACING ())
+    {
+      trace_append_batch (TRACE_OP_MALLOC, size, out, count, default_pool);
+    }
+  return count;
+}
+
+static int
+_compare_addresses (const void *a, const void *b)
+{
+  uintptr_t x = (uintptr_t)*(void *const *)a;
+  uintptr_t y = (uintptr_t)*(void *const *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+void
+deep_pool_free_batch (mem_pool_t *pool, void **ptrs, uint32_t n)
+{
+  uint32_t sorted = 0;
+  uint32_t i = 0;
+
+  if (_pool_is_concurrent (pool))
+    {
+      _pool_lock (pool);
+    }
+
+  /* fast blocks never merge, and blocks outside the pool's buffer go one
+   * by one; move the sorted ones to the front */
+  for (i = 0; i < n; ++i)
+    {
+      if (ptrs[i] == NULL)
+        {
+          continue;
+        }
+      block_head_t head = block_load_head_of_payload (ptrs[i]);
+      if (!block_is_allocated (&head))
+        {
+          PRINT_ARG("%s", "Double free\n");
+          continue;
+        }
+      if (!_pool_contains (pool, ptrs[i]))
+        {
+          /* mapped on its own or in an extra arena */
+          _arenas_free (pool, ptrs[i]);
+        }
+      else if (block_is_fast (&head))
+        {
+          deep_free_fast_bins (pool,
+                               get_pointer_by_offset_in_bytes (
+                                   ptrs[i], -(int64_t)block_payload_offset),
+                               true);
+        }
+      else
+        {
+          ptrs[sorted++] = ptrs[i];
+        }
+    }
+
+  /* neighbours end up next to each other, and so do sorted blocks passed
+   * twice, which are still allocated until freed below */
+  qsort (ptrs, sorted, sizeof (void *), _compare_addresses);
+  uint32_t unique = 0;
+  for (i = 0; i < sorted; ++i)
+    {
+      if (unique > 0 && ptrs[i] == ptrs[unique - 1])
+        {
+          PRINT_ARG("%s", "Double free\n");
+          continue;
+        }
+      ptrs[unique++] = ptrs[i];
+    }
+  sorted = unique;
+  i = 0;
+  while (i < sorted)
+    {
+      sorted_block_t *block = get_pointer_by_offset_in_bytes (
+          ptrs[i++], -(int64_t)block_payload_offset);
+
+      /* a run of adjacent sorted blocks is freed as one block, so it is
+       * merged with its neighbours and indexed only once */
+      while (i < sorted
+             && (uint8_t *)ptrs[i] - block_payload_offset
+                    == (uint8_t *)get_next_block (block))
+        {
+          sorted_block_t *next = get_next_block (block);
+          block_set_size (&block->head, block_get_size (&block->head)
+                                            + block_get_size (&next->head)
+                                            + block_payload_offset);
+          ++i;
+        }
+      deep_free_sorted_bins (pool, block);
+    }
+
+  if (_pool_is_concurrent (pool))
+    {
+      _pool_unlock (pool);
+    }
+}
+
+void
+deep_free_batch (void **ptrs, uint32_t n)
+{
+  if (TRACING ())
+    {
+      trace_append_batch (TRACE_OP_FREE, 0, ptrs, n, default_pool);
+    }
+  if (PROFILING ())
+    {
+      for (uint32_t i = 0; i < n; ++i)
+        {
+          if (ptrs[i] != NULL)
+            {
+              profile_release (_profile_key (ptrs[i]));
+            }
+        }
+    }
+  deep_pool_free_batch (default_pool, ptrs, n);
+}
+
+/**
+ * Bind the calling thread's cache to `pool`, flushing whatever it holds for
+ * another pool, or for the pool once set up or moved at the same address.
+ **/
+static inline void
+_tcache_bind (mem_pool_t *pool)
+{
+  if (tcache.pool != pool || tcache.generation != pool->generation)
+    {
+      deep_tcache_flush ();
+      tcache.pool = pool;
+      tcache.generation = pool->generation;
+    }
+}
+
+void *
+deep_tcache_malloc (mem_pool_t *pool, block_size_t size)
+{
+  block_size_t aligned_size = _block_aligned_size (size);
+  fast_block_t *block = NULL;
+  void *ret = NULL;
+
+  uint32_t offset = (aligned_size >> 3) - 1;
+  if (aligned_size <= FAST_BIN_MAX_SIZE)
+    {
+      _tcache_bind (pool);
+      if (tcache.bins[offset] == NULL)
+        {
+          _tcache_refill (offset, aligned_size);
+        }
+    }
+  /* big blocks, and small ones once the pool's own buffer is short */
+  if (aligned_size > FAST_BIN_MAX_SIZE || tcache.bins[offset] == NULL)
+    {
+      _pool_lock (pool);
+      ret = _arenas_alloc (pool, 0, size);
+      _pool_unlock (pool);
+      return ret;
+    }
+
+  block = tcache.bins[offset];
+  tcache.bins[offset] = block->payload.next;
+  tcache.counts[offset]--;
+  if (pool->flags & POOL_FLAG_ZERO_ON_ALLOC)
+    {
+      memset (&block->payload, 0, block_get_size (&block->head));
+    }
+
+  return &block->payload;
+}
+
+void
+deep_tcache_free (mem_pool_t *pool, void *ptr)
+{
+  if (ptr == NULL)
+    {
+      return;
+    }
+
+  fast_block_t *block
+      = get_pointer_by_offset_in_bytes (ptr, -(int64_t)block_payload_offset);
+  block_head_t head = block_load_head_of_payload (ptr);
+  if (!block_is_fast (&head) || !_pool_contains (pool, ptr))
+    {
+      _pool_lock (pool);
+      _arenas_free (pool, ptr);
+      _pool_unlock (pool);
+      return;
+    }
+
+  uint32_t offset = ((block_get_size (&head) + block_payload_offset) >> 3) - 1;
+  _tcache_bind (pool);
+  _pool_scrub (pool, &block->payload, block_get_size (&head));
+  block->payload.next = tcache.bins[offset];
+  tcache.bins[offset] = block;
+  if (++tcache.counts[offset] > TCACHE_BIN_CAPACITY)
+    {
+      _tcache_drain (offset, TCACHE_BATCH_SIZE);
+    }
+}
+
+void
+deep_tcache_flush (void)
+{
+  if (tcache.pool == NULL)
+    {
+      return;
+    }
+  /* a pool moved or destroyed since has no bins for the blocks any more,
+   * which stay allocated wherever it went */
+  if (tcache.pool->generation == tcache.generation)
+    {
+      for (uint32_t offset = 0; offset < FAST_BIN_LENGTH; ++offset)
+        {
+          _tcache_drain (offset, tcache.counts[offset]);
+        }
+    }
+  memset (&tcache, 0, sizeof (tcache));
+}
+
+/**
+ * Move up to TCACHE_BATCH_SIZE blocks of the given size class from the pool
+ * into the thread cache. Cached blocks stay allocated as far as the pool is
+ * concerned.
+ **/
+static void
+_tcache_refill (uint32_t offset, block_size_t aligned_size)
+{
+  mem_pool_t *pool = tcache.pool;
+
+  _pool_lock (pool);
+  for (uint32_t i = 0; i < TCACHE_BATCH_SIZE; ++i)
+    {
+      void *ptr = deep_malloc_fast_bins (pool, aligned_size, true);
+      if (ptr == NULL)
+        {
+          break;
+        }
+      fast_block_t *block = get_pointer_by_offset_in_bytes (
+          ptr, -(int64_t)block_payload_offset);
+      block->payload.next = tcache.bins[offset];
+      tcache.bins[offset] = block;
+      tcache.counts[offset]++;
+    }
+  _pool_unlock (pool);
+}
+
+/**
+ * Hand `count` blocks of the given size class back to the pool's fast bins.
+ **/
+static void
+_tcache_drain (uint32_t offset, uint32_t count)
+{
+  mem_pool_t *pool = tcache.pool;
+
+  if (count == 0)
+    {
+      return;
+    }
+  _pool_lock (pool);
+  while (count-- > 0 && tcache.bins[offset] != NULL)
+    {
+      fast_block_t *block = tcache.bins[offset];
+      tcache.bins[offset] = block->payload.next;
+      tcache.counts[offset]--;
+      deep_free_fast_bins (pool, block, true);
+    }
+  _pool_unlock (pool);
+}
+
+/**
+ * Add the counters of one arena to `stats`.
+ **/
+static void
+_pool_add_stats (mem_pool_t *arena, mem_stats_t *stats)
+{
+  sorted_block_t *largest = NULL;
+  uint64_t free_bytes
+      = __atomic_load_n (&arena->free_memory, __ATOMIC_RELAXED);
+
+  stats->total_bytes += arena->total_memory;
+  stats->free_bytes += free_bytes;
+  stats->used_bytes += arena->total_memory - free_bytes;
+  stats->remainder_bytes += get_remainder_size (arena);
+  if (get_remainder_size (arena) > stats->largest_free_block)
+    {
+      stats->largest_free_block = get_remainder_size (arena);
+    }
+  for (int i = 0; i < FAST_BIN_LENGTH; ++i)
+    {
+      uint32_t count
+          = __atomic_load_n (&arena->fast_bin_counts[i], __ATOMIC_RELAXED);
+      stats->fast_bin_blocks[i] += count;
+      if (count != 0 && (uint64_t)(i + 1) * 8 > stats->largest_free_block)
+        {
+          stats->largest_free_block = (i + 1) * 8;
+        }
+    }
+  stats->sorted_blocks += arena->sorted_block_count;
+  for (int i = 0; i < STATS_HISTOGRAM_LENGTH; ++i)
+    {
+      stats->sorted_block_histogram[i] += arena->sorted_block_histogram[i];
+    }
+  for (int i = 0; i <= SORTED_BLOCK_INDICES_LEVEL; ++i)
+    {
+      stats->tower_heights[i] += arena->tower_heights[i];
+    }
+  if ((largest = _find_largest_sorted_block (arena)) != NULL
+      && block_get_size (&largest->head) + block_payload_offset
+             > stats->largest_free_block)
+    {
+      stats->largest_free_block
+          = block_get_size (&largest->head) + block_payload_offset;
+    }
+}
+
+void
+deep_pool_stats (mem_pool_t *pool, mem_stats_t *stats)
+{
+  memset (stats, 0, sizeof (*stats));
+  if (_pool_is_concurrent (pool))
+    {
+      _pool_lock (pool);
+    }
+
+  for (mem_pool_t *arena = _pool_next_arena (pool, NULL); arena != NULL;
+       arena = _pool_next_arena (pool, arena))
+    {
+      _pool_add_stats (arena, stats);
+    }
+  stats->arenas = pool->arena_count;
+  stats->mapped_blocks = pool->mapped_block_count;
+  stats->mapped_bytes = pool->mapped_bytes;
+
+  if (_pool_is_concurrent (pool))
+    {
+      _pool_unlock (pool);
+    }
+
+  stats->fragmentation
+      = stats->free_bytes == 0
+            ? 0
+            : 1.0 - (double)stats->largest_free_block / stats->free_bytes;
+}
+
+bool
+deep_mem_stats (mem_stats_t *stats)
+{
+  if (default_pool == NULL)
+    {
+      return false;
+    }
+  deep_pool_stats (default_pool, stats);
+
+  return true;
+}
+
+static inline void *
+_rebase_pointer (void *p, int64_t delta)
+{
+  return (void *)((uintptr_t)p + (uintptr_t)delta);
+}
+
+/**
+ * Point the absolute pointers of the pool copied into `pool` at it instead
+ * of `from`, where they were taken; a NULL `from` or `to` stands for
+ * offsets from the pool, as kept in images. Skiplist links, the TLSF index
+ * and fast bins are relative already, and mapped blocks and arenas live
+ * outside the buffer.
+ **/
+static void
+_pool_rebase (mem_pool_t *pool, void *from, void *to)
+{
+  int64_t delta = (int64_t)((uintptr_t)to - (uintptr_t)from);
+
+  if (pool->sorted_block.addr != NULL)
+    {
+      pool->sorted_block.addr
+          = _rebase_pointer (pool->sorted_block.addr, delta);
+    }
+  pool->remainder_block_head
+      = _rebase_pointer (pool->remainder_block_head, delta);
+  pool->remainder_block_end
+      = _rebase_pointer (pool->remainder_block_end, delta);
+  for (int i = 0; i < FAST_BIN_LENGTH; ++i)
+    {
+      fast_block_t *block = _fast_bin_get_top (pool, pool->fast_bins[i]);
+      while (block != NULL)
+        {
+          fast_block_t *next = block->payload.next;
+          if (next == NULL)
+            {
+              break;
+            }
+          block->payload.next = _rebase_pointer (next, delta);
+          block = _rebase_pointer (next, (int64_t)((uintptr_t)pool
+                                                   - (uintptr_t)from));
+        }
+    }
+}
+
+/* Unmap the pool at `mem` restored from an image, whose mapping starts at
+   the page holding it. */
+static void
+_unmap_image (void *mem, mem_size_t size)
+{
+  uint64_t misalignment = (uintptr_t)mem % sysconf (_SC_PAGESIZE);
+
+  munmap ((uint8_t *)mem - misalignment, misalignment + size);
+}
+
+mem_pool_t *
+deep_pool_migrate (mem_pool_t *pool, void *new_mem, block_size_t size)
+{
+  mem_size_t aligned_size = ALIGN_MEM_SIZE_TRUNC(size);
+  mem_size_t old_size;
+  void *old_mem;
+
+  if (pool == NULL || new_mem == NULL || aligned_size < pool->total_memory
+      || size > POOL_MAX_SIZE)
+    {
+      return NULL;
+    }
+
+  if (tcache.pool == pool)
+    {
+      deep_tcache_flush ();
+    }
+  old_size = pool->total_memory;
+  old_mem = pool;
+  memmove (new_mem, pool, old_size);
+  pool = (mem_pool_t *)new_mem;
+  _pool_rebase (pool, old_mem, pool);
+  if (new_mem != old_mem)
+    {
+      /* caches bound to the old handle must not flush into it */
+      if ((uint8_t *)old_mem + sizeof (mem_pool_t) <= (uint8_t *)new_mem
+          || (uint8_t *)new_mem + aligned_size <= (uint8_t *)old_mem)
+        {
+          ((mem_pool_t *)old_mem)->generation = 0;
+        }
+      pool->generation = _pool_new_generation ();
+    }
+  if (pool->flags & POOL_FLAG_IMAGE)
+    {
+      /* the new buffer is the caller's */
+      pool->flags &= ~POOL_FLAG_IMAGE;
+      _unmap_image (old_mem, old_size);
+    }
+
+  if (aligned_size > old_size)
+    {
+      void *old_fence = get_pointer_by_offset_in_bytes (pool, old_size - 8);
+      void *new_fence = get_pointer_by_offset_in_bytes (pool, aligned_size - 8);
+
+      /* free fast blocks between the remainder and the old fence may
+       * take it up to there */
+      if (pool->remainder_block_end != old_fence)
+        {
+          _consolidate_fast_blocks (pool);
+        }
+      /* blocks sit between the remainder and the old fence, so the old
+       * remainder is given away, as one free sorted block or to the block
+       * before it, and the new space becomes remainder, along with a free
+       * block ending at the old fence. */
+      if (pool->remainder_block_end != old_fence)
+        {
+          block_size_t left = get_remainder_size (pool);
+          if (left >= SORTED_BIN_MIN_SIZE
+              || (left != 0 && !_grow_block_before_remainder (pool, left)))
+            {
+              _release_region_to_bins (pool, pool->remainder_block_head,
+                                       left);
+            }
+          pool->remainder_block_head = old_fence;
+
+          /* the fence has no P flag to tell, so look for the last block */
+          sorted_block_t *last = pool->remainder_block_end;
+          while (get_next_block (last) != old_fence)
+            {
+              last = get_next_block (last);
+            }
+          /* at most two free blocks in a row: the old remainder and it */
+          while (!block_is_fast (&last->head)
+                 && !block_is_allocated (&last->head))
+            {
+              sorted_block_t *prev = prev_block_is_allocated (&last->head)
+                                         ? NULL
+                                         : get_prev_block_by_footer (last);
+              _remove_free_sorted_block (pool, last);
+              _pool_scrub (pool, last, sorted_block_links_size (last));
+              _pool_scrub (pool, get_pointer_by_offset_in_bytes (
+                                     pool->remainder_block_head,
+                                     -(int64_t)sizeof (block_head_t)),
+                           sizeof (block_head_t));
+              pool->remainder_block_head = (block_head_t *)last;
+              if (prev == NULL)
+                {
+                  break;
+                }
+              last = prev;
+            }
+        }
+      _pool_scrub (pool, old_fence, aligned_size - old_size);
+      pool->remainder_block_end = new_fence;
+      *(block_head_t *)new_fence = 0;
+      block_set_A_flag ((block_head_t *)new_fence, true);
+      block_set_P_flag ((block_head_t *)new_fence, true);
+      _pool_adjust_free_memory (pool, aligned_size - old_size);
+      pool->total_memory = aligned_size;
+    }
+
+  PRINT_ARG("Remainder start (after migration): %p\n", pool->remainder_block_head);
+  PRINT_ARG("Remainder end (after migration):   %p\n", pool->remainder_block_end);
+  PRINT_ARG("Free memory (after migration):     %llu\n", pool->free_memory);
+
+  return pool;
+}
+
+bool
+deep_mem_migrate (void *new_mem, block_size_t size)
+{
+  mem_pool_t *pool = deep_pool_migrate (default_pool, new_mem, size);
+
+  if (pool == NULL)
+    {
+      return false;
+    }
+  default_pool = pool;
+
+  return true;
+}
+
+/* A pool image is a pool_image_header_t, then the pool, with the pointers
+   in its header and free fast blocks turned into offsets from it. */
+#define POOL_IMAGE_MAGIC "DMIMAGE1"
+/* Where the mapping of the pool starts in the file, a multiple of any page
+   size; the pool sits at its address modulo ALIGNED_ALLOC_MAX_ALIGNMENT past
+   it, so aligned blocks stay aligned once mapped back. */
+#define POOL_IMAGE_OFFSET (64 * 1024)
+
+typedef struct pool_image_header
+{
+  char magic[8];
+  uint32_t head_bits; /* BLOCK_HEAD_BITS of the build that wrote it */
+  uint32_t pool_header_size; /* sizeof (mem_pool_t) in that build */
+  uint64_t pool_offset; /* in the file */
+  uint64_t total_memory;
+} pool_image_header_t;
+
+/**
+ * The image goes to a temporary file renamed to `path` once complete, so
+ * that pools restored from an older image at `path`, which map its pages,
+ * keep reading that one.
+ **/
+bool
+deep_pool_snapshot (mem_pool_t *pool, char const *path)
+{
+  uint64_t pool_offset, file_size;
+  char *tmp_path;
+  void *map;
+  bool ret = false;
+  int fd;
+
+  if (pool == NULL || pool->mapped_blocks != NULL || pool->arenas != NULL)
+    {
+      return false;
+    }
+
+  pool_offset = POOL_IMAGE_OFFSET
+                + (uintptr_t)pool % ALIGNED_ALLOC_MAX_ALIGNMENT;
+  file_size = pool_offset + pool->total_memory;
+  tmp_path = malloc (strlen (path) + sizeof (".XXXXXX"));
+  if (tmp_path == NULL)
+    {
+      return false;
+    }
+  sprintf (tmp_path, "%s.XXXXXX", path);
+  fd = mkstemp (tmp_path);
+  if (fd < 0)
+    {
+      free (tmp_path);
+      return false;
+    }
+  if (fchmod (fd, 0644) == 0 && ftruncate (fd, file_size) == 0
+      && (map = mmap (NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0))
+             != MAP_FAILED)
+    {
+      pool_image_header_t *header = map;
+      mem_pool_t *image = get_pointer_by_offset_in_bytes (map, pool_offset);
+      int64_t remainder_head
+          = get_offset_between_pointers_in_bytes (pool->remainder_block_head,
+                                                  pool);
+      int64_t remainder_end
+          = get_offset_between_pointers_in_bytes (pool->remainder_block_end,
+                                                  pool);
+
+      /* the remainder holds nothing, and reads as zero from the hole */
+      memcpy (image, pool, remainder_head);
+      memcpy (get_pointer_by_offset_in_bytes (image, remainder_end),
+              pool->remainder_block_end, pool->total_memory - remainder_end);
+      _pool_rebase (image, pool, NULL);
+      image->lock = 0;
+      image->flags &= ~POOL_FLAG_IMAGE;
+      memset (&image->region_provider, 0, sizeof (image->region_provider));
+
+      memcpy (header->magic, POOL_IMAGE_MAGIC, sizeof (header->magic));
+      header->head_bits = BLOCK_HEAD_BITS;
+      header->pool_header_size = sizeof (mem_pool_t);
+      header->pool_offset = pool_offset;
+      header->total_memory = pool->total_memory;
+      munmap (map, file_size);
+      ret = rename (tmp_path, path) == 0;
+    }
+  close (fd);
+  if (!ret)
+    {
+      unlink (tmp_path);
+    }
+  free (tmp_path);
+
+  return ret;
+}
+
+mem_pool_t *
+deep_pool_restore (char const *path)
+{
+  pool_image_header_t header;
+  mem_pool_t *pool = NULL;
+  struct stat st;
+  int fd;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    {
+      return NULL;
+    }
+  if (pread (fd, &header, sizeof (header), 0) == sizeof (header)
+      && memcmp (header.magic, POOL_IMAGE_MAGIC, sizeof (header.magic)) == 0
+      && header.head_bits == BLOCK_HEAD_BITS
+      && header.pool_header_size == sizeof (mem_pool_t)
+      && header.pool_offset >= POOL_IMAGE_OFFSET
+      && header.pool_offset - POOL_IMAGE_OFFSET < ALIGNED_ALLOC_MAX_ALIGNMENT
+      && fstat (fd, &st) == 0
+      && (uint64_t)st.st_size >= header.pool_offset + header.total_memory)
+    {
+      uint64_t misalignment = header.pool_offset - POOL_IMAGE_OFFSET;
+      /* private, so that every pool restored from the file reads its pages
+       * until it writes to them */
+      void *map = mmap (NULL, misalignment + header.total_memory,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                        POOL_IMAGE_OFFSET);
+      if (map != MAP_FAILED)
+        {
+          pool = get_pointer_by_offset_in_bytes (map, misalignment);
+          _pool_rebase (pool, NULL, pool);
+          pool->flags |= POOL_FLAG_IMAGE;
+          pool->generation = _pool_new_generation ();
+        }
+    }
+  close (fd);
+
+  PRINT_ARG("Pool restored at: %p\n", pool);
+
+  return pool;
+}
+
+bool
+deep_mem_snapshot (char const *path)
+{
+  return default_pool != NULL && deep_pool_snapshot (default_pool, path);
+}
+
+bool
+deep_mem_restore (char const *path)
+{
+  mem_pool_t *pool = deep_pool_restore (path);
+
+  if (pool == NULL)
+    {
+      return false;
+    }
+  /* samples of the old pool would name blocks of this one */
+  profile_forget ();
+  default_pool = pool;
+
+  return true;
+}
+
+slab_cache_t *
+deep_slab_create (block_size_t object_size, uint32_t objects_per_slab)
+{
+  return deep_pool_slab_create (default_pool, object_size, objects_per_slab);
+}
+
+void
+deep_slab_destroy (slab_cache_t *cache)
+{
+  deep_pool_slab_destroy (default_pool, cache);
+}
+
+void *
+deep_slab_alloc (slab_cache_t *cache)
+{
+  return deep_pool_slab_alloc (default_pool, cache);
+}
+
+void
+deep_slab_free (slab_cache_t *cache, void *ptr)
+{
+  deep_pool_slab_free (default_pool, cache, ptr);
+}
+
+bool
+deep_region_begin (block_size_t chunk_size)
+{
+  mem_region_t *region = deep_pool_region_begin (default_pool, chunk_size);
+
+  if (region == NULL)
+    {
+      return false;
+    }
+  region->outer = region_stack;
+  region_stack = region;
+
+  return true;
+}
+
+void *
+deep_region_alloc (block_size_t size)
+{
+  return deep_pool_region_alloc (region_stack, size);
+}
+
+void
+deep_region_reset (void)
+{
+  deep_pool_region_reset (region_stack);
+}
+
+void
+deep_region_end (void)
+{
+  mem_region_t *region = region_stack;
+
+  if (region != NULL)
+    {
+      region_stack = region->outer;
+      deep_pool_region_end (region);
+    }
+}
+
+/* helper functions for maintaining the sorted_block skiplist.
+ * aligned_size is the total size of the first block (head + payload).
+*/
+static sorted_block_t *
+_split_into_two_sorted_blocks (sorted_block_t *block,
+                               block_size_t aligned_size)
+{
+  sorted_block_t *new_block = get_block_by_offset(block, aligned_size);
+  // new block size = old block size - space used (aligned_size).
+  block_size_t new_block_size
+      = block_get_size(&block->head) - aligned_size;
+
+  new_block->head = 0;
+  block_set_size (&new_block->head, new_block_size);
+  block_set_A_flag (&new_block->head, false);
+  block_set_P_flag (&new_block->head, false); /* by default */
+  block_set_size (&block->head, aligned_size - block_payload_offset);
+
+  return new_block;
+}
+
+/**
+ * Assuming `curr` and `next` are contiguous in memory address,
+ * where curr < next, and neither of them is in the skiplist.
+ * The merged block keeps the flags of `curr`; the caller is in charge of
+ * its footer and of inserting it into the skiplist.
+ **/
+static void
+_merge_into_single_block (mem_pool_t *pool, sorted_block_t *curr,
+                          sorted_block_t *next)
+{
+  block_size_t curr_size = block_get_size (&curr->head);
+  block_size_t new_size = curr_size + block_get_size (&next->head)
+                          + block_payload_offset;
+
+  block_set_size (&curr->head, new_size);
+  /* the footer of `curr` and the head and links of `next` are now payload;
+   * a bare head split off by a shrink has no footer of its own */
+  if (curr_size >= sizeof (block_head_t))
+    {
+      _pool_scrub (pool,
+                   get_pointer_by_offset_in_bytes (
+                       next, -(int64_t)sizeof (block_head_t)),
+                   sizeof (block_head_t));
+    }
+  _pool_scrub (pool, next, sorted_block_links_size (next));
+}
+
+/**
+ * Allocate up to `n` blocks of `aligned_size` (head + payload) bytes, which
+ * is a fast-bin size or at least SORTED_BIN_MIN_SIZE. The caller holds the
+ * lock of a concurrent pool.
+ **/
+static uint32_t
+_malloc_batch (mem_pool_t *pool, block_size_t aligned_size, uint32_t n,
+               void **out)
+{
+  uint32_t count = 0;
+  uint32_t run = 0;
+
+  if (aligned_size <= FAST_BIN_MAX_SIZE)
+    {
+      return _malloc_fast_batch (pool, aligned_size, n, out);
+    }
+  while (count < n
+         && (run = _malloc_sorted_run (pool, aligned_size, n - count,
+                                       out + count))
+                != 0)
+    {
+      count += run;
+    }
+
+  return count;
+}
+
+/**
+ * Hand out up to `n` fast blocks: the top of the bin first, then one run
+ * carved from the end of the remainder. The caller holds the lock of a
+ * concurrent pool.
+ **/
+static uint32_t
+_malloc_fast_batch (mem_pool_t *pool, block_size_t aligned_size, uint32_t n,
+                    void **out)
+{
+  uint32_t offset = (aligned_size >> 3) - 1;
+  uint32_t count = 0;
+  fast_block_t *block = NULL;
+
+  while (count < n && (block = _fast_bin_pop (pool, offset)) != NULL)
+    {
+      block_set_A_flag (&block->head, true);
+      out[count++] = &block->payload;
+    }
+
+  mem_size_t run = get_remainder_size (pool) / aligned_size;
+  if (run > n - count)
+    {
+      run = n - count;
+    }
+  block = get_pointer_by_offset_in_bytes (pool->remainder_block_end,
+                                          -(int64_t)(run * aligned_size));
+  pool->remainder_block_end = (block_head_t *)block;
+  for (uint32_t i = 0; i < run; ++i)
+    {
+      block->head = 0;
+      block_set_size (&block->head, aligned_size - block_payload_offset);
+      block_set_A_flag (&block->head, true);
+      out[count++] = &block->payload;
+      block = get_pointer_by_offset_in_bytes (block, aligned_size);
+    }
+  _pool_adjust_free_memory (pool, -(int64_t)(count * aligned_size));
+
+  return count;
+}
+
+/**
+ * Carve a run of up to `n` sorted blocks from a single region, in order of
+ * preference:
+ *   - a free block holding all of them;
+ *   - the remainder, if it holds all of them;
+ *   - any free block holding at least one;
+ *   - whatever fits in the remainder.
+ * A free block's leftover goes back to the index when it is big enough,
+ * otherwise it pads the last block. Returns 0 when nothing fits.
+ **/
+static uint32_t
+_malloc_sorted_run (mem_pool_t *pool, block_size_t aligned_size, uint32_t n,
+                    void **out)
+{
+  uint64_t wanted = 0;
+  sorted_block_t *block = NULL;
+  uint64_t region_size = 0;
+  bool from_remainder = false;
+
+  if (!__builtin_mul_overflow ((uint64_t)aligned_size, n, &wanted)
+      && wanted - block_payload_offset <= (block_size_t)-1)
+    {
+      block = _find_free_sorted_block (
+          pool, (block_size_t)(wanted - block_payload_offset));
+    }
+  else
+    {
+      wanted = UINT64_MAX; /* never held by the remainder */
+    }
+  if (block == NULL
+      && (get_remainder_size (pool) >= wanted
+          || (block = _find_free_sorted_block (
+                  pool, aligned_size - block_payload_offset))
+                 == NULL))
+    {
+      from_remainder = true;
+    }
+
+  if (from_remainder)
+    {
+      region_size = get_remainder_size (pool) / aligned_size * aligned_size;
+      if (region_size > wanted)
+        {
+          region_size = wanted;
+        }
+      block = (sorted_block_t *)pool->remainder_block_head;
+      pool->remainder_block_head
+          = get_pointer_by_offset_in_bytes (block, region_size);
+    }
+  else
+    {
+      _remove_free_sorted_block (pool, block);
+      region_size = block_get_size (&block->head) + block_payload_offset;
+    }
+
+  uint32_t count
+      = region_size / aligned_size > n ? n : region_size / aligned_size;
+  if (count == 0)
+    {
+      return 0;
+    }
+
+  uint64_t leftover = region_size - (uint64_t)count * aligned_size;
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      block->head = 0;
+      block_set_size (&block->head, aligned_size - block_payload_offset);
+      block_set_A_flag (&block->head, true);
+      block_set_P_flag (&block->head, true);
+      out[i] = &block->payload;
+      if (i + 1 < count)
+        {
+          block = get_block_by_offset (block, aligned_size);
+        }
+    }
+
+  if (leftover >= SORTED_BIN_MIN_SIZE)
+    {
+      sorted_block_t *tail = get_block_by_offset (block, aligned_size);
+      tail->head = 0;
+      block_set_size (&tail->head, leftover - block_payload_offset);
+      block_set_P_flag (&tail->head, true);
+      block_set_footer (tail);
+      _insert_free_sorted_block (pool, tail);
+      region_size -= leftover;
+    }
+  else
+    {
+      block_set_size (&block->head,
+                      aligned_size + leftover - block_payload_offset);
+      if (!from_remainder)
+        {
+          next_block_set_P_flag (block, true);
+        }
+    }
+  _pool_adjust_free_memory (pool, -(int64_t)region_size);
+
+  return count;
+}
+
+/**
+ * Turn a free region, which is no longer part of the remainder, into free
+ * blocks: a sorted block when it is big enough, fast blocks otherwise.
+ * An 8-byte leftover cannot hold any block and is kept as an allocated
+ * filler head.
+ * NOTE: the region is already counted in `free_memory`.
+ **/
+static void
+_release_region_to_bins (mem_pool_t *pool, void *addr, block_size_t size)
+{
+  if (size >= SORTED_BIN_MIN_SIZE)
+    {
+      sorted_block_t *block = addr;
+      block->head = 0;
+      block_set_size (&block->head, size - block_payload_offset);
+      block_set_P_flag (&block->head, true);
+      block_set_footer (block);
+      next_block_set_P_flag (block, false);
+      _insert_free_sorted_block (pool, block);
+      return;
+    }
+
+  while (size >= sizeof (fast_block_t))
+    {
+      fast_block_t *block = addr;
+      /* never leave an 8-byte tail behind */
+      block_size_t block_size
+          = size > FAST_BIN_MAX_SIZE ? FAST_BIN_MAX_SIZE : size;
+      if (size - block_size == 8)
+        {
+          block_size -= 8;
+        }
+      block->head = 0;
+      block_set_size (&block->head, block_size - block_payload_offset);
+      block_set_P_flag (&block->head, true);
+      _fast_bin_push (pool, (block_size >> 3) - 1, block);
+      addr = get_pointer_by_offset_in_bytes (addr, block_size);
+      size -= block_size;
+    }
+
+  if (size != 0)
+    {
+      *(block_head_t *)addr = 0;
+      block_set_A_flag ((block_head_t *)addr, true);
+      block_set_P_flag ((block_head_t *)addr, true);
+      _pool_adjust_free_memory (pool, -(int64_t)size);
+    }
+}
+
+/**
+ * Give the `size` bytes at the head of the remainder, too few for a free
+ * sorted block, to the block right before them: they come back when it is
+ * freed, where the bins would keep them apart or lose them to a filler.
+ * Fails if there is no such block, or if it is a fast block they would
+ * take past FAST_BIN_MAX_SIZE or a free one.
+ * NOTE: the blocks are walked from the start of the pool.
+ **/
+static bool
+_grow_block_before_remainder (mem_pool_t *pool, block_size_t size)
+{
+  sorted_block_t *block = _pool_get_first_block (pool);
+  sorted_block_t *prev = NULL;
+
+  while (block != (sorted_block_t *)pool->remainder_block_head)
+    {
+      prev = block;
+      block = get_next_block (block);
+    }
+  if (prev == NULL)
+    {
+      return false;
+    }
+
+  block_size_t prev_size = block_get_size (&prev->head);
+  if (block_is_fast (&prev->head))
+    {
+      if (!block_is_allocated (&prev->head)
+          || prev_size + block_payload_offset + size > FAST_BIN_MAX_SIZE)
+        {
+          return false;
+        }
+      block_set_size (&prev->head, prev_size + size);
+    }
+  else if (block_is_allocated (&prev->head))
+    {
+      block_set_size (&prev->head, prev_size + size);
+    }
+  else
+    {
+      /* a free sorted block is indexed by its size */
+      _remove_free_sorted_block (pool, prev);
+      block_set_size (&prev->head, prev_size + size);
+      block_set_footer (prev);
+      _insert_free_sorted_block (pool, prev);
+      next_block_set_P_flag (prev, false);
+      pool->remainder_block_head = pool->remainder_block_end;
+      return true;
+    }
+
+  _pool_adjust_free_memory (pool, -(int64_t)size);
+  pool->remainder_block_head = pool->remainder_block_end;
+  return true;
+}
+
+/**
+ * The remainder has just grown up to `remainder_block_end`: take in a free
+ * sorted block lying there as well, then tell whatever follows that it no
+ * longer comes after a free sorted block. Free fast blocks are left in
+ * their bins, from which they cannot be picked out.
+ **/
+static void
+_extend_remainder_end (mem_pool_t *pool)
+{
+  sorted_block_t *next = pool->remainder_block_end;
+  block_head_t head = __atomic_load_n (&next->head, __ATOMIC_RELAXED);
+
+  if (!block_is_fast (&head) && !block_is_allocated (&head))
+    {
+      PRINT_ARG("%s", "Merge free block into remainder end\n");
+      _remove_free_sorted_block (pool, next);
+      pool->remainder_block_end = get_next_block (next);
+      _pool_scrub (pool, next, sorted_block_links_size (next));
+      _pool_scrub (pool,
+                   get_pointer_by_offset_in_bytes (
+                       pool->remainder_block_end,
+                       -(int64_t)sizeof (block_head_t)),
+                   sizeof (block_head_t));
+    }
+  block_update_P_flag (pool->remainder_block_end, true);
+}
+
+/**
+ * Sort a list of fast blocks by address (merge sort).
+ **/
+static fast_block_t *
+_sort_fast_blocks_by_address (fast_block_t *list)
+{
+  fast_block_t *slow = list;
+  fast_block_t *fast = NULL;
+  fast_block_t *second = NULL;
+  fast_block_t *merged = NULL;
+  fast_block_t **tail = &merged;
+
+  if (list == NULL || list->payload.next == NULL)
+    {
+      return list;
+    }
+  for (fast = list->payload.next;
+       fast != NULL && fast->payload.next != NULL;
+       fast = fast->payload.next->payload.next)
+    {
+      slow = slow->payload.next;
+    }
+  second = slow->payload.next;
+  slow->payload.next = NULL;
+
+  list = _sort_fast_blocks_by_address (list);
+  second = _sort_fast_blocks_by_address (second);
+  while (list != NULL && second != NULL)
+    {
+      fast_block_t **first = (uintptr_t)list < (uintptr_t)second ? &list
+                                                                 : &second;
+      *tail = *first;
+      tail = &(*first)->payload.next;
+      *first = (*first)->payload.next;
+    }
+  *tail = list != NULL ? list : second;
+
+  return merged;
+}
+
+/**
+ * Fast blocks never merge when they are freed, so a burst of small
+ * allocations would keep its memory in the fast bins for good. This takes
+ * every fast bin and walks the pool in address order: each run of
+ * neighbouring free blocks holding a fast block is merged and handed back
+ * to the remainder when it borders it, or to the bins otherwise.
+ * Run when an allocation finds neither a free block nor enough remainder;
+ * the caller holds the lock of a concurrent pool, whose other threads keep
+ * freeing onto the (now empty) bins meanwhile. Returns whether any memory
+ * was merged.
+ **/
+static bool
+_consolidate_fast_blocks (mem_pool_t *pool)
+{
+  fast_block_t *taken = NULL;
+  bool merged = false;
+
+  for (uint32_t offset = 0; offset < FAST_BIN_LENGTH; ++offset)
+    {
+      fast_block_t *block = _fast_bin_take_all (pool, offset);
+      while (block != NULL)
+        {
+          fast_block_t *next = block->payload.next;
+          /* as in _fast_bin_push: a stale pop may still read the link */
+          __atomic_store_n (&block->payload.next, taken, __ATOMIC_RELAXED);
+          taken = block;
+          block = next;
+        }
+    }
+  if (taken == NULL)
+    {
+      return false;
+    }
+  taken = _sort_fast_blocks_by_address (taken);
+
+  /* the blocks below the remainder, then those between it and the fence */
+  taken = _consolidate_region (pool, _pool_get_first_block (pool),
+                               (sorted_block_t *)pool->remainder_block_head,
+                               taken, &merged);
+  taken = _consolidate_region (
+      pool, pool->remainder_block_end,
+      get_pointer_by_offset_in_bytes (pool, pool->total_memory - 8), taken,
+      &merged);
+
+  PRINT_ARG("Remainder start (after consolidation): %p\n", pool->remainder_block_head);
+  PRINT_ARG("Remainder end (after consolidation):   %p\n", pool->remainder_block_end);
+
+  return merged;
+}
+
+/**
+ * Merge the runs of free blocks in [start, end) that hold one of the fast
+ * blocks in `taken`, a list sorted by address. Other free fast blocks are
+ * left alone, as in concurrent pools they may have been freed onto the bins
+ * after they were taken. Returns the blocks of `taken` past `end`.
+ **/
+static fast_block_t *
+_consolidate_region (mem_pool_t *pool, sorted_block_t *start,
+                     sorted_block_t *end, fast_block_t *taken, bool *merged)
+{
+  sorted_block_t *run = NULL;
+  uint32_t run_blocks = 0;
+  bool run_has_fast = false;
+
+  for (sorted_block_t *block = start; ; )
+    {
+      sorted_block_t *next = NULL;
+      bool is_free = false;
+
+      if (block != end)
+        {
+          block_head_t head = __atomic_load_n (&block->head, __ATOMIC_RELAXED);
+          next = get_block_by_offset (block, block_get_size (&head)
+                                                 + block_payload_offset);
+          if ((fast_block_t *)block == taken)
+            {
+              taken = taken->payload.next;
+              run_has_fast = is_free = true;
+            }
+          else
+            {
+              is_free = !block_is_fast (&head) && !block_is_allocated (&head);
+            }
+        }
+
+      if (is_free)
+        {
+          run = run == NULL ? block : run;
+          run_blocks++;
+        }
+      else
+        {
+          if (run != NULL && run_has_fast)
+            {
+              *merged = *merged || run_blocks > 1
+                        || block == (sorted_block_t *)pool->remainder_block_head
+                        || run == pool->remainder_block_end;
+              _release_free_run (pool, run, block);
+            }
+          run = NULL;
+          run_blocks = 0;
+          run_has_fast = false;
+        }
+
+      if (block == end)
+        {
+          return taken;
+        }
+      block = next;
+    }
+}
+
+/**
+ * Merge the free blocks in [run, run_end) into the remainder when they
+ * border it, into new free blocks otherwise.
+ * NOTE: the run is already counted in `free_memory`.
+ **/
+static void
+_release_free_run (mem_pool_t *pool, sorted_block_t *run,
+                   sorted_block_t *run_end)
+{
+  block_size_t size = get_offset_between_blocks (run, run_end);
+
+  /* the heads and links inside the run become payload */
+  for (sorted_block_t *block = run; block != run_end; )
+    {
+      sorted_block_t *next = get_next_block (block);
+      if (block_is_fast (&block->head))
+        {
+          _pool_scrub (pool, block, sizeof (fast_block_t));
+        }
+      else
+        {
+          _remove_free_sorted_block (pool, block);
+          _pool_scrub (pool, block, sorted_block_links_size (block));
+          _pool_scrub (pool,
+                       get_pointer_by_offset_in_bytes (
+                           next, -(int64_t)sizeof (block_head_t)),
+                       sizeof (block_head_t));
+        }
+      block = next;
+    }
+
+  if (run_end == (sorted_block_t *)pool->remainder_block_head)
+    {
+      pool->remainder_block_head = (block_head_t *)run;
+      return;
+    }
+  if (run == pool->remainder_block_end)
+    {
+      pool->remainder_block_end = run_end;
+    }
+  else
+    {
+      _release_region_to_bins (pool, run, size);
+      if (size >= SORTED_BIN_MIN_SIZE)
+        {
+          return; /* a free sorted block, which cleared the next P flag */
+        }
+    }
+  /* whatever follows no longer comes after a free sorted block */
+  block_update_P_flag (run_end, true);
+}
+
+/**
+ * Shrink an allocated sorted block to `aligned_size` (head + payload).
+ * The tail goes back to the remainder when it borders it; otherwise it is
+ * split off and freed, as long as it is big enough to be a sorted block or
+ * is about to be merged into a free one.
+ **/
+static void
+_shrink_sorted_block (mem_pool_t *pool, sorted_block_t *block, block_size_t aligned_size)
+{
+  block_size_t leftover = block_get_size (&block->head) + block_payload_offset
+                      - aligned_size;
+  sorted_block_t *next = get_next_block (block);
+
+  if (leftover == 0)
+    {
+      return;
+    }
+
+  if (next == (sorted_block_t *)pool->remainder_block_head)
+    {
+      block_set_size (&block->head, aligned_size - block_payload_offset);
+      pool->remainder_block_head
+          = (block_head_t *)get_block_by_offset (block, aligned_size);
+      _pool_scrub (pool, pool->remainder_block_head, leftover);
+      _pool_adjust_free_memory (pool, leftover);
+      return;
+    }
+
+  if (leftover >= SORTED_BIN_MIN_SIZE
+      || (!block_is_fast (&next->head) && !block_is_allocated (&next->head)))
+    {
+      sorted_block_t *tail = _split_into_two_sorted_blocks (block, aligned_size);
+      block_set_A_flag (&tail->head, true);
+      block_set_P_flag (&tail->head, true);
+      deep_free_sorted_bins (pool, tail);
+    }
+}
+
+/**
+ * Try to grow an allocated sorted block to `aligned_size` (head + payload)
+ * without moving it, by taking space from the remainder or from the free
+ * sorted block right after it.
+ **/
+static bool
+_grow_sorted_block_in_place (mem_pool_t *pool, sorted_block_t *block, block_size_t aligned_size)
+{
+  block_size_t old_size = block_get_size (&block->head) + block_payload_offset;
+  sorted_block_t *next = get_next_block (block);
+
+  if (next == (sorted_block_t *)pool->remainder_block_head)
+    {
+      if (aligned_size - old_size > get_remainder_size (pool))
+        {
+          return false;
+        }
+      pool->remainder_block_head
+          = (block_head_t *)get_block_by_offset (block, aligned_size);
+      block_set_size (&block->head, aligned_size - block_payload_offset);
+      _pool_adjust_free_memory (pool, -(int64_t)(aligned_size - old_size));
+      return true;
+    }
+
+  if (block_is_fast (&next->head) || block_is_allocated (&next->head))
+    {
+      return false;
+    }
+
+  block_size_t next_size = block_get_size (&next->head) + block_payload_offset;
+  if (old_size + next_size < aligned_size)
+    {
+      return false;
+    }
+
+  _remove_free_sorted_block (pool, next);
+  block_set_size (&block->head, old_size + next_size - block_payload_offset);
+  if (old_size + next_size - aligned_size >= SORTED_BIN_MIN_SIZE)
+    {
+      sorted_block_t *tail = _split_into_two_sorted_blocks (block, aligned_size);
+      block_set_P_flag (&tail->head, true);
+      block_set_footer (tail);
+      _insert_free_sorted_block (pool, tail);
+      _pool_adjust_free_memory (pool, -(int64_t)(aligned_size - old_size));
+    }
+  else
+    {
+      next_block_set_P_flag (block, true);
+      _pool_adjust_free_memory (pool, -(int64_t)next_size);
+    }
+
+  return true;
+}
+
+/** Obtain a most apporiate free sorted block if possible.
+ *
+ * - Obtain a big enough one from the skiplist (smallest) or TLSF (good fit).
+ * - If it is at least (`aligned_size + SORTED_BIN_MIN_SIZE`) big, split it
+ *   into two sorted blocks
+ *   - returns the part with exactly same size
+ *   - insert the rest back as a free sorted block
+ * - NULL
+ *
+ * NOTE: The obtained block will be **removed** from the index.
+ **/
+static sorted_block_t *
+_allocate_sorted_block (mem_pool_t *pool, block_size_t aligned_size)
+{
+  sorted_block_t *ret = NULL;
+
+  if ((ret = _find_free_sorted_block (pool,
+                                      aligned_size - block_payload_offset))
+      == NULL)
+    {
+      return NULL;
+    }
+  _remove_free_sorted_block (pool, ret);
+  if (block_get_size (&ret->head) + block_payload_offset
+      >= aligned_size + SORTED_BIN_MIN_SIZE)
+    {
+      sorted_block_t *remainder = _split_into_two_sorted_blocks (ret, aligned_size);
+      block_set_P_flag (&remainder->head, true);
+      block_set_footer (remainder);
+      _insert_free_sorted_block (pool, remainder);
+    }
+
+  return ret;
+}
+
+/**
+ * Free sorted blocks are indexed by either the skiplist or TLSF, as picked
+ * at init; these dispatch to the one in use.
+ **/
+static sorted_block_t *
+_find_free_sorted_block (mem_pool_t *pool, block_size_t size)
+{
+  if (_pool_uses_tlsf (pool))
+    {
+      return _tlsf_find_block (pool, size);
+    }
+  if (pool->sorted_block.addr == NULL)
+    {
+      return NULL;
+    }
+  return _find_sorted_block_by_size (pool->sorted_block.addr, size);
+}
+
+/* floor (log2 (size)), for size > 0 */
+static inline uint32_t
+_size_log2 (block_size_t size)
+{
+  return 63 - __builtin_clzll (size);
+}
+
+static inline uint32_t
+_histogram_bucket (sorted_block_t const *block)
+{
+  return _size_log2 (block_get_size (&block->head) + block_payload_offset);
+}
+
+static void
+_insert_free_sorted_block (mem_pool_t *pool, sorted_block_t *block)
+{
+  pool->sorted_block_count++;
+  pool->sorted_block_histogram[_histogram_bucket (block)]++;
+  if (_pool_uses_tlsf (pool))
+    {
+      _tlsf_insert_block (pool, block);
+    }
+  else
+    {
+      _insert_sorted_block_to_skiplist (pool, block);
+    }
+}
+
+static void
+_remove_free_sorted_block (mem_pool_t *pool, sorted_block_t *block)
+{
+  pool->sorted_block_count--;
+  pool->sorted_block_histogram[_histogram_bucket (block)]--;
+  if (_pool_uses_tlsf (pool))
+    {
+      _tlsf_remove_block (pool, block);
+    }
+  else
+    {
+      _remove_sorted_block_from_skiplist (pool, block);
+    }
+}
+
+static inline bool
+_sorted_block_is_in_skiplist (sorted_block_t *block)
 {
   return (block->payload.info.pred_offset != 0 || block->payload.info.level_of_indices != 0);
 }
 
 /**
- *  returns a block with desired size on the list of given index level;
- * if not possible, the greatest one that is smaller than desired.
+ *  returns the last node on the list of given index level, starting from
+ * `node`, whose size is strictly smaller than desired.
+ *
+ * NOTE:
+ *   - there will always be an infimum due to the existence of head
+ *   - this function will not check nodes on other index level
+ *   - `node` itself must be smaller than desired and be on this index level
+ **/
+static sorted_block_t *
+_find_sorted_block_by_size_on_index (sorted_block_t *node, block_size_t size,
+                                     uint32_t index_level)
+{
+  sorted_block_t *curr = node;
+
+  while (curr->payload.info.offsets[index_level] != 0)
+    {
+      sorted_block_t *next
+          = get_block_by_offset (curr, curr->payload.info.offsets[index_level]);
+      if (block_get_size (&next->head) >= size)
+        {
+          break;
+        }
+      curr = next; /* curr is the candidate of infimum. */
+    }
+
+  return curr;
+}
+
+/**
+ *  returns a block with desired size; if not possible, the least greater one
+ *
+ * NOTE:
+ *   - returns NULL when supremum is not in the list
+ **/
+static sorted_block_t *
+_find_sorted_block_by_size (sorted_block_t *node, block_size_t size)
+{
+
+  sorted_block_t *curr = node;
+
+  /* indices should only exists on first node in each sub-list. */
+  while (curr->payload.info.pred_offset != 0)
+    {
+      curr = get_block_by_offset (curr, curr->payload.info.pred_offset);
+    }
+
+  if (block_get_size (&curr->head) < size)
+    {
+      /* descend from the highest index of curr to the biggest smaller one */
+      for (uint32_t index_level = curr->payload.info.level_of_indices;
+           index_level-- > 0;)
+        {
+          curr = _find_sorted_block_by_size_on_index (curr, size, index_level);
+        }
+
+      /* all nodes are smaller than required. */
+      if (curr->payload.info.offsets[0] == 0)
+        {
+          return NULL;
+        }
+      curr = get_block_by_offset (curr, curr->payload.info.offsets[0]);
+    }
+
+  /* return a node with no indices to avoid copying indices. */
+  if (curr->payload.info.succ_offset != 0)
+    {
+      curr = get_block_by_offset (curr, curr->payload.info.succ_offset);
+    }
+
+  return curr;
+}
+
+/**
+ * Collect the biggest node smaller than `size` on every index level.
+ **/
+static void
+_find_sorted_block_predecessors (mem_pool_t *pool, block_size_t size, sorted_block_t **preds)
+{
+  sorted_block_t *curr = pool->sorted_block.addr;
+
+  for (uint32_t index_level = SORTED_BLOCK_INDICES_LEVEL; index_level-- > 0;)
+    {
+      curr = _find_sorted_block_by_size_on_index (curr, size, index_level);
+      preds[index_level] = curr;
+    }
+}
+
+static void
+_insert_sorted_block_to_skiplist (mem_pool_t *pool, sorted_block_t *block)
+{
+  block_size_t size = block_get_size (&block->head);
+  sorted_block_t *preds[SORTED_BLOCK_INDICES_LEVEL];
+  sorted_block_t *pos = NULL;
+
+  _find_sorted_block_predecessors (pool, size, preds);
+  pos = preds[0];
+  if (pos->payload.info.offsets[0] != 0)
+    {
+      pos = get_block_by_offset (pos, pos->payload.info.offsets[0]);
+    }
+
+  /* insert into the chain with same size, right after its first node. */
+  if (block_get_size (&pos->head) == size && pos != pool->sorted_block.addr)
+    {
+      block->payload.info.level_of_indices = 0;
+      block->payload.info.pred_offset = get_offset_between_blocks (block, pos);
+      if (pos->payload.info.succ_offset != 0)
+        {
+          sorted_block_t *succ
+              = get_block_by_offset (pos, pos->payload.info.succ_offset);
+          block->payload.info.succ_offset
+              = get_offset_between_blocks (block, succ);
+          succ->payload.info.pred_offset
+              = get_offset_between_blocks (succ, block);
+        }
+      else
+        {
+          block->payload.info.succ_offset = 0; /* end of chain */
+        }
+      pos->payload.info.succ_offset = get_offset_between_blocks (pos, block);
+      pool->tower_heights[0]++;
+
+      return;
+    }
+
+  block->payload.info.pred_offset = 0;
+  block->payload.info.succ_offset = 0;
+  /* geometric: every SORTED_BLOCK_LEVEL_SHIFT more trailing zeros reach
+   * one level higher; the high half is used, the low bits of xoroshiro128+
+   * being its weakest */
+  block->payload.info.level_of_indices
+      = __builtin_ctz ((uint32_t)(next_r (pool->level_random) >> 32)
+                       | 1u << SORTED_BLOCK_LEVEL_SHIFT
+                                   * (SORTED_BLOCK_INDICES_LEVEL - 1))
+            / SORTED_BLOCK_LEVEL_SHIFT
+        + 1;
+  /* the tower must end before the footer */
+  if (block->payload.info.level_of_indices
+      > sorted_block_max_level (size + block_payload_offset))
+    {
+      block->payload.info.level_of_indices
+          = sorted_block_max_level (size + block_payload_offset);
+    }
+  pool->tower_heights[block->payload.info.level_of_indices]++;
+
+  for (uint32_t index_level = 0;
+       index_level < block->payload.info.level_of_indices; ++index_level)
+    {
+      pos = preds[index_level];
+      if (pos->payload.info.offsets[index_level] != 0)
+        {
+          block->payload.info.offsets[index_level]
+              = pos->payload.info.offsets[index_level]
+                - get_offset_between_blocks (pos, block);
+        }
+      else
+        {
+          block->payload.info.offsets[index_level] = 0;
+        }
+      pos->payload.info.offsets[index_level] = get_offset_between_blocks (pos, block);
+    }
+}
+
+/**
+ * Remove the node and update all indices / offsets.
+ *
+ * When the node carries indices and has children in the chain, the first
+ * child takes over its indices.
+ **/
+static void _remove_sorted_block_from_skiplist (mem_pool_t *pool, sorted_block_t *block)
+{
+  sorted_block_t *preds[SORTED_BLOCK_INDICES_LEVEL];
+  sorted_block_t *succ = NULL;
+  block_size_t size = block_get_size (&block->head);
+
+  /* a child in the chain */
+  if (block->payload.info.pred_offset != 0)
+    {
+      sorted_block_t *pred
+          = get_block_by_offset (block, block->payload.info.pred_offset);
+      if (block->payload.info.succ_offset != 0)
+        {
+          pred->payload.info.succ_offset += block->payload.info.succ_offset;
+          get_block_by_offset (block, block->payload.info.succ_offset)->payload.info.pred_offset
+              += block->payload.info.pred_offset;
+        }
+      else
+        {
+          pred->payload.info.succ_offset = 0;
+        }
+      block->payload.info.pred_offset = 0;
+      block->payload.info.succ_offset = 0;
+      pool->tower_heights[0]--;
+
+      return;
+    }
+
+  if (block->payload.info.level_of_indices == 0)
+    {
+      return; /* not in the skiplist */
+    }
+
+  _find_sorted_block_predecessors (pool, size, preds);
+  /* the tower lives on in the first child, if any, which leaves the chain */
+  pool->tower_heights[block->payload.info.succ_offset != 0
+                          ? 0
+                          : block->payload.info.level_of_indices]--;
+  if (block->payload.info.succ_offset != 0)
+    {
+      /* the first child inherits the indices */
+      succ = get_block_by_offset (block, block->payload.info.succ_offset);
+      succ->payload.info.pred_offset = 0;
+      succ->payload.info.level_of_indices = block->payload.info.level_of_indices;
+    }
+
+  for (uint32_t index_level = 0;
+       index_level < block->payload.info.level_of_indices; ++index_level)
+    {
+      sorted_block_t *prev = preds[index_level];
+      if (succ != NULL)
+        {
+          if (block->payload.info.offsets[index_level] != 0)
+            {
+              succ->payload.info.offsets[index_level]
+                  = block->payload.info.offsets[index_level]
+                    - get_offset_between_blocks (block, succ);
+            }
+          else
+            {
+              succ->payload.info.offsets[index_level] = 0;
+            }
+          prev->payload.info.offsets[index_level]
+              = get_offset_between_blocks (prev, succ);
+        }
+      else if (block->payload.info.offsets[index_level] != 0)
+        {
+          prev->payload.info.offsets[index_level] += block->payload.info.offsets[index_level];
+        }
+      else
+        {
+          prev->payload.info.offsets[index_level] = 0;
+        }
+    }
+
+  block->payload.info.level_of_indices = 0;
+  block->payload.info.succ_offset = 0;
+}
+
+/**
+ * Map a payload size to its first-level (power of two) and second-level
+ * (linear subdivision) class.
+ **/
+static inline void
+_tlsf_mapping_insert (block_size_t size, uint32_t *fl, uint32_t *sl)
+{
+  if (size < TLSF_SMALL_BLOCK_SIZE)
+    {
+      *fl = 0;
+      *sl = size / (TLSF_SMALL_BLOCK_SIZE / TLSF_SL_INDEX_COUNT);
+    }
+  else
+    {
+      uint32_t bit = _size_log2 (size);
+      *sl = (size >> (bit - TLSF_SL_INDEX_COUNT_LOG2))
+            ^ (1 << TLSF_SL_INDEX_COUNT_LOG2);
+      *fl = bit - (TLSF_FL_INDEX_SHIFT - 1);
+    }
+}
+
+static inline sorted_block_t *
+_tlsf_get_block (mem_pool_t *pool, block_size_t offset)
+{
+  return offset == 0 ? NULL : get_pointer_by_offset_in_bytes (pool, offset);
+}
+
+/**
+ *  returns a free block at least `size` big in constant time, from the
+ * first non-empty class whose every block fits (size rounded up to the next
+ * class), found with two bitmap scans.
  *
  * NOTE:
- *   - there will always be an infimum due to the existence of head
- *   - this function will not check nodes on other index level
- *   - this function will not check if there are any predecessor in the chain
- *     with same key. It assumes the `node` given has embedded all indices.
+ *   - returns NULL when no class that big has a block
  **/
 static sorted_block_t *
-_find_sorted_block_by_size_on_index (sorted_block_t *node, uint32_t size,
-                                     uint32_t index_level)
+_tlsf_find_block (mem_pool_t *pool, block_size_t size)
 {
+  tlsf_index_t *index = _pool_get_tlsf_index (pool);
+  uint32_t fl, sl, sl_map;
+  block_size_t fl_map;
 
-  sorted_block_t *curr = node;
-  sorted_block_t *prev = curr;
+  if (size >= TLSF_SMALL_BLOCK_SIZE)
+    {
+      block_size_t round
+          = ((block_size_t)1 << (_size_log2 (size) - TLSF_SL_INDEX_COUNT_LOG2))
+            - 1;
+      if (size > (block_size_t)-1 - round)
+        {
+          return NULL;
+        }
+      size += round;
+    }
+  _tlsf_mapping_insert (size, &fl, &sl);
+  if (fl >= TLSF_FL_INDEX_COUNT)
+    {
+      return NULL;
+    }
 
-  while (block_get_size (&curr->head) < size)
+  sl_map = index->sl_bitmap[fl] & (~0U << sl);
+  if (sl_map == 0)
     {
-      prev = curr; /* curr is the candidate of infimum. */
-      /* reached the end of the skiplist or the biggest smaller sorted block */
-      if (index_level >= SORTED_BLOCK_INDICES_LEVEL
-          || curr->payload.info.offsets[index_level] == 0)
+      fl_map = index->fl_bitmap & (~(block_size_t)0 << (fl + 1));
+      if (fl_map == 0)
         {
-          break;
+          return NULL;
         }
-      curr = get_block_by_offset (curr, curr->payload.info.offsets[index_level]);
+      fl = __builtin_ctzll (fl_map);
+      sl_map = index->sl_bitmap[fl];
     }
+  sl = __builtin_ctz (sl_map);
 
-  /* return a node with no indices to avoid copying indices. */
-  if (block_get_size (&curr->head) == size && curr->payload.info.succ_offset != 0)
+  return _tlsf_get_block (pool, index->blocks[fl][sl]);
+}
+
+static void
+_tlsf_insert_block (mem_pool_t *pool, sorted_block_t *block)
+{
+  tlsf_index_t *index = _pool_get_tlsf_index (pool);
+  uint32_t fl, sl;
+
+  _tlsf_mapping_insert (block_get_size (&block->head), &fl, &sl);
+  sorted_block_t *first = _tlsf_get_block (pool, index->blocks[fl][sl]);
+
+  block->payload.info.pred_offset = 0;
+  block->payload.info.level_of_indices = 0;
+  if (first != NULL)
+    {
+      block->payload.info.succ_offset = get_offset_between_blocks (block, first);
+      first->payload.info.pred_offset = get_offset_between_blocks (first, block);
+    }
+  else
+    {
+      block->payload.info.succ_offset = 0;
+    }
+  index->blocks[fl][sl] = get_offset_between_pointers_in_bytes (block, pool);
+  index->fl_bitmap |= (block_size_t)1 << fl;
+  index->sl_bitmap[fl] |= 1U << sl;
+}
+
+static void
+_tlsf_remove_block (mem_pool_t *pool, sorted_block_t *block)
+{
+  tlsf_index_t *index = _pool_get_tlsf_index (pool);
+  sorted_block_t *pred = NULL;
+  sorted_block_t *succ = NULL;
+  uint32_t fl, sl;
+
+  if (block->payload.info.pred_offset != 0)
+    {
+      pred = get_block_by_offset (block, block->payload.info.pred_offset);
+    }
+  if (block->payload.info.succ_offset != 0)
+    {
+      succ = get_block_by_offset (block, block->payload.info.succ_offset);
+    }
+
+  if (succ != NULL)
+    {
+      succ->payload.info.pred_offset
+          = pred == NULL ? 0 : get_offset_between_blocks (succ, pred);
+    }
+  if (pred != NULL)
     {
-      return get_block_by_offset (curr, curr->payload.info.succ_offset);
+      pred->payload.info.succ_offset
+          = succ == NULL ? 0 : get_offset_between_blocks (pred, succ);
+    }
+  else
+    {
+      /* the first block of its class */
+      _tlsf_mapping_insert (block_get_size (&block->head), &fl, &sl);
+      index->blocks[fl][sl]
+          = succ == NULL ? 0 : get_offset_between_pointers_in_bytes (succ, pool);
+      if (succ == NULL)
+        {
+          index->sl_bitmap[fl] &= ~(1U << sl);
+          if (index->sl_bitmap[fl] == 0)
+            {
+              index->fl_bitmap &= ~((block_size_t)1 << fl);
+            }
+        }
     }
 
-  return prev;
+  block->payload.info.pred_offset = 0;
+  block->payload.info.succ_offset = 0;
 }
 
 /**
- *  returns a block with desired size; if not possible, the least greater one
- *
- * NOTE:
- *   - returns NULL when supremum is not in the list
+ * The biggest free sorted block: the last node of the skiplist, reached
+ * from the top level down, or the biggest one in the highest non-empty
+ * TLSF class.
  **/
 static sorted_block_t *
-_find_sorted_block_by_size (sorted_block_t *node, uint32_t size)
+_find_largest_sorted_block (mem_pool_t *pool)
 {
+  sorted_block_t *ret = NULL;
 
-  sorted_block_t *curr = node;
-
-  /* indices should only exists on first node in each sub-list. */
-  while (curr->payload.info.pred_offset != 0)
+  if (_pool_uses_tlsf (pool))
     {
-      curr = get_block_by_offset (curr, curr->payload.info.pred_offset);
+      tlsf_index_t *index = _pool_get_tlsf_index (pool);
+      if (index->fl_bitmap == 0)
+        {
+          return NULL;
+        }
+      uint32_t fl = _size_log2 (index->fl_bitmap);
+      uint32_t sl = 31 - __builtin_clz (index->sl_bitmap[fl]);
+      for (sorted_block_t *block = _tlsf_get_block (pool, index->blocks[fl][sl]);
+           block != NULL;
+           block = block->payload.info.succ_offset == 0
+                       ? NULL
+                       : get_block_by_offset (block,
+                                              block->payload.info.succ_offset))
+        {
+          if (ret == NULL
+              || block_get_size (&block->head) > block_get_size (&ret->head))
+            {
+              ret = block;
+            }
+        }
+      return ret;
     }
 
-  while (block_get_size (&curr->head) < size)
+  if ((ret = pool->sorted_block.addr) == NULL)
     {
-      uint32_t index_level
-          = SORTED_BLOCK_INDICES_LEVEL - curr->payload.info.level_of_indices;
-
-      /* skip non-existing indices, to node with size <= than desired */
-      while (index_level < SORTED_BLOCK_INDICES_LEVEL
-             || curr->payload.info.offsets[index_level] == 0
-             || (block_get_size (&get_block_by_offset (curr, curr->payload.info.offsets[index_level])->head) > size))
+      return NULL;
+    }
+  for (uint32_t level = SORTED_BLOCK_INDICES_LEVEL; level-- > 0;)
+    {
+      while (ret->payload.info.offsets[level] != 0)
         {
-          index_level++;
+          ret = get_block_by_offset (ret, ret->payload.info.offsets[level]);
         }
+    }
+
+  return ret == pool->sorted_block.addr ? NULL : ret;
+}
+
+/**
+ * Allocate from the first arena with room, in _pool_next_arena order, and
+ * from a new one when none has; `alignment` is 0 for a plain malloc.
+ * Blocks reaching mmap_threshold are mapped by `pool` itself.
+ **/
+static void *
+_arenas_alloc (mem_pool_t *pool, uint32_t alignment, block_size_t size)
+{
+  mem_pool_t *arena = NULL;
+  void *ret = NULL;
 
-      /* reached the end of the skiplist or the biggest smaller sorted block */
-      if (index_level >= SORTED_BLOCK_INDICES_LEVEL
-          || curr->payload.info.offsets[index_level] == 0)
+  if (alignment == 0 && _pool_maps (pool, size))
+    {
+      return _pool_malloc (pool, size);
+    }
+  for (arena = _pool_next_arena (pool, NULL); arena != NULL;
+       arena = _pool_next_arena (pool, arena))
+    {
+      ret = alignment == 0 ? _pool_malloc (arena, size)
+                           : _pool_aligned_alloc (arena, alignment, size);
+      if (ret != NULL)
         {
-          break;
+          return ret;
         }
+    }
 
-      /* will not be NULL as curr's size is smaller than size */
-      curr = _find_sorted_block_by_size_on_index (curr, size, index_level);
+  if (pool->region_provider.acquire == NULL
+      || size > POOL_MAX_SIZE - ALIGNED_ALLOC_MAX_ALIGNMENT
+                    - 2 * SORTED_BIN_MIN_SIZE)
+    {
+      return NULL;
     }
+  block_size_t aligned_size = ALIGN_MEM_SIZE(size + block_payload_offset);
+  if (aligned_size < SORTED_BIN_MIN_SIZE)
+    {
+      aligned_size = SORTED_BIN_MIN_SIZE;
+    }
+  if (alignment != 0)
+    {
+      /* what _pool_aligned_alloc asks for */
+      aligned_size += alignment + SORTED_BIN_MIN_SIZE;
+    }
+  if ((arena = _pool_add_arena (pool, aligned_size)) == NULL)
+    {
+      return NULL;
+    }
+  return alignment == 0 ? _pool_malloc (arena, size)
+                        : _pool_aligned_alloc (arena, alignment, size);
+}
 
-  /* all nodes are smaller than required. */
-  if (block_get_size (&curr->head) < size)
+/**
+ * Resize within the block's own arena when possible, otherwise move the
+ * block to wherever _arenas_alloc finds room.
+ **/
+static void *
+_arenas_realloc (mem_pool_t *pool, void *ptr, block_size_t size)
+{
+  mem_pool_t *arena = NULL;
+  void *ret = NULL;
+
+  if (pool->arenas == NULL && pool->region_provider.acquire == NULL)
+    {
+      return _pool_realloc (pool, ptr, size);
+    }
+  if (ptr == NULL)
     {
+      return _arenas_alloc (pool, 0, size);
+    }
+  if (size == 0)
+    {
+      _arenas_free (pool, ptr);
       return NULL;
     }
 
-  /* return a node with no indices to avoid copying indices. */
-  if (curr->payload.info.succ_offset != 0)
+  block_head_t head = block_load_head_of_payload (ptr);
+  if (!block_is_allocated (&head))
     {
-      curr = get_block_by_offset (curr, curr->payload.info.succ_offset);
+      return NULL;
+    }
+  arena = _pool_find_arena (pool, ptr);
+  /* blocks reaching mmap_threshold leave the extra arenas, which map none */
+  if ((arena == pool || !_pool_maps (pool, size))
+      && (ret = _pool_realloc (arena, ptr, size)) != NULL)
+    {
+      return ret;
+    }
+  if ((ret = _arenas_alloc (pool, 0, size)) != NULL)
+    {
+      PRINT_ARG("%s", "Realloc moved to another arena\n");
+      block_size_t payload_size = block_get_size (&head);
+      memcpy (ret, ptr, payload_size < size ? payload_size : size);
+      _arenas_free (pool, ptr);
     }
 
-  return curr;
+  return ret;
 }
 
+/**
+ * Free a block of any arena, releasing its arena to the region provider
+ * once nothing in it is allocated.
+ **/
 static void
-_insert_sorted_block_to_skiplist (sorted_block_t *block)
+_arenas_free (mem_pool_t *pool, void *ptr)
 {
-  block_size_t size = block_get_size (&block->head);
-  sorted_block_t *pos
-      = _find_sorted_block_by_size (pool->sorted_block.addr, size);
+  mem_pool_t *arena = ptr == NULL ? pool : _pool_find_arena (pool, ptr);
 
-  /* insert into the chain with same size. */
-  if (pos != NULL && block_get_size (&pos->head) == size)
+  _pool_free (arena, ptr);
+  if (arena != pool && pool->region_provider.release != NULL
+      && _pool_is_empty (arena))
     {
-      block->payload.info.pred_offset = get_offset_between_blocks (block, pos);
-      if (pos->payload.info.succ_offset != 0)
-        {
-          block->payload.info.succ_offset
-              = pos->payload.info.succ_offset - get_offset_between_blocks (pos, block);
-        }
-      else
+      _pool_release_arena (pool, arena);
+    }
+}
+
+/**
+ * _malloc_batch over the arenas in _pool_next_arena order, then in a new
+ * arena for whatever is still missing.
+ **/
+static uint32_t
+_arenas_malloc_batch (mem_pool_t *pool, block_size_t aligned_size,
+                      uint32_t n, void **out)
+{
+  mem_pool_t *arena = NULL;
+  block_size_t missing = 0;
+  uint32_t count = 0;
+
+  for (arena = _pool_next_arena (pool, NULL); arena != NULL && count < n;
+       arena = _pool_next_arena (pool, arena))
+    {
+      count += _malloc_batch (arena, aligned_size, n - count, out + count);
+      if (count < n && _consolidate_fast_blocks (arena))
         {
-          block->payload.info.succ_offset = 0; /* end of chain */
+          count += _malloc_batch (arena, aligned_size, n - count,
+                                  out + count);
         }
-      pos->payload.info.succ_offset = get_offset_between_blocks (pos, block);
+    }
 
-      return;
+  if (count < n && pool->region_provider.acquire != NULL
+      && !__builtin_mul_overflow ((block_size_t)(n - count), aligned_size,
+                                  &missing)
+      && (arena = _pool_add_arena (pool, missing)) != NULL)
+    {
+      count += _malloc_batch (arena, aligned_size, n - count, out + count);
     }
 
-  block->payload.info.level_of_indices
-      = ((uint32_t) (next () >> 32)) % SORTED_BLOCK_INDICES_LEVEL + 1;
+  return count;
+}
 
-  for (uint32_t index_level
-       = SORTED_BLOCK_INDICES_LEVEL - block->payload.info.level_of_indices;
-       index_level < SORTED_BLOCK_INDICES_LEVEL; ++index_level)
+/**
+ * Ask the region provider for a region with room for a `size`-byte block,
+ * and set it up as the newest extra arena: a pool of its own, with the
+ * engine and zero policy of `pool`.
+ **/
+static mem_pool_t *
+_pool_add_arena (mem_pool_t *pool, block_size_t size)
+{
+  /* header, index and fence */
+  block_size_t overhead
+      = get_offset_between_pointers_in_bytes (_pool_get_first_block (pool),
+                                              pool)
+        + 8;
+  mem_pool_config_t config = {
+    .engine = _pool_uses_tlsf (pool) ? MEM_ENGINE_TLSF : MEM_ENGINE_SKIPLIST,
+    .zero = (pool->flags & POOL_FLAG_ZERO_ON_ALLOC) ? MEM_ZERO_ON_ALLOC
+            : (pool->flags & POOL_FLAG_ZERO_ON_FREE) ? MEM_ZERO_ON_FREE
+                                                     : MEM_ZERO_NONE,
+    .seed = next_r (pool->level_random),
+  };
+  mem_pool_t *arena = NULL;
+  void *region = NULL;
+
+  if (size > POOL_MAX_SIZE - overhead)
     {
-      pos = _find_sorted_block_by_size_on_index (pool->sorted_block.addr, size,
-                                                 index_level);
-      if (pos->payload.info.offsets[index_level] != 0)
-        {
-          block->payload.info.offsets[index_level]
-              = pos->payload.info.offsets[index_level]
-                - get_offset_between_blocks (pos, block);
-        }
-      else
+      return NULL;
+    }
+  size += overhead;
+  if ((region = pool->region_provider.acquire (pool->region_provider.context,
+                                               &size))
+      == NULL)
+    {
+      return NULL;
+    }
+  /* a bigger region than a pool can span is only partly used */
+  if ((arena = deep_pool_init_with_config (
+           region, size < POOL_MAX_SIZE ? size : POOL_MAX_SIZE, &config))
+      == NULL)
+    {
+      if (pool->region_provider.release != NULL)
         {
-          block->payload.info.offsets[index_level] = 0;
+          pool->region_provider.release (pool->region_provider.context,
+                                         region, size);
         }
-      pos->payload.info.offsets[index_level] = get_offset_between_blocks (pos, block);
+      return NULL;
+    }
+  PRINT_ARG("New arena of %llu bytes\n", (unsigned long long)size);
+
+  arena->region_size = size;
+  arena->next_arena = pool->arenas;
+  pool->arenas = arena;
+  pool->arena_count++;
+
+  return arena;
+}
+
+static void
+_pool_release_arena (mem_pool_t *pool, mem_pool_t *arena)
+{
+  mem_pool_t **link = &pool->arenas;
+
+  while (*link != arena)
+    {
+      link = &(*link)->next_arena;
+    }
+  *link = arena->next_arena;
+  pool->arena_count--;
+  PRINT_ARG("Released an arena of %llu bytes\n",
+            (unsigned long long)arena->region_size);
+
+  if (pool->region_provider.release != NULL)
+    {
+      pool->region_provider.release (pool->region_provider.context, arena,
+                                     arena->region_size);
     }
 }
 
 /**
- * Remove the node and update all indices / offsets.
- * May traverse the list multiple times
- *
- * NOTE: never removes a node with offsets when it has children in the chain
+ * The length of a mapping holding a `size`-byte payload, rounded up to
+ * whole pages; 0 if the payload size could not be kept in a head.
  **/
-static void _remove_sorted_block_from_skiplist (sorted_block_t *block)
+static mem_size_t
+_mapping_length (block_size_t size)
 {
+  mem_size_t page = sysconf (_SC_PAGESIZE);
 
-  /* considering a node which is not in the skiplist */
-  sorted_block_t *prev = NULL;
-  block_size_t size = block_get_size (&block->head);
+  if (size > BLOCK_SIZE_MASK - mapped_payload_offset - page)
+    {
+      return 0;
+    }
+  return ((mem_size_t)size + mapped_payload_offset + page - 1) & ~(page - 1);
+}
+
+static void *
+_malloc_mapped (mem_pool_t *pool, block_size_t size)
+{
+  mem_size_t length = _mapping_length (size);
+  mapped_block_t *block = NULL;
 
-  for (uint32_t index_level
-       = SORTED_BLOCK_INDICES_LEVEL - block->payload.info.level_of_indices;
-       index_level < SORTED_BLOCK_INDICES_LEVEL; ++index_level)
+  if (length == 0
+      || (block = mmap (NULL, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+             == MAP_FAILED)
     {
-      /* -1 to find the strictly smaller node. */
-      prev = _find_sorted_block_by_size_on_index (pool->sorted_block.addr,
-                                                  size - 1, index_level);
-      if (block->payload.info.offsets[index_level] != 0)
-        {
-          prev->payload.info.offsets[index_level] += block->payload.info.offsets[index_level];
-        }
-      else
-        {
-          prev->payload.info.offsets[index_level] = 0;
-        }
+      return NULL;
     }
+  PRINT_ARG("Mapped a block of %llu bytes\n", (unsigned long long)length);
 
-  if (block->payload.info.pred_offset != 0)
+  block->length = length;
+  block->head = (length - mapped_payload_offset) | A_FLAG_MASK | M_FLAG_MASK;
+  block->prev = NULL;
+  block->next = pool->mapped_blocks;
+  if (block->next != NULL)
     {
-      if (block->payload.info.succ_offset != 0)
-        {
-          get_block_by_offset (block, block->payload.info.pred_offset)->payload.info.succ_offset
-              += block->payload.info.succ_offset;
-          get_block_by_offset (block, block->payload.info.succ_offset)->payload.info.pred_offset
-              += block->payload.info.pred_offset;
-        }
-      else
+      block->next->prev = block;
+    }
+  pool->mapped_blocks = block;
+  pool->mapped_block_count++;
+  pool->mapped_bytes += length;
+
+  return &block->payload;
+}
+
+/**
+ * A mapped block below mmap_threshold moves back into the pool; otherwise
+ * mremap grows or shrinks it, moving its pages rather than its bytes.
+ **/
+static void *
+_realloc_mapped (mem_pool_t *pool, mapped_block_t *block, block_size_t size)
+{
+  mem_size_t length = 0;
+  mapped_block_t *moved = NULL;
+  void *ret = NULL;
+
+  if (!_pool_maps (pool, size))
+    {
+      /* the mapped payload is at least mmap_threshold, i.e. over `size` */
+      if ((ret = _pool_malloc (pool, size)) != NULL)
         {
-          get_block_by_offset (block, block->payload.info.pred_offset)->payload.info.succ_offset = 0;
+          PRINT_ARG("%s", "Realloc moved into the pool\n");
+          memcpy (ret, &block->payload, size);
+          _free_mapped (pool, block);
         }
+      return ret;
+    }
+  if ((length = _mapping_length (size)) == 0)
+    {
+      return NULL;
+    }
+  if (length == block->length)
+    {
+      return &block->payload;
+    }
+
+#ifdef MREMAP_MAYMOVE
+  if ((moved = mremap (block, block->length, length, MREMAP_MAYMOVE))
+      == MAP_FAILED)
+    {
+      return NULL;
+    }
+#else
+  /* no mremap: copy into a new mapping */
+  if ((ret = _malloc_mapped (pool, size)) != NULL)
+    {
+      memcpy (ret, &block->payload,
+              block->length < length ? block->length - mapped_payload_offset
+                                     : size);
+      _free_mapped (pool, block);
+    }
+  return ret;
+#endif
+  PRINT_ARG("Remapped a block to %llu bytes\n", (unsigned long long)length);
+
+  /* the neighbours in the list still point at the old address */
+  if (moved->prev != NULL)
+    {
+      moved->prev->next = moved;
+    }
+  else
+    {
+      pool->mapped_blocks = moved;
+    }
+  if (moved->next != NULL)
+    {
+      moved->next->prev = moved;
     }
-  /* no other cases, as if it is the first node, it should be the only node. */
+  pool->mapped_bytes += length - moved->length;
+  moved->length = length;
+  block_set_size (&moved->head, length - mapped_payload_offset);
+
+  return &moved->payload;
 }
 
+static void
+_free_mapped (mem_pool_t *pool, mapped_block_t *block)
+{
+  if (block->prev != NULL)
+    {
+      block->prev->next = block->next;
+    }
+  else
+    {
+      pool->mapped_blocks = block->next;
+    }
+  if (block->next != NULL)
+    {
+      block->next->prev = block->prev;
+    }
+  pool->mapped_block_count--;
+  pool->mapped_bytes -= block->length;
+  PRINT_ARG("Unmapped a block of %llu bytes\n",
+            (unsigned long long)block->length);
+
+  munmap (block, block->length);
+}
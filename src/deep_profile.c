@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "random.h"
+#include "deep_profile.h"
+
+#define PROFILE_TABLE_INITIAL_LENGTH (1024)
+
+bool profile_enabled;
+uint64_t profile_live_samples;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t profile_interval;
+static uint32_t profile_epoch; /* bumped by every start */
+static profile_site_t *profile_sites;
+static profile_sample_t *profile_table;
+static uint64_t profile_table_length; /* a power of two */
+/* sampled blocks per hash bucket, read without the lock by deep_free */
+static uint32_t profile_filter[PROFILE_FILTER_LENGTH];
+
+/* bytes each thread still allocates before its next sample */
+static __thread int64_t profile_countdown;
+static __thread uint32_t profile_thread_epoch;
+static __thread uint64_t profile_random[2];
+
+static inline uint64_t
+_profile_hash (uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccd;
+  return key ^ (key >> 33);
+}
+
+static inline uint32_t *
+_profile_filter_bucket (uint64_t key)
+{
+  return &profile_filter[(_profile_hash (key) >> 20)
+                         % PROFILE_FILTER_LENGTH];
+}
+
+/* Exponentially distributed, `profile_interval` on average. */
+static int64_t
+_profile_next_distance (void)
+{
+  double u = ((next_r (profile_random) >> 11) + 1) * 0x1.0p-53;
+
+  return (int64_t)(-log (u)
+                   * __atomic_load_n (&profile_interval, __ATOMIC_RELAXED))
+         + 1;
+}
+
+/**
+ * Count `size` bytes against the calling thread; true when they reach its
+ * next sample. A thread draws its first distance once it sees profiling
+ * (re)started.
+ **/
+bool
+profile_tick (block_size_t size)
+{
+  uint32_t epoch = __atomic_load_n (&profile_epoch, __ATOMIC_ACQUIRE);
+
+  if (profile_thread_epoch != epoch)
+    {
+      seed_r (profile_random, (uintptr_t)&profile_countdown ^ epoch);
+      profile_thread_epoch = epoch;
+      profile_countdown = _profile_next_distance ();
+    }
+  if ((profile_countdown -= size) > 0)
+    {
+      return false;
+    }
+  profile_countdown = _profile_next_distance ();
+  return true;
+}
+
+/* Called with profile_lock held; the slot of `key`, or the empty slot
+ * where it would go. */
+static profile_sample_t *
+_profile_lookup (uint64_t key)
+{
+  uint64_t mask = profile_table_length - 1;
+
+  for (uint64_t i = _profile_hash (key) & mask;; i = (i + 1) & mask)
+    {
+      if (profile_table[i].key == key || profile_table[i].key == 0)
+        {
+          return &profile_table[i];
+        }
+    }
+}
+
+/* Called with profile_lock held; keeps the table at most half full. */
+static bool
+_profile_reserve (void)
+{
+  if (profile_live_samples < profile_table_length / 2)
+    {
+      return true;
+    }
+
+  uint64_t length = profile_table_length != 0 ? profile_table_length * 2
+                                               : PROFILE_TABLE_INITIAL_LENGTH;
+  profile_sample_t *table = calloc (length, sizeof (profile_sample_t));
+  profile_sample_t *old = profile_table;
+  uint64_t old_length = profile_table_length;
+  if (table == NULL)
+    {
+      return false;
+    }
+  profile_table = table;
+  profile_table_length = length;
+  for (uint64_t i = 0; i < old_length; i++)
+    {
+      if (old[i].key != 0)
+        {
+          *_profile_lookup (old[i].key) = old[i];
+        }
+    }
+  free (old);
+  return true;
+}
+
+/* Called with profile_lock held. */
+static void
+_profile_insert (profile_sample_t const *sample)
+{
+  profile_site_t *site = sample->site;
+
+  *_profile_lookup (sample->key) = *sample;
+  site->live_count += sample->count;
+  site->live_bytes += sample->bytes;
+  site->live_samples++;
+  __atomic_add_fetch (_profile_filter_bucket (sample->key), 1,
+                      __ATOMIC_RELAXED);
+  __atomic_add_fetch (&profile_live_samples, 1, __ATOMIC_RELAXED);
+}
+
+/* Called with profile_lock held; linear probing, so the slots after the
+ * hole move back rather than leaving a tombstone. */
+static void
+_profile_remove (profile_sample_t *slot)
+{
+  uint64_t mask = profile_table_length - 1;
+  uint64_t hole = slot - profile_table;
+
+  for (uint64_t i = (hole + 1) & mask; profile_table[i].key != 0;
+       i = (i + 1) & mask)
+    {
+      uint64_t home = _profile_hash (profile_table[i].key) & mask;
+      /* move it if the hole lies between its home and its slot */
+      if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+          profile_table[hole] = profile_table[i];
+          hole = i;
+        }
+    }
+  profile_table[hole].key = 0;
+}
+
+/* Called with profile_lock held. */
+static void
+_profile_release (profile_sample_t *sample)
+{
+  profile_site_t *site = sample->site;
+
+  site->live_count -= sample->count;
+  site->live_bytes -= sample->bytes;
+  site->live_samples--;
+  __atomic_sub_fetch (_profile_filter_bucket (sample->key), 1,
+                      __ATOMIC_RELAXED);
+  __atomic_sub_fetch (&profile_live_samples, 1, __ATOMIC_RELAXED);
+  _profile_remove (sample);
+}
+
+void
+profile_sample (profile_site_t *site, uint64_t key, block_size_t size)
+{
+  /* a block of `size` bytes is sampled with probability p, so it stands
+   * for 1 / p blocks */
+  double weight
+      = -1 / expm1 (-(double)size
+                    / __atomic_load_n (&profile_interval, __ATOMIC_RELAXED));
+  profile_sample_t sample = {
+    .key = key,
+    .site = site,
+    .size = size,
+    .weight = weight,
+    .count = (uint64_t)(weight + 0.5),
+    .bytes = (uint64_t)(weight * size + 0.5),
+  };
+
+  pthread_mutex_lock (&profile_lock);
+  if (_profile_reserve ())
+    {
+      profile_sample_t *stale = _profile_lookup (key);
+      if (stale->key == key)
+        {
+          /* freed behind the profiler's back, e.g. by deep_pool_free */
+          _profile_release (stale);
+        }
+      if (!site->listed)
+        {
+          site->listed = true;
+          site->next = profile_sites;
+          profile_sites = site;
+        }
+      site->alloc_count += sample.count;
+      site->alloc_bytes += sample.bytes;
+      _profile_insert (&sample);
+    }
+  pthread_mutex_unlock (&profile_lock);
+}
+
+/**
+ * The block of `key` is freed. Most blocks are not sampled, which the
+ * filter tells without the lock.
+ **/
+void
+profile_release (uint64_t key)
+{
+  if (__atomic_load_n (_profile_filter_bucket (key), __ATOMIC_RELAXED) == 0)
+    {
+      return;
+    }
+
+  pthread_mutex_lock (&profile_lock);
+  if (profile_table != NULL)
+    {
+      profile_sample_t *sample = _profile_lookup (key);
+      if (sample->key == key)
+        {
+          _profile_release (sample);
+        }
+    }
+  pthread_mutex_unlock (&profile_lock);
+}
+
+/**
+ * Take the block of `key` out of the samples ahead of a realloc, which may
+ * free it; false if it is not sampled.
+ **/
+bool
+profile_take (uint64_t key, profile_sample_t *sample)
+{
+  bool ret = false;
+
+  if (__atomic_load_n (_profile_filter_bucket (key), __ATOMIC_RELAXED) == 0)
+    {
+      return false;
+    }
+
+  pthread_mutex_lock (&profile_lock);
+  if (profile_table != NULL)
+    {
+      profile_sample_t *slot = _profile_lookup (key);
+      if (slot->key == key)
+        {
+          *sample = *slot;
+          _profile_release (slot);
+          ret = true;
+        }
+    }
+  pthread_mutex_unlock (&profile_lock);
+
+  return ret;
+}
+
+/**
+ * Put a taken sample back as the `size`-byte block of `key`, which stands
+ * for as many blocks as before. Samples taken before a restart are left
+ * out, their site no longer being listed.
+ **/
+void
+profile_put (profile_sample_t const *sample, uint64_t key, block_size_t size)
+{
+  profile_sample_t moved = *sample;
+
+  moved.key = key;
+  moved.size = size;
+  moved.bytes = (uint64_t)(moved.weight * size + 0.5);
+  pthread_mutex_lock (&profile_lock);
+  if (moved.site->listed && _profile_reserve ())
+    {
+      _profile_insert (&moved);
+    }
+  pthread_mutex_unlock (&profile_lock);
+}
+
+/* Called with profile_lock held. */
+static void
+_profile_forget (void)
+{
+  for (profile_site_t *site = profile_sites; site != NULL; site = site->next)
+    {
+      site->live_count = 0;
+      site->live_bytes = 0;
+      site->live_samples = 0;
+    }
+  free (profile_table);
+  profile_table = NULL;
+  profile_table_length = 0;
+  memset (profile_filter, 0, sizeof (profile_filter));
+  __atomic_store_n (&profile_live_samples, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * The pool is gone, and with it every sampled block; the sites keep what
+ * they allocated.
+ **/
+void
+profile_forget (void)
+{
+  pthread_mutex_lock (&profile_lock);
+  _profile_forget ();
+  pthread_mutex_unlock (&profile_lock);
+}
+
+void
+deep_mem_profile_start (block_size_t interval)
+{
+  pthread_mutex_lock (&profile_lock);
+  _profile_forget ();
+  while (profile_sites != NULL)
+    {
+      profile_site_t *site = profile_sites;
+      profile_sites = site->next;
+      site->listed = false;
+      site->next = NULL;
+      site->alloc_count = 0;
+      site->alloc_bytes = 0;
+    }
+  __atomic_store_n (&profile_interval,
+                    interval != 0 ? interval : PROFILE_DEFAULT_INTERVAL,
+                    __ATOMIC_RELAXED);
+  __atomic_add_fetch (&profile_epoch, 1, __ATOMIC_RELEASE);
+  __atomic_store_n (&profile_enabled, true, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&profile_lock);
+}
+
+void
+deep_mem_profile_stop (void)
+{
+  __atomic_store_n (&profile_enabled, false, __ATOMIC_RELEASE);
+}
+
+static int
+_profile_compare_sites (const void *a, const void *b)
+{
+  uint64_t x = ((profile_site_t const *)a)->live_bytes;
+  uint64_t y = ((profile_site_t const *)b)->live_bytes;
+
+  return x > y ? -1 : x < y;
+}
+
+uint32_t
+deep_mem_profile_sites (profile_site_t *sites, uint32_t max)
+{
+  uint32_t count = 0;
+
+  pthread_mutex_lock (&profile_lock);
+  for (profile_site_t *site = profile_sites; site != NULL; site = site->next)
+    {
+      count++;
+    }
+  profile_site_t *all = calloc (count, sizeof (profile_site_t));
+  if (all == NULL && count != 0)
+    {
+      pthread_mutex_unlock (&profile_lock);
+      return 0;
+    }
+  uint32_t i = 0;
+  for (profile_site_t *site = profile_sites; site != NULL; site = site->next)
+    {
+      all[i++] = *site;
+    }
+  pthread_mutex_unlock (&profile_lock);
+
+  qsort (all, count, sizeof (profile_site_t), _profile_compare_sites);
+  for (i = 0; i < count && i < max; i++)
+    {
+      all[i].next = NULL;
+      sites[i] = all[i];
+    }
+  free (all);
+  return count;
+}
+
+void
+deep_mem_profile_dump (FILE *out)
+{
+  uint32_t count = deep_mem_profile_sites (NULL, 0);
+  profile_site_t *sites = calloc (count, sizeof (profile_site_t));
+
+  if (sites == NULL && count != 0)
+    {
+      return;
+    }
+  /* sites listed meanwhile are left for the next dump */
+  uint32_t listed = deep_mem_profile_sites (sites, count);
+  count = listed < count ? listed : count;
+  fprintf (out, "%14s %10s %14s %10s  %s\n", "live bytes", "live", "bytes",
+           "blocks", "site");
+  for (uint32_t i = 0; i < count; i++)
+    {
+      fprintf (out, "%14llu %10llu %14llu %10llu  %s:%u, %s()\n",
+               (unsigned long long)sites[i].live_bytes,
+               (unsigned long long)sites[i].live_count,
+               (unsigned long long)sites[i].alloc_bytes,
+               (unsigned long long)sites[i].alloc_count, sites[i].file,
+               sites[i].line, sites[i].func);
+    }
+  free (sites);
+}
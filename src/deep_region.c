@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include "deep_region.h"
+
+#define REGION_CHUNK_HEADER_SIZE (ALIGN_MEM_SIZE (sizeof (region_chunk_t)))
+/* the region itself sits at the start of its first chunk */
+#define REGION_HEADER_SIZE (ALIGN_MEM_SIZE (sizeof (mem_region_t)))
+
+static inline uint8_t *
+_region_chunk_start (region_chunk_t *chunk)
+{
+  return (uint8_t *)chunk + REGION_CHUNK_HEADER_SIZE;
+}
+
+static region_chunk_t *
+_region_chunk_new (mem_pool_t *pool, block_size_t size)
+{
+  region_chunk_t *chunk;
+
+  if (size > POOL_MAX_SIZE - REGION_CHUNK_HEADER_SIZE)
+    {
+      return NULL;
+    }
+  chunk = deep_pool_malloc (pool, REGION_CHUNK_HEADER_SIZE + size);
+  if (chunk == NULL)
+    {
+      return NULL;
+    }
+  chunk->next = NULL;
+  chunk->size = size;
+
+  return chunk;
+}
+
+/* Where allocations start in `chunk`, past the region in the first one. */
+static inline uint8_t *
+_region_chunk_data (mem_region_t *region, region_chunk_t *chunk)
+{
+  return _region_chunk_start (chunk)
+         + (chunk == region->first ? REGION_HEADER_SIZE : 0);
+}
+
+static inline void
+_region_enter_chunk (mem_region_t *region, region_chunk_t *chunk)
+{
+  region->current = chunk;
+  region->top = _region_chunk_data (region, chunk);
+  region->end = _region_chunk_start (chunk) + chunk->size;
+}
+
+mem_region_t *
+deep_pool_region_begin (mem_pool_t *pool, block_size_t chunk_size)
+{
+  region_chunk_t *chunk;
+  mem_region_t *region;
+
+  if (pool == NULL)
+    {
+      return NULL;
+    }
+  chunk_size = ALIGN_MEM_SIZE (chunk_size != 0 ? chunk_size
+                                               : REGION_DEFAULT_CHUNK_SIZE);
+  if (chunk_size < REGION_HEADER_SIZE
+      || (chunk = _region_chunk_new (pool, chunk_size)) == NULL)
+    {
+      return NULL;
+    }
+
+  region = (mem_region_t *)_region_chunk_start (chunk);
+  region->pool = pool;
+  region->outer = NULL;
+  region->first = chunk;
+  region->chunk_size = chunk_size;
+  _region_enter_chunk (region, chunk);
+
+  return region;
+}
+
+/**
+ * Move on to the next chunk able to hold `size` bytes: the ones kept by a
+ * reset are reused in order, those too small for the request skipped, and
+ * a new one is put right after the current one if none fits.
+ **/
+static bool
+_region_next_chunk (mem_region_t *region, block_size_t size)
+{
+  region_chunk_t *chunk = region->current->next;
+
+  while (chunk != NULL && chunk->size < size)
+    {
+      chunk = chunk->next;
+    }
+  if (chunk == NULL)
+    {
+      chunk = _region_chunk_new (region->pool, size > region->chunk_size
+                                                   ? size
+                                                   : region->chunk_size);
+      if (chunk == NULL)
+        {
+          return false;
+        }
+      chunk->next = region->current->next;
+      region->current->next = chunk;
+    }
+  _region_enter_chunk (region, chunk);
+
+  return true;
+}
+
+void *
+deep_pool_region_alloc (mem_region_t *region, block_size_t size)
+{
+  void *ret;
+
+  if (region == NULL || size > POOL_MAX_SIZE)
+    {
+      return NULL;
+    }
+  size = ALIGN_MEM_SIZE (size);
+  if (size > (uint64_t)(region->end - region->top)
+      && !_region_next_chunk (region, size))
+    {
+      return NULL;
+    }
+
+  ret = region->top;
+  region->top += size;
+  if (region->pool->flags & POOL_FLAG_ZERO_ON_ALLOC)
+    {
+      memset (ret, 0, size);
+    }
+  return ret;
+}
+
+void
+deep_pool_region_reset (mem_region_t *region)
+{
+  if (region == NULL)
+    {
+      return;
+    }
+  if (region->pool->flags & POOL_FLAG_ZERO_ON_FREE)
+    {
+      /* the chunks before the current one were handed out at most up to
+       * their end */
+      for (region_chunk_t *chunk = region->first; chunk != region->current;
+           chunk = chunk->next)
+        {
+          uint8_t *data = _region_chunk_data (region, chunk);
+          memset (data, 0, _region_chunk_start (chunk) + chunk->size - data);
+        }
+      uint8_t *data = _region_chunk_data (region, region->current);
+      memset (data, 0, region->top - data);
+    }
+  _region_enter_chunk (region, region->first);
+}
+
+void
+deep_pool_region_end (mem_region_t *region)
+{
+  if (region == NULL)
+    {
+      return;
+    }
+
+  mem_pool_t *pool = region->pool;
+  region_chunk_t *first = region->first;
+  /* the region lives in the first chunk, freed last */
+  for (region_chunk_t *chunk = first->next; chunk != NULL;)
+    {
+      region_chunk_t *next = chunk->next;
+      deep_pool_free (pool, chunk);
+      chunk = next;
+    }
+  deep_pool_free (pool, first);
+}
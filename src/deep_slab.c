@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+#include "deep_slab.h"
+
+/* the objects of a slab start after its header */
+#define SLAB_HEADER_SIZE (ALIGN_MEM_SIZE (sizeof (slab_t)))
+/* a slab block's head sits in the 8 bytes before it, so a slab block of
+ * this many bytes ends right where the next slab's head goes */
+#define SLAB_PAYLOAD_SIZE(slab_size) ((slab_size) - 8)
+
+static inline slab_t *
+_slab_at (slab_cache_t *cache, int64_t offset)
+{
+  return offset == 0 ? NULL : (slab_t *)((uint8_t *)cache + offset);
+}
+
+static inline int64_t
+_slab_offset (slab_cache_t *cache, slab_t *slab)
+{
+  return slab == NULL ? 0 : (uint8_t *)slab - (uint8_t *)cache;
+}
+
+static inline void *
+_slab_object (slab_cache_t *cache, slab_t *slab, uint32_t index)
+{
+  return (uint8_t *)slab + SLAB_HEADER_SIZE
+         + (uint64_t)index * cache->object_size;
+}
+
+static void
+_slab_list_push (slab_cache_t *cache, int64_t *list, slab_t *slab)
+{
+  slab_t *first = _slab_at (cache, *list);
+
+  slab->prev = 0;
+  slab->next = *list;
+  if (first != NULL)
+    {
+      first->prev = _slab_offset (cache, slab);
+    }
+  *list = _slab_offset (cache, slab);
+}
+
+static void
+_slab_list_remove (slab_cache_t *cache, int64_t *list, slab_t *slab)
+{
+  slab_t *prev = _slab_at (cache, slab->prev);
+  slab_t *next = _slab_at (cache, slab->next);
+
+  if (prev != NULL)
+    {
+      prev->next = slab->next;
+    }
+  else
+    {
+      *list = slab->next;
+    }
+  if (next != NULL)
+    {
+      next->prev = slab->prev;
+    }
+}
+
+slab_cache_t *
+deep_pool_slab_create (mem_pool_t *pool, block_size_t object_size,
+                       uint32_t objects_per_slab)
+{
+  slab_cache_t *cache;
+  block_size_t slab_size = SLAB_MIN_SIZE;
+
+  /* objects stay 8-byte aligned, with room for the free-list link */
+  object_size = ALIGN_MEM_SIZE (object_size);
+  if (pool == NULL || object_size == 0
+      || object_size > SLAB_PAYLOAD_SIZE (SLAB_MAX_SIZE) - SLAB_HEADER_SIZE)
+    {
+      return NULL;
+    }
+  while (slab_size < SLAB_MAX_SIZE
+         && SLAB_PAYLOAD_SIZE (slab_size) - SLAB_HEADER_SIZE
+                < (uint64_t)object_size * objects_per_slab)
+    {
+      slab_size <<= 1;
+    }
+
+  cache = deep_pool_malloc (pool, sizeof (slab_cache_t));
+  if (cache == NULL)
+    {
+      return NULL;
+    }
+  memset (cache, 0, sizeof (slab_cache_t));
+  cache->object_size = object_size;
+  cache->slab_size = slab_size;
+  cache->objects_per_slab
+      = (SLAB_PAYLOAD_SIZE (slab_size) - SLAB_HEADER_SIZE) / object_size;
+
+  return cache;
+}
+
+static void
+_slab_list_free (mem_pool_t *pool, slab_cache_t *cache, int64_t list)
+{
+  for (slab_t *slab = _slab_at (cache, list); slab != NULL;)
+    {
+      slab_t *next = _slab_at (cache, slab->next);
+      deep_pool_free (pool, slab);
+      slab = next;
+    }
+}
+
+void
+deep_pool_slab_destroy (mem_pool_t *pool, slab_cache_t *cache)
+{
+  if (pool == NULL || cache == NULL)
+    {
+      return;
+    }
+  _slab_list_free (pool, cache, cache->partial);
+  _slab_list_free (pool, cache, cache->full);
+  deep_pool_free (pool, cache);
+}
+
+/**
+ * Carve a slab through the sorted path. Slabs carved from the remainder
+ * one after another need no leading slack, each one ending where the next
+ * one's head goes.
+ **/
+static slab_t *
+_slab_new (mem_pool_t *pool, slab_cache_t *cache)
+{
+  block_size_t slab_size = cache->slab_size;
+  slab_t *slab = deep_pool_aligned_alloc (pool, slab_size,
+                                          SLAB_PAYLOAD_SIZE (slab_size));
+
+  if (slab == NULL)
+    {
+      return NULL;
+    }
+  memset (slab, 0, sizeof (slab_t));
+  _slab_list_push (cache, &cache->partial, slab);
+  cache->slab_count++;
+
+  return slab;
+}
+
+void *
+deep_pool_slab_alloc (mem_pool_t *pool, slab_cache_t *cache)
+{
+  slab_t *slab;
+  void *ret;
+
+  if (pool == NULL || cache == NULL)
+    {
+      return NULL;
+    }
+  slab = _slab_at (cache, cache->partial);
+  if (slab == NULL && (slab = _slab_new (pool, cache)) == NULL)
+    {
+      return NULL;
+    }
+
+  if (slab->free != 0)
+    {
+      ret = _slab_object (cache, slab, slab->free - 1);
+      memcpy (&slab->free, ret, sizeof (uint32_t));
+    }
+  else
+    {
+      ret = _slab_object (cache, slab, slab->carved++);
+    }
+  if (++slab->used == cache->objects_per_slab)
+    {
+      _slab_list_remove (cache, &cache->partial, slab);
+      _slab_list_push (cache, &cache->full, slab);
+    }
+  cache->object_count++;
+
+  if (pool->flags & POOL_FLAG_ZERO_ON_ALLOC)
+    {
+      memset (ret, 0, cache->object_size);
+    }
+  return ret;
+}
+
+void
+deep_pool_slab_free (mem_pool_t *pool, slab_cache_t *cache, void *ptr)
+{
+  if (pool == NULL || cache == NULL || ptr == NULL)
+    {
+      return;
+    }
+
+  slab_t *slab
+      = (slab_t *)((uintptr_t)ptr & ~(uintptr_t)(cache->slab_size - 1));
+  uint32_t index
+      = ((uint8_t *)ptr - (uint8_t *)_slab_object (cache, slab, 0))
+        / cache->object_size;
+
+  if (pool->flags & POOL_FLAG_ZERO_ON_FREE)
+    {
+      memset (ptr, 0, cache->object_size);
+    }
+  memcpy (ptr, &slab->free, sizeof (uint32_t));
+  slab->free = index + 1;
+  if (slab->used-- == cache->objects_per_slab)
+    {
+      _slab_list_remove (cache, &cache->full, slab);
+      _slab_list_push (cache, &cache->partial, slab);
+    }
+  cache->object_count--;
+
+  /* an empty slab is kept only while no other one has room, so that a
+   * cache hovering around a slab boundary does not churn */
+  if (slab->used == 0 && (slab->prev != 0 || slab->next != 0))
+    {
+      _slab_list_remove (cache, &cache->partial, slab);
+      cache->slab_count--;
+      deep_pool_free (pool, slab);
+    }
+}
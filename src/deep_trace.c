@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "deep_trace.h"
+
+bool trace_enabled;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static trace_header_t *trace_map;
+static uint64_t trace_capacity; /* records the mapping can hold */
+static uint64_t trace_start_ns;
+static bool atexit_registered;
+
+static uint64_t
+_trace_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static size_t
+_trace_file_size (uint64_t records)
+{
+  return sizeof (trace_header_t) + records * sizeof (trace_record_t);
+}
+
+/**
+ * Grow the file and map it again with room for `records` records.
+ **/
+static bool
+_trace_map (uint64_t records)
+{
+  void *map;
+
+  if (ftruncate (trace_fd, _trace_file_size (records)) != 0)
+    {
+      return false;
+    }
+  map = mmap (NULL, _trace_file_size (records), PROT_READ | PROT_WRITE,
+              MAP_SHARED, trace_fd, 0);
+  if (map == MAP_FAILED)
+    {
+      return false;
+    }
+  if (trace_map != NULL)
+    {
+      munmap (trace_map, _trace_file_size (trace_capacity));
+    }
+  trace_map = map;
+  trace_capacity = records;
+  return true;
+}
+
+bool
+trace_open (const char *path, uint64_t pool_size)
+{
+  bool ret = false;
+
+  pthread_mutex_lock (&trace_lock);
+  if (trace_fd < 0
+      && (trace_fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0)
+    {
+      if (_trace_map (TRACE_INITIAL_RECORDS))
+        {
+          memcpy (trace_map->magic, TRACE_MAGIC, sizeof (trace_map->magic));
+          trace_map->record_size = sizeof (trace_record_t);
+          trace_map->count = 0;
+          trace_map->pool_size = pool_size;
+          trace_start_ns = _trace_now ();
+          __atomic_store_n (&trace_enabled, true, __ATOMIC_RELEASE);
+          if (!atexit_registered)
+            {
+              /* so a trace that is never closed still gets its final size */
+              atexit (trace_close);
+              atexit_registered = true;
+            }
+          ret = true;
+        }
+      else
+        {
+          close (trace_fd);
+          trace_fd = -1;
+        }
+    }
+  pthread_mutex_unlock (&trace_lock);
+
+  return ret;
+}
+
+void
+trace_close (void)
+{
+  pthread_mutex_lock (&trace_lock);
+  if (trace_fd >= 0)
+    {
+      __atomic_store_n (&trace_enabled, false, __ATOMIC_RELEASE);
+      uint64_t count = trace_map->count;
+      munmap (trace_map, _trace_file_size (trace_capacity));
+      /* drop the unused tail of the last mapping */
+      if (ftruncate (trace_fd, _trace_file_size (count)) != 0)
+        {
+          perror ("deep_mem trace");
+        }
+      close (trace_fd);
+      trace_fd = -1;
+      trace_map = NULL;
+      trace_capacity = 0;
+    }
+  pthread_mutex_unlock (&trace_lock);
+}
+
+/* Called with trace_lock held; returns false once the file cannot grow. */
+static bool
+_trace_put (uint64_t now, trace_op_t op, block_size_t size, block_size_t id,
+            block_size_t new_id, uint8_t flags)
+{
+  if (trace_map == NULL
+      || (trace_map->count == trace_capacity
+          && !_trace_map (trace_capacity * 2)))
+    {
+      return false;
+    }
+
+  trace_record_t *record
+      = (trace_record_t *)(trace_map + 1) + trace_map->count;
+  record->timestamp = now - trace_start_ns;
+  record->size = size;
+  record->id = id;
+  record->new_id = new_id;
+  record->op = op;
+  record->flags = flags;
+  /* the count in the file always covers complete records only */
+  trace_map->count++;
+  return true;
+}
+
+void
+trace_append (trace_op_t op, block_size_t size, block_size_t id,
+              block_size_t new_id)
+{
+  uint64_t now = _trace_now ();
+
+  pthread_mutex_lock (&trace_lock);
+  _trace_put (now, op, size, id, new_id, 0);
+  pthread_mutex_unlock (&trace_lock);
+}
+
+void
+trace_append_batch (trace_op_t op, block_size_t size, void *const *ptrs,
+                    uint32_t n, void const *base)
+{
+  uint64_t now = _trace_now ();
+  uint64_t last = UINT64_MAX;
+
+  /* under one lock, so other threads' records cannot split the batch */
+  pthread_mutex_lock (&trace_lock);
+  for (uint32_t i = 0; i < n; ++i)
+    {
+      if (ptrs[i] == NULL)
+        {
+          continue;
+        }
+      block_size_t id = (uint8_t const *)ptrs[i] - (uint8_t const *)base;
+      if (!_trace_put (now, op, size, id, 0, TRACE_FLAG_BATCH_NEXT))
+        {
+          break;
+        }
+      last = trace_map->count - 1;
+    }
+  if (last != UINT64_MAX)
+    {
+      /* by index: growing the file may have moved the mapping */
+      ((trace_record_t *)(trace_map + 1))[last].flags = 0;
+    }
+  pthread_mutex_unlock (&trace_lock);
+}
@@ -42,19 +42,43 @@ rotl (const uint64_t x, int k)
 static uint64_t s[2] = { 0x562217302acf9a69, 0x2916753e667e5094 };
 
 uint64_t
-next (void)
+next_r (uint64_t state[2])
 {
-  const uint64_t s0 = s[0];
-  uint64_t s1 = s[1];
+  const uint64_t s0 = state[0];
+  uint64_t s1 = state[1];
   const uint64_t result = s0 + s1;
 
   s1 ^= s0;
-  s[0] = rotl (s0, 24) ^ s1 ^ (s1 << 16); // a, b
-  s[1] = rotl (s1, 37);                   // c
+  state[0] = rotl (s0, 24) ^ s1 ^ (s1 << 16); // a, b
+  state[1] = rotl (s1, 37);                   // c
 
   return result;
 }
 
+uint64_t
+next (void)
+{
+  return next_r (s);
+}
+
+/* splitmix64, which never yields two zero words in a row */
+static uint64_t
+splitmix64 (uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+void
+seed_r (uint64_t state[2], uint64_t seed)
+{
+  state[0] = splitmix64 (&seed);
+  state[1] = splitmix64 (&seed);
+}
+
 /* This is the jump function for the generator. It is equivalent
    to 2^64 calls to next(); it can be used to generate 2^64
    non-overlapping subsequences for parallel computations. */
@@ -0,0 +1,562 @@
+/*
+ * Replay a trace recorded with deep_mem_trace_start on a pool of any
+ * configuration, and report how long it took and how fragmented the pool
+ * got.
+ *
+ * Trace ids are first translated to dense slots, so the replay itself only
+ * indexes an array. Frees of blocks the trace never saw allocated (tracing
+ * started late) are skipped and reallocs of them replayed as mallocs;
+ * mallocs that failed when recorded are replayed and, if they succeed now,
+ * freed again straight away. Batch calls are replayed as batch calls. Like bench_suite, the trace is replayed twice: untimed for
+ * throughput, then with every operation timed for latency percentiles and
+ * with the pool's counters sampled for fragmentation.
+ *
+ * Reported:
+ *   ops/s         operations per second
+ *   p50..p999     latency of a single operation, in ns
+ *   peak frag     1 - peak requested bytes / peak footprint, where the
+ *                 footprint is the pool minus its untouched remainder,
+ *                 plus the blocks mapped on their own
+ *   max free frag highest mem_stats_t.fragmentation seen
+ *   failed        share of mallocs / reallocs returning NULL
+ *
+ * Usage: deep_replay [-s pool size] [-e skiplist|tlsf]
+ *                    [-z none|alloc|free] [-m mmap threshold] [-c] trace
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "deep_mem.h"
+#include "deep_trace.h"
+
+#define NO_SLOT (UINT32_MAX)
+#define STATS_INTERVAL (256)
+
+/* a trace record with its ids replaced by slots */
+typedef struct
+{
+  uint32_t slot;
+  block_size_t size;
+  uint32_t batch; /* ops in the batch call starting here, else 1 */
+  uint32_t alignment; /* of aligned allocations */
+  uint8_t op;
+} replay_op_t;
+
+/* id -> slot, open addressing with linear probing; id 0 marks empty */
+typedef struct
+{
+  block_size_t *ids;
+  uint32_t *slots;
+  uint32_t mask;
+  uint32_t count;
+} id_map_t;
+
+static replay_op_t *ops;
+static uint64_t op_count;
+static uint64_t op_counts[TRACE_OP_ALIGNED_ALLOC + 1];
+static uint64_t untracked;
+static void **slots;
+static block_size_t *slot_sizes;
+static uint32_t slot_count;
+static uint32_t *latencies;
+static void **batch_ptrs;
+static uint32_t max_batch;
+
+static void *pool_mem;
+static mem_pool_t *pool;
+static uint64_t pool_size;
+static mem_pool_config_t config;
+
+static inline uint32_t
+id_hash (id_map_t const *map, block_size_t id)
+{
+  return (uint32_t)(id * 2654435761u) & map->mask;
+}
+
+static void id_map_put (id_map_t *map, block_size_t id, uint32_t slot);
+
+static void
+id_map_grow (id_map_t *map)
+{
+  id_map_t old = *map;
+
+  map->mask = old.mask * 2 + 1;
+  map->count = 0;
+  map->ids = calloc ((size_t)map->mask + 1, sizeof (block_size_t));
+  map->slots = malloc (((size_t)map->mask + 1) * sizeof (uint32_t));
+  if (map->ids == NULL || map->slots == NULL)
+    {
+      fprintf (stderr, "out of memory\n");
+      exit (1);
+    }
+  for (uint32_t i = 0; i <= old.mask; i++)
+    {
+      if (old.ids[i] != 0)
+        {
+          id_map_put (map, old.ids[i], old.slots[i]);
+        }
+    }
+  free (old.ids);
+  free (old.slots);
+}
+
+static void
+id_map_put (id_map_t *map, block_size_t id, uint32_t slot)
+{
+  uint32_t i = id_hash (map, id);
+
+  if ((map->count + 1) * 2 > map->mask)
+    {
+      id_map_grow (map);
+      i = id_hash (map, id);
+    }
+  while (map->ids[i] != 0 && map->ids[i] != id)
+    {
+      i = (i + 1) & map->mask;
+    }
+  map->count += map->ids[i] == 0;
+  map->ids[i] = id;
+  map->slots[i] = slot;
+}
+
+/* remove `id` and return its slot, NO_SLOT if it is not there */
+static uint32_t
+id_map_take (id_map_t *map, block_size_t id)
+{
+  uint32_t i = id_hash (map, id), slot;
+
+  while (map->ids[i] != id)
+    {
+      if (map->ids[i] == 0)
+        {
+          return NO_SLOT;
+        }
+      i = (i + 1) & map->mask;
+    }
+  slot = map->slots[i];
+  map->count--;
+
+  /* shift later entries of the cluster back so no probe crosses a hole */
+  uint32_t hole = i;
+  for (uint32_t j = (i + 1) & map->mask; map->ids[j] != 0;
+       j = (j + 1) & map->mask)
+    {
+      uint32_t home = id_hash (map, map->ids[j]);
+      if (((j - home) & map->mask) >= ((j - hole) & map->mask))
+        {
+          map->ids[hole] = map->ids[j];
+          map->slots[hole] = map->slots[j];
+          hole = j;
+        }
+    }
+  map->ids[hole] = 0;
+  return slot;
+}
+
+/**
+ * Translate the `count` records at `records` into `ops`, allocating a slot
+ * per live block and reusing the slots of freed ones.
+ **/
+static void
+load_ops (trace_record_t const *records, uint64_t count)
+{
+  id_map_t map = { NULL, NULL, 1023, 0 };
+  uint32_t *free_slots = malloc (count * sizeof (uint32_t) + 1);
+  uint32_t free_count = 0;
+  uint64_t batch_start = 0;
+  bool in_batch = false;
+
+  map.ids = calloc (map.mask + 1, sizeof (block_size_t));
+  map.slots = malloc ((map.mask + 1) * sizeof (uint32_t));
+  ops = malloc (count * sizeof (replay_op_t) + 1);
+  if (free_slots == NULL || map.ids == NULL || map.slots == NULL
+      || ops == NULL)
+    {
+      fprintf (stderr, "out of memory\n");
+      exit (1);
+    }
+
+  for (uint64_t i = 0; i < count; i++)
+    {
+      trace_record_t const *r = &records[i];
+      replay_op_t op = { NO_SLOT, r->size, 1, 0, r->op };
+      block_size_t new_id = r->op == TRACE_OP_REALLOC ? r->new_id : r->id;
+
+      if (r->op < TRACE_OP_MALLOC || r->op > TRACE_OP_ALIGNED_ALLOC)
+        {
+          fprintf (stderr, "bad op %u in record %lu\n", r->op,
+                   (unsigned long)i);
+          exit (1);
+        }
+      if (!in_batch)
+        {
+          batch_start = op_count;
+        }
+      in_batch = (r->flags & TRACE_FLAG_BATCH_NEXT) != 0;
+      if (r->op == TRACE_OP_ALIGNED_ALLOC)
+        {
+          op.alignment = r->new_id;
+        }
+      if (r->op == TRACE_OP_FREE || (r->op == TRACE_OP_REALLOC && r->id != 0))
+        {
+          op.slot = id_map_take (&map, r->id);
+          if (op.slot == NO_SLOT)
+            {
+              untracked++;
+              if (r->op == TRACE_OP_FREE)
+                {
+                  continue;
+                }
+            }
+        }
+      if (r->op == TRACE_OP_REALLOC && op.slot == NO_SLOT)
+        {
+          /* realloc (NULL) or of an untracked block */
+          op.op = TRACE_OP_MALLOC;
+        }
+      if (op.op == TRACE_OP_FREE
+          || (op.op == TRACE_OP_REALLOC && r->size == 0))
+        {
+          free_slots[free_count++] = op.slot;
+        }
+      else if (new_id != 0)
+        {
+          if (op.slot == NO_SLOT)
+            {
+              op.slot = free_count > 0 ? free_slots[--free_count]
+                                       : slot_count++;
+            }
+          id_map_put (&map, new_id, op.slot);
+        }
+      else if (op.slot != NO_SLOT)
+        {
+          /* a failed realloc leaves the block where it was */
+          id_map_put (&map, r->id, op.slot);
+        }
+      op_counts[r->op]++;
+      ops[op_count++] = op;
+      if (op_count - batch_start > 1)
+        {
+          ops[batch_start].batch = op_count - batch_start;
+          max_batch = ops[batch_start].batch > max_batch
+                          ? ops[batch_start].batch
+                          : max_batch;
+        }
+    }
+
+  free (map.ids);
+  free (map.slots);
+  free (free_slots);
+}
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int
+compare_u32 (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Replay the whole batch starting at `batch`, which gives ops of one kind.
+ * Returns how many blocks that should have been allocated were not.
+ **/
+static uint32_t
+replay_batch (replay_op_t const *batch)
+{
+  uint32_t n = batch->batch, count = n;
+
+  if (batch->op == TRACE_OP_FREE)
+    {
+      for (uint32_t i = 0; i < n; i++)
+        {
+          batch_ptrs[i] = slots[batch[i].slot];
+          slots[batch[i].slot] = NULL;
+        }
+      deep_pool_free_batch (pool, batch_ptrs, n);
+      return 0;
+    }
+
+  count = deep_pool_malloc_batch (pool, batch->size, n, batch_ptrs);
+  for (uint32_t i = 0; i < n; i++)
+    {
+      slots[batch[i].slot] = i < count ? batch_ptrs[i] : NULL;
+    }
+  return n - count;
+}
+
+/* returns whether a malloc / realloc that should succeed failed */
+static inline bool
+replay_op (replay_op_t op)
+{
+  void *ptr;
+
+  switch (op.op)
+    {
+    case TRACE_OP_MALLOC:
+    case TRACE_OP_CALLOC:
+      ptr = op.op == TRACE_OP_MALLOC ? deep_pool_malloc (pool, op.size)
+                                     : deep_pool_calloc (pool, 1, op.size);
+      if (op.slot == NO_SLOT)
+        {
+          /* failed when recorded, so nothing refers to it later */
+          deep_pool_free (pool, ptr);
+          return ptr == NULL;
+        }
+      slots[op.slot] = ptr;
+      return ptr == NULL;
+    case TRACE_OP_ALIGNED_ALLOC:
+      ptr = deep_pool_aligned_alloc (pool, op.alignment, op.size);
+      if (op.slot == NO_SLOT)
+        {
+          deep_pool_free (pool, ptr);
+          return ptr == NULL;
+        }
+      slots[op.slot] = ptr;
+      return ptr == NULL;
+    case TRACE_OP_REALLOC:
+      ptr = deep_pool_realloc (pool, slots[op.slot], op.size);
+      if (ptr != NULL || op.size == 0)
+        {
+          slots[op.slot] = ptr;
+        }
+      return ptr == NULL && op.size != 0;
+    default:
+      deep_pool_free (pool, slots[op.slot]);
+      slots[op.slot] = NULL;
+      return false;
+    }
+}
+
+static void
+reset_pool (void)
+{
+  /* unmaps what the last run left mapped */
+  deep_pool_destroy (pool);
+  pool = deep_pool_init_with_config (pool_mem, pool_size, &config);
+  if (pool == NULL)
+    {
+      fprintf (stderr, "cannot set up a %lu-byte pool\n",
+               (unsigned long)pool_size);
+      exit (1);
+    }
+  memset (slots, 0, (size_t)slot_count * sizeof (void *));
+  memset (slot_sizes, 0, (size_t)slot_count * sizeof (block_size_t));
+}
+
+static uint64_t
+replay_untimed (void)
+{
+  uint64_t failures = 0;
+
+  reset_pool ();
+  for (uint64_t i = 0; i < op_count; i += ops[i].batch)
+    {
+      failures += ops[i].batch > 1 ? replay_batch (&ops[i]) : replay_op (ops[i]);
+    }
+  return failures;
+}
+
+static void
+replay_timed (double *peak_frag, double *max_free_frag)
+{
+  uint64_t live = 0, peak_live = 0, peak_footprint = 0, next_sample = 0;
+  mem_stats_t stats;
+
+  *max_free_frag = 0;
+  reset_pool ();
+  for (uint64_t i = 0; i < op_count; i += ops[i].batch)
+    {
+      uint32_t n = ops[i].batch;
+      bool failed;
+
+      uint64_t start = now_ns ();
+      failed = n > 1 ? replay_batch (&ops[i]) : replay_op (ops[i]);
+      /* a batch call counts as `n` operations of the average latency */
+      uint32_t latency = (now_ns () - start) / n;
+
+      for (uint64_t j = i; j < i + n; j++)
+        {
+          replay_op_t op = ops[j];
+          latencies[j] = latency;
+          /* keep the requested bytes of every live block; a failed
+             realloc leaves its block as it was */
+          if (op.slot != NO_SLOT && !(failed && op.op == TRACE_OP_REALLOC))
+            {
+              live -= slot_sizes[op.slot];
+              slot_sizes[op.slot] = slots[op.slot] != NULL ? op.size : 0;
+              live += slot_sizes[op.slot];
+            }
+        }
+
+      if (i >= next_sample)
+        {
+          next_sample = i + STATS_INTERVAL;
+          deep_pool_stats (pool, &stats);
+          uint64_t footprint = stats.total_bytes - stats.remainder_bytes
+                               + stats.mapped_bytes;
+          peak_live = live > peak_live ? live : peak_live;
+          peak_footprint
+              = footprint > peak_footprint ? footprint : peak_footprint;
+          *max_free_frag = stats.fragmentation > *max_free_frag
+                               ? stats.fragmentation
+                               : *max_free_frag;
+        }
+    }
+  *peak_frag
+      = peak_footprint == 0 ? 0 : 1.0 - (double)peak_live / peak_footprint;
+}
+
+static void
+usage (char const *name)
+{
+  fprintf (stderr,
+           "usage: %s [-s pool size] [-e skiplist|tlsf] "
+           "[-z none|alloc|free] [-m mmap threshold] [-c] trace\n",
+           name);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct stat st;
+  trace_header_t const *header;
+  int opt, fd;
+
+  while ((opt = getopt (argc, argv, "s:e:z:m:c")) != -1)
+    {
+      switch (opt)
+        {
+        case 's':
+          pool_size = strtoull (optarg, NULL, 0);
+          break;
+        case 'e':
+          if (strcmp (optarg, "skiplist") == 0)
+            config.engine = MEM_ENGINE_SKIPLIST;
+          else if (strcmp (optarg, "tlsf") == 0)
+            config.engine = MEM_ENGINE_TLSF;
+          else
+            usage (argv[0]);
+          break;
+        case 'z':
+          if (strcmp (optarg, "none") == 0)
+            config.zero = MEM_ZERO_NONE;
+          else if (strcmp (optarg, "alloc") == 0)
+            config.zero = MEM_ZERO_ON_ALLOC;
+          else if (strcmp (optarg, "free") == 0)
+            config.zero = MEM_ZERO_ON_FREE;
+          else
+            usage (argv[0]);
+          break;
+        case 'm':
+          config.mmap_threshold = strtoull (optarg, NULL, 0);
+          break;
+        case 'c':
+          config.concurrent = true;
+          break;
+        default:
+          usage (argv[0]);
+        }
+    }
+  if (optind != argc - 1)
+    {
+      usage (argv[0]);
+    }
+
+  if ((fd = open (argv[optind], O_RDONLY)) < 0 || fstat (fd, &st) != 0
+      || (size_t)st.st_size < sizeof (trace_header_t))
+    {
+      perror (argv[optind]);
+      return 1;
+    }
+  header = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (header == MAP_FAILED
+      || memcmp (header->magic, TRACE_MAGIC, sizeof (header->magic)) != 0
+      || header->record_size != sizeof (trace_record_t)
+      || header->count
+             > (st.st_size - sizeof (trace_header_t)) / sizeof (trace_record_t))
+    {
+      fprintf (stderr, "%s: not a deep_mem trace\n", argv[optind]);
+      return 1;
+    }
+  if (pool_size == 0)
+    {
+      pool_size = header->pool_size;
+    }
+  if (pool_size > POOL_MAX_SIZE)
+    {
+      fprintf (stderr, "pool size %lu too big\n", (unsigned long)pool_size);
+      return 1;
+    }
+
+  trace_record_t const *records = (trace_record_t const *)(header + 1);
+  load_ops (records, header->count);
+  slots = malloc ((size_t)slot_count * sizeof (void *) + 1);
+  slot_sizes = calloc ((size_t)slot_count + 1, sizeof (block_size_t));
+  latencies = malloc (op_count * sizeof (uint32_t) + 1);
+  batch_ptrs = malloc ((size_t)max_batch * sizeof (void *) + 1);
+  /* aligned allocations only land where they did if the pool is aligned
+     the same way as the recorded one, which is likeliest page-aligned */
+  pool_mem = aligned_alloc (ALIGNED_ALLOC_MAX_ALIGNMENT,
+                            (pool_size + ALIGNED_ALLOC_MAX_ALIGNMENT - 1)
+                                & -(uint64_t)ALIGNED_ALLOC_MAX_ALIGNMENT);
+  if (slots == NULL || slot_sizes == NULL || latencies == NULL
+      || batch_ptrs == NULL || pool_mem == NULL)
+    {
+      fprintf (stderr, "out of memory\n");
+      return 1;
+    }
+
+  printf ("%s: %lu ops over %.3f s (%lu malloc, %lu calloc, %lu realloc, "
+          "%lu free, %lu aligned), %lu untracked, %u blocks live at most\n",
+          argv[optind], (unsigned long)op_count,
+          header->count == 0 ? 0 : records[header->count - 1].timestamp / 1e9,
+          (unsigned long)op_counts[TRACE_OP_MALLOC],
+          (unsigned long)op_counts[TRACE_OP_CALLOC],
+          (unsigned long)op_counts[TRACE_OP_REALLOC],
+          (unsigned long)op_counts[TRACE_OP_FREE],
+          (unsigned long)op_counts[TRACE_OP_ALIGNED_ALLOC],
+          (unsigned long)untracked,
+          slot_count);
+  if (op_count == 0)
+    {
+      return 0;
+    }
+
+  uint64_t start = now_ns ();
+  uint64_t failures = replay_untimed ();
+  double seconds = (now_ns () - start) / 1e9;
+  double peak_frag, max_free_frag;
+  replay_timed (&peak_frag, &max_free_frag);
+  qsort (latencies, op_count, sizeof (uint32_t), compare_u32);
+
+  uint64_t allocs = op_count - op_counts[TRACE_OP_FREE];
+  printf ("%12s %7s %7s %7s %10s %14s %10s\n", "ops/s", "p50", "p99", "p999",
+          "peak frag", "max free frag", "failed");
+  printf ("%12.0f %7u %7u %7u %9.1f%% %13.1f%% %9.3f%%\n", op_count / seconds,
+          latencies[op_count / 2], latencies[op_count * 99 / 100],
+          latencies[op_count * 999 / 1000], 100 * peak_frag,
+          100 * max_free_frag,
+          allocs == 0 ? 0 : 100.0 * failures / allocs);
+
+  free (pool_mem);
+  munmap ((void *)header, st.st_size);
+  close (fd);
+  return 0;
+}